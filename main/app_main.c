@@ -11,6 +11,8 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
+#include <ctype.h>
+#include <math.h>
 #include "esp_wifi.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
@@ -30,11 +32,29 @@
 #include "dht.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_ota_ops.h"
 #include "mqtt_client.h"
+#ifdef CONFIG_MQTT_TLS_CRT_BUNDLE
+#include "esp_crt_bundle.h"
+#endif
 #include "cJSON.h"
 
 #include "my_wifi_station.h"
 #include "optmed.h"
+#include "plant_log.h"
+#include "plant_trace.h"
+#include "sensor_stats.h"
+#include "plant_ota.h"
+#include "plant_link.h"
+#include "plant_gateway.h"
+#include "plant_energy.h"
+#include "plant_dosing.h"
+#include "plant_state.h"
+#include "sensor_schedule.h"
+#include "sensor_driver.h"
+#include "plant_synthetic.h"
+#include "pump_safety.h"
 
 #define STORAGE_NAMESPACE "storage"
 
@@ -43,27 +63,63 @@ static const char *TAG = "MQTT_EXAMPLE";
 /* LOCAL GLOBALS = BAD */
 static bool mqtt_connected = false;  // Indicates if MQTT is connected to broker
 static bool enable_pump = true;      // If false, pump will not operate (for testing)
-static bool use_fake_poll = false;   // If true, uses the following fake data during polling (for testing)
-static uint32_t fake_moisture = 0;   // fake moisture value to return during polling (for testing)
-static uint32_t fake_level = 0;      // fake level value to return during polling (for testing)
+#ifdef CONFIG_PLANT_SYNTHETIC_SENSORS
+static bool use_fake_poll = true;    // If true, polling returns synthetic sensor data (for testing)
+#else
+static bool use_fake_poll = false;   // If true, polling returns synthetic sensor data (for testing)
+#endif
+static bool publish_requested = false;                // If true, the next control loop pass polls and publishes immediately
+static esp_mqtt_client_handle_t mqtt_client = NULL;   // Set by the network startup task once the client is created
+static char device_id[PLANT_LINK_ID_SIZE];            // Station MAC in hex
+static char mqtt_client_id[32];                       // "plant_thing_" + device_id
+static uint64_t mqtt_connect_start_us = 0;            // Start of the current (re)connect attempt
+static uint32_t mqtt_connect_count = 0;
+static bool trace_enabled = false;                    // If true, raw sensor polls are recorded to pt/<id>/trace
+#if CONFIG_PLANT_ROLE_NODE
+static bool link_ready = false;                       // ESP-NOW link up, telemetry goes to the gateway instead of MQTT
+static uint8_t link_gateway_addr[PLANT_LINK_ADDR_LEN];
+static uint16_t link_seq = 0;                         // Of frames sent to the gateway
+static int32_t link_last_command_seq = -1;            // Of the last command from the gateway, to drop retransmissions
+#endif
 
 #define MOISTURE_SENSOR_DRY 720      // Sensor value from calibration - read while sensor dry and in air
 #define MOISTURE_SENSOR_WET 2616     // Sensor value from calibration - read while sensor wet and in a glass of water
 #define SEC_IN_MICROSEC 1000000ull   // Conversion factor
-#define PLANT_NVS_KEY "plant"
+#define PLANT_NVS_KEY "plant"               // NVS key of plant 0, further plants append their index
+#define PLANT_TRACE_BUFFER_SIZE 1024        // Trace records are published in batches of this many bytes
+#define TELEMETRY_MOISTURE_DEADBAND 20      // Sensor counts (~1%) moisture must move before it is republished
+#define TELEMETRY_LEVEL_DEADBAND 100        // Sensor counts the level must move before it is republished
+#define TELEMETRY_TEMPERATURE_DEADBAND 0.5f // Degrees C
+#define TELEMETRY_HUMIDITY_DEADBAND 2.0f    // Percent RH
+#define TELEMETRY_HEARTBEAT_S (15*60)       // Publish at least this often even if nothing changed
+#define STATS_SUMMARY_POLLS 30              // Polls per published sensor statistics summary
+#define PLANT_COUNT CONFIG_PLANT_COUNT      // Number of plants driven by this board
+#define PLANT_SCHEDULER_MIN_SLEEP_US 100000ull    // Minimum scheduler sleep after a state change
+#define PLANT_SCHEDULER_MAX_SLEEP_US SEC_IN_MICROSEC  // Upper bound on scheduler sleep
+#if CONFIG_PLANT_LEARNED_DOSING
+#define PLANT_LEARNED_MAX_PULSE_S CONFIG_PLANT_DOSING_MAX_PULSE_S   // Pulses sized from the learned gain
+#else
+#define PLANT_LEARNED_MAX_PULSE_S 0                                 // Fixed pump_on_period_s pulses
+#endif
+#define LEVEL_SENSOR_EMPTY 2048              // Level sensor reading at or below which the reservoir is treated as empty
+#define PUMP_SAFETY_SAMPLE_PERIOD_US 2000    // Level sampling period while the pump is running
+#define ENERGY_REPORT_PERIOD_S (60*60)       // Energy metrics publish period
+#define LEVEL_SAMPLE_PERIOD_US SEC_IN_MICROSEC    // Reservoir level sampling period, keeps the pre-pump check fresh
+#define DHT_SAMPLE_PERIOD_US (60*SEC_IN_MICROSEC) // Temperature and humidity sampling period (DHT11 needs >= 1 s)
 
 #define MOISTURE_SENSOR_VALUE_FROM_RATIO(x) (x * (MOISTURE_SENSOR_WET - MOISTURE_SENSOR_DRY) + MOISTURE_SENSOR_DRY)
 #define RATIO_FROM_MOISTURE_SENSOR_VALUE(x) ((x - MOISTURE_SENSOR_DRY) / ((float) (MOISTURE_SENSOR_WET - MOISTURE_SENSOR_DRY)))
 
-enum PlantStates{
-    PLANT_DRYING = 0,
-    PLANT_PUMP_DELAY = 1,
-    PLANT_PUMP_ON = 2,
-    PLANT_WET_HOLD = 3,
-    PLANT_DRY_HOLD = 4,
-    PLANT_ALARM = 5
+// What a plant uses each of its sensors for (see the sensor sources below)
+enum SensorRoles{
+    SENSOR_ROLE_MOISTURE = 0,
+    SENSOR_ROLE_LEVEL,
+    SENSOR_ROLE_ENVIRONMENT,
+    SENSOR_ROLE_COUNT
 };
 
+struct sensor_source_struct;
+
 const char* PlantStateString[] = {
     "DRYING",
     "PUMP_DELAY",
@@ -82,28 +138,42 @@ struct plant_pin_config_struct{
     gpio_num_t dht_gpio_pin;
 };
 
-// Watering Algorithm Parameters for plant
-struct plant_watering_config_struct{
-    uint16_t low_moisture;
-    uint16_t watered_moisture;
-    uint16_t high_moisture;
-    uint16_t polling_period_s;
-    uint16_t pump_on_period_s;
-    uint16_t pump_off_period_s;
-    uint16_t wet_hold_period_s;
-    uint16_t dry_hold_period_s;
-};
-
 // Plant State and Status info
 struct plant_status_struct{
     uint16_t poll_median_moisture_sensor;
     uint16_t poll_median_level_sensor;
     float poll_temperature;
     float poll_humidity;
-    uint64_t state_entry_time_us;
     uint64_t last_poll_time_us;
-    enum PlantStates state;
+    struct plant_state_struct machine;  // Watering state machine (plant_state.h)
     bool initialized;
+    // Pump safety cutoff - written by the safety timer while the pump runs
+    esp_timer_handle_t pump_safety_timer;
+    volatile bool pump_running;
+    volatile bool pump_safety_tripped;
+    uint16_t pump_safety_level;         // Filtered level reading that tripped the cutoff
+    uint32_t pump_safety_latency_us;    // First empty sample to pump off
+    struct pump_safety_struct pump_safety;
+    uint64_t pump_on_start_us;
+    uint64_t pump_on_total_us;          // Pump run time since boot
+    struct plant_synthetic_struct synthetic;    // Synthetic soil model state (fake polling only)
+    // Raw sample statistics and SENSOR_FAULT_* flags from the latest poll
+    struct sensor_stats_struct moisture_stats;
+    struct sensor_stats_struct level_stats;
+    uint8_t moisture_faults;
+    uint8_t level_faults;
+    uint16_t stats_polls;
+    uint64_t level_stats_time_us;       // Level burst last added to level_stats
+    // Last published telemetry, for change-only publishing
+    uint16_t published_moisture_sensor;
+    uint16_t published_level_sensor;
+    float published_temperature;
+    float published_humidity;
+    enum PlantStates published_state;
+    uint8_t published_faults;
+    uint64_t last_publish_time_us;      // 0 = nothing published yet
+    // Source of each sensor role, resolved once by initSensorSources
+    struct sensor_source_struct *sensor_sources[SENSOR_ROLE_COUNT];
 };
 
 // All plant parameters
@@ -137,10 +207,13 @@ void print_plant_status_struct(const struct plant_status_struct *status, const c
     printf("%spoll_median_level_sensor    = %d\n", prefix, status->poll_median_level_sensor);
     printf("%spoll_temperature            = %0.1f\n", prefix, status->poll_temperature);
     printf("%spoll_humidity               = %0.1f\n", prefix, status->poll_humidity);
-    printf("%sstate_entry_time_us         = %llu\n", prefix, status->state_entry_time_us);
+    printf("%sstate_entry_time_us         = %llu\n", prefix, status->machine.state_entry_time_us);
     printf("%slast_poll_time_us           = %llu\n", prefix, status->last_poll_time_us);
-    printf("%sstate                       = %d (%s)\n", prefix, status->state, PlantStateString[status->state]);
+    printf("%sstate                       = %d (%s)\n", prefix, status->machine.state, PlantStateString[status->machine.state]);
     printf("%sinitialized                 = %d\n", prefix, status->initialized);
+    printf("%spump_safety_tripped         = %d\n", prefix, status->pump_safety_tripped);
+    printf("%smoisture_faults             = 0x%x\n", prefix, status->moisture_faults);
+    printf("%slevel_faults                = 0x%x\n", prefix, status->level_faults);
 }
 
 void print_plant_struct(const struct plant_struct *plant){
@@ -157,10 +230,22 @@ const struct plant_status_struct plant_status_struct_default = {
     // State values
     .poll_median_moisture_sensor = 0,
     .poll_median_level_sensor = 0,
-    .state_entry_time_us = 0,
     .last_poll_time_us = 0,
-    .state = PLANT_DRYING,
-    .initialized = false
+    .machine = { .state = PLANT_DRYING },
+    .initialized = false,
+    .pump_safety_timer = NULL,
+    .pump_running = false,
+    .pump_safety_tripped = false,
+    .pump_safety_level = 0,
+    .pump_safety_latency_us = 0,
+    .pump_safety = {0},
+    .pump_on_start_us = 0,
+    .pump_on_total_us = 0,
+    .synthetic = {0},
+    .moisture_faults = 0,
+    .level_faults = 0,
+    .stats_polls = 0,
+    .last_publish_time_us = 0
 };
 
 // Default plant values
@@ -185,15 +270,135 @@ const struct plant_struct plant_default = {
     .status = plant_status_struct_default
 };
 
-// Global plant structure...  :(  Made it global so it can be modified by the mqtt thread.  Refactor this some day
-struct plant_struct global_plant = plant_default;
+// Default pins per plant slot.  Plants share the reservoir level sensor and the DHT, and each
+// gets its own moisture channel and pump.  ADC1 channels 1 and 2 are only bonded out on some modules.
+const struct plant_pin_config_struct plant_pin_defaults[] = {
+    { ADC1_CHANNEL_4, ADC1_CHANNEL_5, GPIO_NUM_18, GPIO_NUM_19 },
+    { ADC1_CHANNEL_6, ADC1_CHANNEL_5, GPIO_NUM_21, GPIO_NUM_19 },
+    { ADC1_CHANNEL_7, ADC1_CHANNEL_5, GPIO_NUM_22, GPIO_NUM_19 },
+    { ADC1_CHANNEL_0, ADC1_CHANNEL_5, GPIO_NUM_23, GPIO_NUM_19 },
+    { ADC1_CHANNEL_3, ADC1_CHANNEL_5, GPIO_NUM_25, GPIO_NUM_19 },
+    { ADC1_CHANNEL_1, ADC1_CHANNEL_5, GPIO_NUM_26, GPIO_NUM_19 },
+    { ADC1_CHANNEL_2, ADC1_CHANNEL_5, GPIO_NUM_27, GPIO_NUM_19 },
+};
+_Static_assert(PLANT_COUNT <= sizeof(plant_pin_defaults) / sizeof(plant_pin_defaults[0]), "No default pins for PLANT_COUNT plants");
+
+// Boot phase timestamps (us since boot), published once so time-to-control and
+// time-to-first-publish can be compared across firmware versions
+struct boot_timing_struct{
+    uint64_t nvs_ready_us;
+    uint64_t control_start_us;
+    uint64_t network_init_done_us;
+    uint64_t wifi_got_ip_us;
+    uint64_t mqtt_connected_us;
+    uint64_t first_publish_us;
+    bool reported;
+};
+
+static struct boot_timing_struct boot_timing = {0};
+
+// MQTT topics, all under this device's "pt/<device_id>/" namespace and built once at startup
+struct device_topics_struct{
+    char cmd[32];           // Commands to the device
+    char rsp[32];           // Command responses, tagged with the command's correlation id
+    char alarm[32];
+    char metrics[32];       // Boot and connect timing, "type" field tells them apart
+    char trace[32];
+};
+
+static struct device_topics_struct topics;
+
+// Plant registry - one contiguous entry per pot on this board, serviced in order by the
+// scheduler.  Global so it can be modified by the mqtt thread.
+struct plant_struct plants[PLANT_COUNT];
+static char plant_nvs_keys[PLANT_COUNT][16];
+static char plant_telemetry_topics[PLANT_COUNT][32];
+static char plant_stats_topics[PLANT_COUNT][32];
+static struct plant_dosing_struct plant_dosing[PLANT_COUNT];   // Learned per pot, persisted separately from the plant blob
+static char plant_dosing_nvs_keys[PLANT_COUNT][16];
+
+static TaskHandle_t plant_scheduler_task = NULL;   // Woken early by events that need the control loop
+
+static inline int plant_index(const struct plant_struct *plant){
+    return plant - plants;
+}
+
+void initPlantRegistry(void)
+{
+    for(int i = 0; i < PLANT_COUNT; i++)
+    {
+        plants[i] = plant_default;
+        plants[i].pins = plant_pin_defaults[i];
+        if(i == 0){
+            snprintf(plant_nvs_keys[i], sizeof(plant_nvs_keys[i]), "%s", PLANT_NVS_KEY);
+        }else{
+            snprintf(plant_nvs_keys[i], sizeof(plant_nvs_keys[i]), "%s%d", PLANT_NVS_KEY, i);
+        }
+        snprintf(plant_telemetry_topics[i], sizeof(plant_telemetry_topics[i]), "pt/%s/tele/%d", device_id, i);
+        snprintf(plant_stats_topics[i], sizeof(plant_stats_topics[i]), "pt/%s/stats/%d", device_id, i);
+        snprintf(plant_dosing_nvs_keys[i], sizeof(plant_dosing_nvs_keys[i]), "dose%d", i);
+    }
+}
+
+void wakePlantScheduler(void)
+{
+    if(plant_scheduler_task){
+        xTaskNotifyGive(plant_scheduler_task);
+    }
+}
 
 esp_err_t store_plant_to_nvs(struct plant_struct *plant, const char *nvs_key);
 
 
-// Processes JSON data received from mqtt in the following formats
+// All MQTT publishes go through here so their radio cost is accounted
+static int mqttPublish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain)
+{
+    plant_energy_count(PLANT_ENERGY_PUBLISH, 1);
+    plant_energy_count(PLANT_ENERGY_TX_BYTE, len ? len : strlen(data));
+    return esp_mqtt_client_publish(client, topic, data, len, qos, retain);
+}
+
+// Sends response text to the rsp topic, through the gateway on sensor nodes
+static void send_response_text(esp_mqtt_client_handle_t client, const char *text)
+{
+#if CONFIG_PLANT_ROLE_NODE
+    uint8_t frame[PLANT_LINK_MAX_FRAME];
+    struct plant_link_header_struct header = { .magic = PLANT_LINK_MAGIC, .type = PLANT_LINK_RESPONSE, .seq = link_seq++ };
+    size_t len = strnlen(text, PLANT_LINK_MAX_TEXT);
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), text, len);
+    plant_energy_count(PLANT_ENERGY_LINK_FRAME, 1);
+    plant_link_espnow.send(plant_link_espnow.ctx, link_gateway_addr, frame, sizeof(header) + len);
+#else
+    mqttPublish(client, topics.rsp, text, 0, 0, 0);
+#endif
+}
+
+// Publishes a command response, tagged with the command's correlation id when it had one
+static void publish_response(esp_mqtt_client_handle_t client, const cJSON *id, const char *text)
+{
+    if(id == NULL){
+        send_response_text(client, text);
+        return;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddItemToObject(root, "id", cJSON_Duplicate(id, true));
+    cJSON_AddStringToObject(root, "rsp", text);
+    char *my_json_string = cJSON_PrintUnformatted(root);
+    send_response_text(client, my_json_string);
+    free(my_json_string);
+    cJSON_Delete(root);
+}
+
+// Processes JSON data received from mqtt in the following formats.  "plant" selects the plant
+// (default 0), "id" is an optional correlation id echoed in the response, and "query <n>"
+// returns the config of plant n.  {"ota":{"size":N,"sha256":"<hex>"}} starts a delta OTA update
+// (plant_ota.h).
 /*
 {
+    "id": 42,
+    "plant": 0,
     "config":{ 
         "low_moisture":       0.80, 
         "watered_moisture":   0.92, 
@@ -206,45 +411,78 @@ esp_err_t store_plant_to_nvs(struct plant_struct *plant, const char *nvs_key);
     }
 }
 */
-void process_mqqt_data(esp_mqtt_event_handle_t event)
+void process_mqqt_data(esp_mqtt_client_handle_t client, const char *data)
 {
-    esp_mqtt_client_handle_t client = event->client;
-    cJSON *json = cJSON_Parse(event->data);
+    cJSON *json = cJSON_Parse(data);
     
-    if(0 == strncmp("query", event->data, sizeof("query")-1)){
+    if(0 == strncmp("trace ", data, sizeof("trace ")-1)){
+        trace_enabled = (0 == strncmp("on", data + sizeof("trace ")-1, 2));
+        publish_response(client, NULL, trace_enabled ? "TRACE ON" : "TRACE OFF");
+        if(!trace_enabled){
+            wakePlantScheduler();   // The scheduler task owns the trace buffer and flushes it
+        }
+    }
+    else if(0 == strncmp("query", data, sizeof("query")-1)){
         static char query_rsp[2048];
+        int index = atoi(data + sizeof("query")-1);
+        if(index < 0 || index >= PLANT_COUNT){
+            publish_response(client, NULL, "Unknown plant");
+            cJSON_Delete(json);
+            return;
+        }
+        struct plant_struct *plant = &plants[index];
+        // Compact so it also fits in one link frame on sensor nodes
         sprintf(query_rsp, 
-            "{\n"
-            "     \"config\":{ \n"
-            "         \"low_moisture\":       %0.2f, \n"
-            "         \"watered_moisture\":   %0.2f, \n"
-            "         \"high_moisture\":      %0.2f, \n"
-            "         \"polling_period_s\":   %d, \n"
-            "         \"pump_on_period_s\":   %d, \n"
-            "         \"pump_off_period_s\":  %d, \n"
-            "         \"wet_hold_period_s\":  %d, \n"
-            "         \"dry_hold_period_s\":  %d \n"
-            "    }\n"
-            "}\n", 
-            RATIO_FROM_MOISTURE_SENSOR_VALUE(global_plant.config.low_moisture), 
-            RATIO_FROM_MOISTURE_SENSOR_VALUE(global_plant.config.watered_moisture), 
-            RATIO_FROM_MOISTURE_SENSOR_VALUE(global_plant.config.high_moisture), 
-            global_plant.config.polling_period_s, 
-            global_plant.config.pump_on_period_s, 
-            global_plant.config.pump_off_period_s, 
-            global_plant.config.wet_hold_period_s, 
-            global_plant.config.dry_hold_period_s );
-        esp_mqtt_client_publish(client, "/topic/qos1", query_rsp, 0, 0, 0);
+            "{"
+                "\"plant\":%d,"
+                "\"config\":{"
+                    "\"low_moisture\":%0.2f,"
+                    "\"watered_moisture\":%0.2f,"
+                    "\"high_moisture\":%0.2f,"
+                    "\"polling_period_s\":%d,"
+                    "\"pump_on_period_s\":%d,"
+                    "\"pump_off_period_s\":%d,"
+                    "\"wet_hold_period_s\":%d,"
+                    "\"dry_hold_period_s\":%d"
+                "}"
+            "}", 
+            index,
+            RATIO_FROM_MOISTURE_SENSOR_VALUE(plant->config.low_moisture), 
+            RATIO_FROM_MOISTURE_SENSOR_VALUE(plant->config.watered_moisture), 
+            RATIO_FROM_MOISTURE_SENSOR_VALUE(plant->config.high_moisture), 
+            plant->config.polling_period_s, 
+            plant->config.pump_on_period_s, 
+            plant->config.pump_off_period_s, 
+            plant->config.wet_hold_period_s, 
+            plant->config.dry_hold_period_s );
+        publish_response(client, NULL, query_rsp);
     }
     else if(json == NULL){
         ESP_LOGW(TAG, "Parse Error");
-        esp_mqtt_client_publish(client, "/topic/qos1", "JSON PARSE ERROR", 0, 0, 0);
+        publish_response(client, NULL, "JSON PARSE ERROR");
     }else{
         ESP_LOGI(TAG, "Parsed");
         cJSON *config = cJSON_GetObjectItemCaseSensitive(json, "config");
+        cJSON *plant_item = cJSON_GetObjectItemCaseSensitive(json, "plant");
+        cJSON *id = cJSON_GetObjectItemCaseSensitive(json, "id");
+        cJSON *ota = cJSON_GetObjectItemCaseSensitive(json, "ota");
+        int index = cJSON_IsNumber(plant_item) ? plant_item->valueint : 0;
         
         // Parse config structure
-        if(cJSON_IsObject(config)){
+        if(index < 0 || index >= PLANT_COUNT){
+            publish_response(client, id, "Unknown plant");
+        }
+        else if(cJSON_IsObject(ota)){
+            cJSON *size_item = cJSON_GetObjectItemCaseSensitive(ota, "size");
+            cJSON *sha256_item = cJSON_GetObjectItemCaseSensitive(ota, "sha256");
+            if(cJSON_IsNumber(size_item) && size_item->valuedouble > 0 && cJSON_IsString(sha256_item)){
+                publish_response(client, id, plant_ota_start(client, size_item->valuedouble, sha256_item->valuestring));
+            }else{
+                publish_response(client, id, "OTA REJECTED - Parse Failed");
+            }
+        }
+        else if(cJSON_IsObject(config)){
+            struct plant_struct *plant = &plants[index];
             cJSON *low_moisture_item = cJSON_GetObjectItemCaseSensitive(config, "low_moisture");
             cJSON *watered_moisture_item = cJSON_GetObjectItemCaseSensitive(config, "watered_moisture");
             cJSON *high_moisture_item = cJSON_GetObjectItemCaseSensitive(config, "high_moisture");
@@ -274,33 +512,189 @@ void process_mqqt_data(esp_mqtt_event_handle_t event)
                     dry_hold_period_s_item->valueint > 0)
                 {
                     // Use these parameters and store in flash
-                    global_plant.config.low_moisture = MOISTURE_SENSOR_VALUE_FROM_RATIO(low_moisture_item->valuedouble);
-                    global_plant.config.watered_moisture = MOISTURE_SENSOR_VALUE_FROM_RATIO(watered_moisture_item->valuedouble);
-                    global_plant.config.high_moisture = MOISTURE_SENSOR_VALUE_FROM_RATIO(high_moisture_item->valuedouble);
-                    global_plant.config.polling_period_s = polling_period_s_item->valueint;
-                    global_plant.config.pump_on_period_s = pump_on_period_s_item->valueint;;
-                    global_plant.config.pump_off_period_s = pump_off_period_s_item->valueint;
-                    global_plant.config.wet_hold_period_s = wet_hold_period_s_item->valueint;
-                    global_plant.config.dry_hold_period_s = dry_hold_period_s_item->valueint;
-
-                    ESP_ERROR_CHECK(store_plant_to_nvs(&global_plant, PLANT_NVS_KEY));
-                    esp_mqtt_client_publish(client, "/topic/qos1", "CONFIG ACCEPTED", 0, 0, 0);
+                    plant->config.low_moisture = MOISTURE_SENSOR_VALUE_FROM_RATIO(low_moisture_item->valuedouble);
+                    plant->config.watered_moisture = MOISTURE_SENSOR_VALUE_FROM_RATIO(watered_moisture_item->valuedouble);
+                    plant->config.high_moisture = MOISTURE_SENSOR_VALUE_FROM_RATIO(high_moisture_item->valuedouble);
+                    plant->config.polling_period_s = polling_period_s_item->valueint;
+                    plant->config.pump_on_period_s = pump_on_period_s_item->valueint;;
+                    plant->config.pump_off_period_s = pump_off_period_s_item->valueint;
+                    plant->config.wet_hold_period_s = wet_hold_period_s_item->valueint;
+                    plant->config.dry_hold_period_s = dry_hold_period_s_item->valueint;
+
+                    ESP_ERROR_CHECK(store_plant_to_nvs(plant, plant_nvs_keys[index]));
+                    publish_response(client, id, "CONFIG ACCEPTED");
+                    wakePlantScheduler(); // New periods may move the next deadline earlier
                 }else{
-                    esp_mqtt_client_publish(client, "/topic/qos1", "CONFIG REJECTED - Failed sanity check", 0, 0, 0);
+                    publish_response(client, id, "CONFIG REJECTED - Failed sanity check");
                 }
             }else{
-                esp_mqtt_client_publish(client, "/topic/qos1", "CONFIG REJECTED - Parse Failed", 0, 0, 0);
+                publish_response(client, id, "CONFIG REJECTED - Parse Failed");
             }
         }
         else
         {
-            esp_mqtt_client_publish(client, "/topic/qos1", "Unexpected JSON structure", 0, 0, 0);
+            publish_response(client, id, "Unexpected JSON structure");
         }
     }
 
     cJSON_Delete(json);
 }
 
+// Publishes how long the (re)connect took, TCP + TLS handshake + MQTT CONNECT, so full and
+// cheap (PSK or resumed session) reconnects can be compared
+static void publish_connect_timing(esp_mqtt_client_handle_t client, bool session_present)
+{
+    uint32_t connect_ms = (esp_timer_get_time() - mqtt_connect_start_us) / 1000;
+    mqtt_connect_count++;
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "connect");
+    cJSON_AddNumberToObject(root, "connect_ms", connect_ms);
+    cJSON_AddNumberToObject(root, "connects", mqtt_connect_count);
+    cJSON_AddBoolToObject(root, "session_present", session_present);
+    cJSON_AddBoolToObject(root, "tls", 0 == strncmp("mqtts://", CONFIG_MQTT_BROKER_URL, sizeof("mqtts://")-1));
+    char *my_json_string = cJSON_PrintUnformatted(root);
+    mqttPublish(client, topics.metrics, my_json_string, 0, 0, 0);
+    free(my_json_string);
+    cJSON_Delete(root);
+}
+
+#if CONFIG_PLANT_ROLE_GATEWAY
+static void addTelemetryFields(cJSON *root, uint16_t moisture_sensor, uint16_t level_sensor, float temperature, float humidity,
+    enum PlantStates state, uint8_t moisture_faults, uint8_t level_faults);
+
+// Sensor nodes heard over ESP-NOW, published through this device's MQTT session.  gateway_mutex
+// serialises the gateway between the link, MQTT and gateway tasks, and is never held across a
+// publish: the MQTT task holds the client lock while it waits for the mutex to forward a command.
+static struct plant_gateway_struct gateway;
+static SemaphoreHandle_t gateway_mutex = NULL;
+static esp_timer_handle_t gateway_flush_timer = NULL;
+static TaskHandle_t gateway_task_handle = NULL;     // Publishes node telemetry, woken to flush
+
+// Publishes a node's telemetry under the node's own namespace, as the node would itself
+static void gateway_publish_sample(void *ctx, const char *node_id, const struct plant_link_sample_struct *sample)
+{
+    char topic[32];
+    snprintf(topic, sizeof(topic), "pt/%s/tele/%d", node_id, sample->plant);
+
+    cJSON *root = cJSON_CreateObject();
+    addTelemetryFields(root, sample->moisture, sample->level, sample->temperature_x10 / 10.0f, sample->humidity_x10 / 10.0f,
+        sample->state, sample->faults & 0x0f, sample->faults >> 4);
+    cJSON_AddStringToObject(root, "gateway", device_id);
+    char *my_json_string = cJSON_PrintUnformatted(root);
+    mqttPublish(mqtt_client, topic, my_json_string, 0, 1, 1);
+    free(my_json_string);
+    cJSON_Delete(root);
+}
+
+static void gateway_publish_response(void *ctx, const char *node_id, const char *text, size_t len)
+{
+    char topic[32];
+    snprintf(topic, sizeof(topic), "pt/%s/rsp", node_id);
+    mqttPublish(mqtt_client, topic, text, len, 0, 0);
+}
+
+static const struct plant_gateway_output_struct gateway_output = {
+    .ctx = NULL,
+    .publish_sample = gateway_publish_sample,
+    .publish_response = gateway_publish_response,
+};
+
+static void gateway_link_receive(void *user, const uint8_t *addr, const uint8_t *data, size_t len)
+{
+    xSemaphoreTake(gateway_mutex, portMAX_DELAY);
+    bool flush_now = plant_gateway_receive(&gateway, addr, data, len, esp_timer_get_time());
+    xSemaphoreGive(gateway_mutex);
+    if(flush_now){
+        xTaskNotifyGive(gateway_task_handle);
+    }
+}
+
+// Runs on the esp_timer task, which must not block on publishes, so it only wakes the gateway task
+static void gateway_flush_timer_cb(void *arg)
+{
+    xTaskNotifyGive(gateway_task_handle);
+}
+
+// Publishes the node responses and the node samples that changed, a few at a time so the mutex is
+// not held while publishing
+static void gateway_task(void *pvParameters)
+{
+    struct plant_gateway_batch_struct batch[PLANT_GATEWAY_MAX_PLANTS];
+    struct plant_gateway_response_struct response;
+    int collected;
+    bool taken;
+
+    while(1)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if(!mqtt_connected){
+            continue;   // Samples stay dirty and responses queued until the next flush after reconnecting
+        }
+        do{
+            xSemaphoreTake(gateway_mutex, portMAX_DELAY);
+            taken = plant_gateway_take_response(&gateway, &response);
+            xSemaphoreGive(gateway_mutex);
+            if(taken){
+                gateway_publish_response(NULL, response.node_id, response.text, response.len);
+            }
+        }while(taken);
+        do{
+            xSemaphoreTake(gateway_mutex, portMAX_DELAY);
+            collected = plant_gateway_collect(&gateway, batch, PLANT_GATEWAY_MAX_PLANTS);
+            xSemaphoreGive(gateway_mutex);
+            for(int i = 0; i < collected; i++)
+            {
+                gateway_publish_sample(NULL, batch[i].node_id, &batch[i].sample);
+            }
+        }while(collected == PLANT_GATEWAY_MAX_PLANTS);
+    }
+}
+
+// Starts the ESP-NOW link on the channel of the AP we are associated with
+static void gateway_start(void)
+{
+    gateway_mutex = xSemaphoreCreateMutex();
+    plant_gateway_init(&gateway, &plant_link_espnow, &gateway_output);
+    xTaskCreate(gateway_task, "gateway", 4096, NULL, 5, &gateway_task_handle);
+    ESP_ERROR_CHECK(plant_link_espnow.start(plant_link_espnow.ctx, gateway_link_receive, NULL) == 0 ? ESP_OK : ESP_FAIL);
+
+    const esp_timer_create_args_t flush_timer_args = {
+        .callback = gateway_flush_timer_cb,
+        .name = "gateway_flush",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&flush_timer_args, &gateway_flush_timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(gateway_flush_timer, CONFIG_PLANT_GATEWAY_FLUSH_MS * 1000ull));
+}
+#endif
+
+// On a gateway, fans pt/<node>/cmd messages out to the nodes.  Returns false for this device's
+// own commands.
+static bool gatewayForwardCommand(esp_mqtt_event_handle_t event)
+{
+#if CONFIG_PLANT_ROLE_GATEWAY
+    const int id_len = strlen(device_id);
+    char node_id[sizeof(device_id)];
+
+    if(event->topic_len != sizeof("pt/") - 1 + id_len + sizeof("/cmd") - 1 ||
+        0 != strncmp(event->topic, "pt/", 3) || 0 != strncmp(event->topic + 3 + id_len, "/cmd", 4)){
+        return false;
+    }
+    memcpy(node_id, event->topic + 3, id_len);
+    node_id[id_len] = 0;
+    if(0 == strcmp(node_id, device_id)){
+        return false;
+    }
+    // Commands for devices that are not our nodes (e.g. standalone ones) are dropped here too
+    xSemaphoreTake(gateway_mutex, portMAX_DELAY);
+    plant_gateway_send_command(&gateway, node_id, event->data, event->data_len);
+    xSemaphoreGive(gateway_mutex);
+    return true;
+#else
+    return false;
+#endif
+}
+
 static void log_error_if_nonzero(const char * message, int error_code)
 {
     if (error_code != 0) {
@@ -308,39 +702,75 @@ static void log_error_if_nonzero(const char * message, int error_code)
     }
 }
 
+// Hands a command to process_mqqt_data as a string, event->data is not NUL terminated
+static void processMqttCommand(esp_mqtt_client_handle_t client, esp_mqtt_event_handle_t event)
+{
+    if(event->data_len != event->total_data_len){
+        if(event->current_data_offset == 0){
+            ESP_LOGW(TAG, "Command of %d bytes does not fit the MQTT buffer, dropped", event->total_data_len);
+        }
+        return;
+    }
+    char *command = malloc(event->data_len + 1);
+    if(command == NULL){
+        return;
+    }
+    memcpy(command, event->data, event->data_len);
+    command[event->data_len] = 0;
+    process_mqqt_data(client, command);
+    free(command);
+}
+
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 {
     esp_mqtt_client_handle_t client = event->client;
     int msg_id;
     // your_context_t *context = event->context;
     switch (event->event_id) {
+        case MQTT_EVENT_BEFORE_CONNECT:
+            mqtt_connect_start_us = esp_timer_get_time();
+            break;
         case MQTT_EVENT_CONNECTED:
-            ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-
-            // TODO: Subscribe to topics here
-            msg_id = esp_mqtt_client_subscribe(client, "/topic/qos0", 0);
-            ESP_LOGI(TAG, "sent subscribe successful, msg_id=%d", msg_id);
+            // With a persistent session the broker still has our subscriptions
+            msg_id = -1;
+            if(!event->session_present){
+#if CONFIG_PLANT_ROLE_GATEWAY
+                msg_id = esp_mqtt_client_subscribe(client, "pt/+/cmd", 1);   // Ours and our nodes'
+#else
+                msg_id = esp_mqtt_client_subscribe(client, topics.cmd, 1);
+#endif
+            }
+            PLANT_LOG(PLOG_MQTT_CONNECTED, PLOG_I(msg_id));
+            plant_ota_on_connected(client, event->session_present);
+            if(boot_timing.mqtt_connected_us == 0){
+                boot_timing.mqtt_connected_us = esp_timer_get_time();
+            }
             mqtt_connected = true;
+            publish_connect_timing(client, event->session_present);
+            publish_requested = true; // Publish current state right away instead of waiting for the next poll
+            wakePlantScheduler();
             break;
 
         case MQTT_EVENT_DISCONNECTED:
-            ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+            PLANT_LOG(PLOG_MQTT_DISCONNECTED);
             mqtt_connected = false;
             break;
         case MQTT_EVENT_SUBSCRIBED:
-            ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
+            PLANT_LOG(PLOG_MQTT_SUBSCRIBED, PLOG_I(event->msg_id));
             break;
         case MQTT_EVENT_UNSUBSCRIBED:
                 ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
             break;
         case MQTT_EVENT_PUBLISHED:
-            ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+            PLANT_LOG(PLOG_MQTT_PUBLISHED, PLOG_I(event->msg_id));
             break;
         case MQTT_EVENT_DATA:
-            ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-            printf("TOPIC=%.*s\r\n", event->topic_len, event->topic);
-            printf("DATA=%.*s\r\n", event->data_len, event->data);
-            process_mqqt_data(event);
+            PLANT_LOG(PLOG_MQTT_DATA, PLOG_I(event->topic_len), PLOG_I(event->data_len));
+            ESP_LOGD(TAG, "TOPIC=%.*s", event->topic_len, event->topic);
+            ESP_LOGD(TAG, "DATA=%.*s", event->data_len, event->data);
+            if(!plant_ota_handle_data(event) && !gatewayForwardCommand(event)){
+                processMqttCommand(client, event);
+            }
             break;
         case MQTT_EVENT_ERROR:
             ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -364,141 +794,696 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
     mqtt_event_handler_cb(event_data);
 }
 
+#ifdef CONFIG_MQTT_TLS_PSK
+static uint8_t mqtt_psk_key[32];
+static struct psk_key_hint mqtt_psk = {
+    .key = mqtt_psk_key,
+    .key_size = (sizeof(CONFIG_MQTT_TLS_PSK_KEY) - 1) / 2,
+    .hint = CONFIG_MQTT_TLS_PSK_IDENTITY,
+};
+_Static_assert(sizeof(CONFIG_MQTT_TLS_PSK_KEY) > 1, "MQTT_TLS_PSK_KEY is not set");
+_Static_assert((sizeof(CONFIG_MQTT_TLS_PSK_KEY) - 1) % 2 == 0, "MQTT_TLS_PSK_KEY has an odd number of hex digits");
+_Static_assert((sizeof(CONFIG_MQTT_TLS_PSK_KEY) - 1) / 2 <= sizeof(mqtt_psk_key), "MQTT_TLS_PSK_KEY too long");
+
+// Decodes CONFIG_MQTT_TLS_PSK_KEY into mqtt_psk_key, false if it holds anything but hex digits
+static bool decode_psk_key(void)
+{
+    for(int i = 0; i < mqtt_psk.key_size; i++)
+    {
+        char hex_byte[3] = { CONFIG_MQTT_TLS_PSK_KEY[2*i], CONFIG_MQTT_TLS_PSK_KEY[2*i + 1], 0 };
+        if(!isxdigit((unsigned char) hex_byte[0]) || !isxdigit((unsigned char) hex_byte[1])){
+            return false;
+        }
+        mqtt_psk_key[i] = strtol(hex_byte, NULL, 16);
+    }
+    return true;
+}
+#endif
+
+// Derives the device id from the station MAC and builds the device's MQTT client id and topics
+void init_device_id(void)
+{
+    uint8_t mac[6];
+    ESP_ERROR_CHECK(esp_read_mac(mac, ESP_MAC_WIFI_STA));
+    plant_link_format_id(device_id, mac);
+    snprintf(mqtt_client_id, sizeof(mqtt_client_id), "plant_thing_%s", device_id);
+
+    snprintf(topics.cmd, sizeof(topics.cmd), "pt/%s/cmd", device_id);
+    snprintf(topics.rsp, sizeof(topics.rsp), "pt/%s/rsp", device_id);
+    snprintf(topics.alarm, sizeof(topics.alarm), "pt/%s/alarm", device_id);
+    snprintf(topics.metrics, sizeof(topics.metrics), "pt/%s/metrics", device_id);
+    snprintf(topics.trace, sizeof(topics.trace), "pt/%s/trace", device_id);
+}
+
+// Connects to CONFIG_MQTT_BROKER_URL, over TLS when it is an mqtts:// URL.  The session is
+// persistent (clean session off, stable client id) so subscriptions and queued QoS 1 commands
+// survive reconnects.
 esp_mqtt_client_handle_t mqtt_app_start(void)
 {
     esp_mqtt_client_config_t mqtt_cfg = {
-        .host = CONFIG_MQTT_BROKER_URL,
+        .uri = CONFIG_MQTT_BROKER_URL,
         .username = CONFIG_MQTT_USERNAME,
         .password = CONFIG_MQTT_PASSWORD,
+        .client_id = mqtt_client_id,
+        .disable_clean_session = true,
+#ifdef CONFIG_MQTT_TLS_CRT_BUNDLE
+        .crt_bundle_attach = esp_crt_bundle_attach,
+#endif
     };
 
+#ifdef CONFIG_MQTT_TLS_PSK
+    // A PSK handshake skips certificate verification and public key operations entirely
+    if(!decode_psk_key()){
+        ESP_LOGE(TAG, "MQTT_TLS_PSK_KEY is not a hex string, refusing to connect");
+        ESP_ERROR_CHECK(ESP_ERR_INVALID_ARG);
+    }
+    mqtt_cfg.psk_hint_key = &mqtt_psk;
+#endif
+
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
     esp_mqtt_client_start(client);
     return client;
 }
 
-void pollSensors(struct plant_struct* plant, uint64_t now, esp_mqtt_client_handle_t client)
+// Logs the boot timing and publishes it as a metric, if there is an MQTT client (sensor nodes have none)
+void publish_boot_timing(esp_mqtt_client_handle_t client)
 {
-    if(use_fake_poll){
-        plant->status.poll_median_moisture_sensor = fake_moisture;
-        plant->status.poll_median_level_sensor = fake_level;
-        plant->status.last_poll_time_us = now;
+    if(client){
+        const esp_app_desc_t *app_desc = esp_ota_get_app_description();
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "boot");
+        cJSON_AddStringToObject(root, "version", app_desc->version);
+        cJSON_AddNumberToObject(root, "nvs_ready_ms", boot_timing.nvs_ready_us / 1000);
+        cJSON_AddNumberToObject(root, "control_start_ms", boot_timing.control_start_us / 1000);
+        cJSON_AddNumberToObject(root, "network_init_done_ms", boot_timing.network_init_done_us / 1000);
+        cJSON_AddNumberToObject(root, "wifi_got_ip_ms", boot_timing.wifi_got_ip_us / 1000);
+        cJSON_AddNumberToObject(root, "mqtt_connected_ms", boot_timing.mqtt_connected_us / 1000);
+        cJSON_AddNumberToObject(root, "first_publish_ms", boot_timing.first_publish_us / 1000);
+        char *my_json_string = cJSON_PrintUnformatted(root);
+        mqttPublish(client, topics.metrics, my_json_string, 0, 1, 0);
+        free(my_json_string);
+        cJSON_Delete(root);
     }
-    else
+
+    ESP_LOGI(TAG, "[BOOT] control at %llu ms, first publish at %llu ms", 
+        boot_timing.control_start_us / 1000, boot_timing.first_publish_us / 1000);
+    boot_timing.reported = true;
+}
+
+static bool outsideDeadband(float value, float published, float deadband)
+{
+    return value > published + deadband || value < published - deadband;
+}
+
+// True when telemetry can be sent, over MQTT or, on sensor nodes, the link to the gateway
+static bool telemetryReady(esp_mqtt_client_handle_t client)
+{
+#if CONFIG_PLANT_ROLE_NODE
+    return link_ready;
+#else
+    return client && mqtt_connected;
+#endif
+}
+
+// Telemetry JSON fields, shared by the plants on this board and, on a gateway, those of its nodes
+static void addTelemetryFields(cJSON *root, uint16_t moisture_sensor, uint16_t level_sensor, float temperature, float humidity,
+    enum PlantStates state, uint8_t moisture_faults, uint8_t level_faults)
+{
+    cJSON_AddNumberToObject(root, "test", 100*RATIO_FROM_MOISTURE_SENSOR_VALUE(moisture_sensor));
+    cJSON_AddNumberToObject(root, "temperature", temperature);
+    cJSON_AddNumberToObject(root, "humidity", humidity);
+    cJSON_AddNumberToObject(root, "water_available", level_sensor);
+    cJSON_AddNumberToObject(root, "state", state);
+    cJSON_AddNumberToObject(root, "moisture_faults", moisture_faults);
+    cJSON_AddNumberToObject(root, "level_faults", level_faults);
+}
+
+#if CONFIG_PLANT_ROLE_NODE
+// Sends the plant's telemetry to the gateway, urgent for state and fault changes
+static void sendPlantSample(const struct plant_struct* plant, uint8_t faults, bool urgent)
+{
+    const struct plant_status_struct *status = &plant->status;
+    struct plant_link_sample_struct sample = {
+        .header = { .magic = PLANT_LINK_MAGIC, .type = PLANT_LINK_SAMPLE, .seq = link_seq++ },
+        .plant = plant_index(plant),
+        .state = status->machine.state,
+        .faults = faults,
+        .flags = urgent ? PLANT_LINK_FLAG_URGENT : 0,
+        .moisture = status->poll_median_moisture_sensor,
+        .level = status->poll_median_level_sensor,
+        .temperature_x10 = status->poll_temperature * 10,
+        .humidity_x10 = status->poll_humidity * 10,
+    };
+    plant_energy_count(PLANT_ENERGY_LINK_FRAME, 1);
+    plant_link_espnow.send(plant_link_espnow.ctx, link_gateway_addr, &sample, sizeof(sample));
+}
+#endif
+
+// Publishes the plant's telemetry as a retained message, but only when the state or sensor faults
+// changed, a reading moved beyond its deadband, the heartbeat period expired or a publish was
+// forced.  New subscribers get the last known state from the retained message.
+void publishPlant(struct plant_struct* plant, uint64_t now, bool force, esp_mqtt_client_handle_t client)
+{
+    struct plant_status_struct *status = &plant->status;
+    uint8_t faults = status->moisture_faults | status->level_faults << 4;
+
+    if(!telemetryReady(client)){
+        return;
+    }
+
+    bool changed = force ||
+        status->last_publish_time_us == 0 ||
+        now - status->last_publish_time_us >= TELEMETRY_HEARTBEAT_S * SEC_IN_MICROSEC ||
+        status->machine.state != status->published_state ||
+        faults != status->published_faults ||
+        outsideDeadband(status->poll_median_moisture_sensor, status->published_moisture_sensor, TELEMETRY_MOISTURE_DEADBAND) ||
+        outsideDeadband(status->poll_median_level_sensor, status->published_level_sensor, TELEMETRY_LEVEL_DEADBAND) ||
+        outsideDeadband(status->poll_temperature, status->published_temperature, TELEMETRY_TEMPERATURE_DEADBAND) ||
+        outsideDeadband(status->poll_humidity, status->published_humidity, TELEMETRY_HUMIDITY_DEADBAND);
+    if(!changed){
+        return;
+    }
+
+#if CONFIG_PLANT_ROLE_NODE
+    sendPlantSample(plant, faults, status->machine.state != status->published_state || faults != status->published_faults);
+#else
+    cJSON *root = cJSON_CreateObject();
+    addTelemetryFields(root, status->poll_median_moisture_sensor, status->poll_median_level_sensor, status->poll_temperature,
+        status->poll_humidity, status->machine.state, status->moisture_faults, status->level_faults);
+    cJSON_AddNumberToObject(root, "sum_heap_free", esp_get_free_heap_size());
+    char *my_json_string = cJSON_PrintUnformatted(root);
+    mqttPublish(client, plant_telemetry_topics[plant_index(plant)], my_json_string, 0, 1, 1);
+    free(my_json_string); // Need to free the string allocated by cJSON_Print
+    cJSON_Delete(root); // Free the cJSON object
+#endif
+
+    status->published_moisture_sensor = status->poll_median_moisture_sensor;
+    status->published_level_sensor = status->poll_median_level_sensor;
+    status->published_temperature = status->poll_temperature;
+    status->published_humidity = status->poll_humidity;
+    status->published_state = status->machine.state;
+    status->published_faults = faults;
+    status->last_publish_time_us = now;
+
+    if(!boot_timing.reported){
+        boot_timing.first_publish_us = esp_timer_get_time();
+        publish_boot_timing(client);
+    }
+}
+
+void logPoll(const struct plant_struct* plant)
+{
+    PLANT_LOG(PLOG_POLL,
+        PLOG_I(plant_index(plant)), PLOG_I(mqtt_connected), 
+        PLOG_F(RATIO_FROM_MOISTURE_SENSOR_VALUE(plant->status.poll_median_moisture_sensor)), 
+        PLOG_I(plant->status.poll_median_moisture_sensor), PLOG_I(plant->status.poll_median_level_sensor), 
+        PLOG_F(plant->status.poll_temperature), PLOG_F(plant->status.poll_humidity),
+        PLOG_I(plant->status.machine.state), PLOG_I(esp_get_free_heap_size()));
+}
+
+static uint8_t trace_buffer[PLANT_TRACE_BUFFER_SIZE];
+static size_t trace_buffer_len = 0;
+static uint32_t trace_dropped = 0;      // Records lost because the buffer could not be published
+
+// Publishes the buffered trace records, or counts them lost while MQTT is down, and empties the buffer
+void flushTrace(esp_mqtt_client_handle_t client)
+{
+    if(client && mqtt_connected){
+        mqttPublish(client, topics.trace, (const char *) trace_buffer, trace_buffer_len, 1, 0);
+    }else{
+        trace_dropped += trace_buffer_len / sizeof(struct plant_trace_record_struct);
+        ESP_LOGW(TAG, "Trace buffer dropped, %u records lost so far", trace_dropped);
+    }
+    trace_buffer_len = 0;
+}
+
+// Appends one poll to the trace buffer, publishing the buffer first if the record doesn't fit
+void tracePoll(const struct plant_struct* plant, const int* moisture_samples, const int* level_samples, bool dht_ok, uint64_t now, esp_mqtt_client_handle_t client)
+{
+    struct plant_trace_record_struct record = {
+        .magic = PLANT_TRACE_MAGIC,
+        .version = PLANT_TRACE_VERSION,
+        .plant = plant_index(plant),
+        .time_us = now,
+        .low_moisture = plant->config.low_moisture,
+        .watered_moisture = plant->config.watered_moisture,
+        .high_moisture = plant->config.high_moisture,
+        .polling_period_s = plant->config.polling_period_s,
+        .pump_on_period_s = plant->config.pump_on_period_s,
+        .pump_off_period_s = plant->config.pump_off_period_s,
+        .wet_hold_period_s = plant->config.wet_hold_period_s,
+        .dry_hold_period_s = plant->config.dry_hold_period_s,
+        .temperature = plant->status.poll_temperature,
+        .humidity = plant->status.poll_humidity,
+        .dht_ok = dht_ok,
+        .gain = plant_dosing[plant_index(plant)].gain,
+        .dose_pulse_ms = plant->status.machine.dose_pulse_ms,
+        .state = plant->status.machine.state
+    };
+    for(int i = 0; i < PLANT_TRACE_SAMPLES; i++)
     {
-        int moisture_readings[9] = {0};
-        int level_readings[9] = {0};
+        record.moisture_samples[i] = moisture_samples[i];
+        record.level_samples[i] = level_samples[i];
+    }
 
-        for(int i = 0; i < 9; i++)
-        {
-            moisture_readings[i] = adc1_get_raw(plant->pins.moisture_sensor_adc1_channel);
-            level_readings[i] = adc1_get_raw(plant->pins.level_sensor_adc1_channel);
-        }
+    if(trace_buffer_len + sizeof(record) > sizeof(trace_buffer)){
+        flushTrace(client);
+    }
+
+    memcpy(&trace_buffer[trace_buffer_len], &record, sizeof(record));
+    trace_buffer_len += sizeof(record);
+}
+
+// Fake polling reads the synthetic soil (plant_synthetic.h) instead of the sensors
+void stepSyntheticSensors(struct plant_struct* plant, uint64_t now)
+{
+    struct plant_status_struct *status = &plant->status;
+
+    if(status->synthetic.moisture == 0){
+        status->synthetic.moisture = plant->config.high_moisture;
+    }
+
+    float elapsed_s = (now - status->last_poll_time_us) / (float) SEC_IN_MICROSEC;
+    status->poll_median_moisture_sensor = plant_synthetic_step(&status->synthetic, elapsed_s, status->pump_on_total_us,
+        MOISTURE_SENSOR_DRY, MOISTURE_SENSOR_WET);
+    status->poll_median_level_sensor = PLANT_SYNTHETIC_LEVEL;
+}
 
-        plant->status.poll_median_moisture_sensor = opt_med9(moisture_readings);
-        plant->status.poll_median_level_sensor = opt_med9(level_readings);
-        plant->status.last_poll_time_us = now;
+static void addStatsSummary(cJSON *root, const char *name, const struct sensor_stats_struct *stats, uint8_t faults)
+{
+    cJSON *summary = cJSON_AddObjectToObject(root, name);
+    cJSON_AddNumberToObject(summary, "n", stats->count);
+    cJSON_AddNumberToObject(summary, "mean", stats->mean);
+    cJSON_AddNumberToObject(summary, "var", sensor_stats_variance(stats));
+    cJSON_AddNumberToObject(summary, "min", stats->min);
+    cJSON_AddNumberToObject(summary, "max", stats->max);
+    cJSON_AddNumberToObject(summary, "p50", sensor_stats_median(stats));
+    cJSON_AddNumberToObject(summary, "mad", sensor_stats_mad(stats));
+    cJSON_AddNumberToObject(summary, "faults", faults);
+}
+
+// Feeds a poll's raw bursts into the plant's channel statistics.  Every STATS_SUMMARY_POLLS polls
+// the window is published as a compact summary and restarted.
+// level_samples is NULL when the level has not been sampled since the plant's last poll
+void updateSensorStats(struct plant_struct* plant, const int* moisture_samples, const int* level_samples, esp_mqtt_client_handle_t client)
+{
+    struct plant_status_struct *status = &plant->status;
+    uint8_t old_faults = status->moisture_faults | status->level_faults << 4;
 
-        dht_read_float_data(DHT_TYPE_DHT11, plant->pins.dht_gpio_pin, &(plant->status.poll_humidity), &(plant->status.poll_temperature));
+    status->moisture_faults = sensor_stats_add_burst(&status->moisture_stats, moisture_samples, 9);
+    if(level_samples){
+        status->level_faults = sensor_stats_add_burst(&status->level_stats, level_samples, 9);
     }
 
-    size_t sum_heap_free = esp_get_free_heap_size();
-    float moisture_percent = RATIO_FROM_MOISTURE_SENSOR_VALUE(plant->status.poll_median_moisture_sensor);
+    if((status->moisture_faults | status->level_faults << 4) != old_faults){
+        PLANT_LOG(PLOG_SENSOR_FAULTS, PLOG_I(plant_index(plant)), PLOG_I(status->moisture_faults), PLOG_I(status->level_faults));
+    }
+
+    if(++status->stats_polls < STATS_SUMMARY_POLLS){
+        return;
+    }
 
     if(client && mqtt_connected){
         cJSON *root = cJSON_CreateObject();
-        cJSON_AddNumberToObject(root, "test", 100*moisture_percent);
-        cJSON_AddNumberToObject(root, "temperature", plant->status.poll_temperature);
-        cJSON_AddNumberToObject(root, "humidity", plant->status.poll_humidity);
-        cJSON_AddNumberToObject(root, "water_available", plant->status.poll_median_level_sensor);
-        cJSON_AddNumberToObject(root, "state", plant->status.state);
-        cJSON_AddNumberToObject(root, "sum_heap_free", sum_heap_free);
-        char *my_json_string = cJSON_Print(root);
-        esp_mqtt_client_publish(client, "/test/test", my_json_string, 0, 0, 0);
-        free(my_json_string); // Need to free the string allocated by cJSON_Print
-        cJSON_Delete(root); // Free the cJSON object
+        addStatsSummary(root, "moisture", &status->moisture_stats, status->moisture_faults);
+        addStatsSummary(root, "level", &status->level_stats, status->level_faults);
+        char *my_json_string = cJSON_PrintUnformatted(root);
+        mqttPublish(client, plant_stats_topics[plant_index(plant)], my_json_string, 0, 0, 0);
+        free(my_json_string);
+        cJSON_Delete(root);
     }
 
-    ESP_LOGI(TAG, "[%s] moisture = %0.4f (%d), water_available = %d, temperature = %0.1f, humidity = %0.1f, state = %s, sum_heap_free=%d", 
-        mqtt_connected?"connected":"DISCONNECTED", 
-        moisture_percent, plant->status.poll_median_moisture_sensor, plant->status.poll_median_level_sensor, 
-        plant->status.poll_temperature, plant->status.poll_humidity,
-        PlantStateString[plant->status.state], sum_heap_free);
+    sensor_stats_reset(&status->moisture_stats);
+    sensor_stats_reset(&status->level_stats);
+    status->stats_polls = 0;
 }
 
-void turnOnPump(struct plant_struct* plant)
+// Sensor sources.  Every distinct sensor the plants are wired to is one source, shared by those
+// plants, read through its driver (sensor_driver.h) and holding the latest reading.  Moisture is
+// sampled when a plant's poll is due, the reservoir level and DHT on their own schedules,
+// independent of the plants' polling periods.
+
+const char *sensor_role_names[SENSOR_ROLE_COUNT] = {
+    "moisture",
+    "level",
+    "environment"
+};
+
+// Driver and sampling period of each role, period 0 = sampled by the plant polls
+const struct{
+    enum SensorDriverTypes driver;
+    uint64_t period_us;
+} sensor_roles[SENSOR_ROLE_COUNT] = {
+    [SENSOR_ROLE_MOISTURE] = { SENSOR_DRIVER_ADC, 0 },
+    [SENSOR_ROLE_LEVEL] = { SENSOR_DRIVER_ADC, LEVEL_SAMPLE_PERIOD_US },
+    [SENSOR_ROLE_ENVIRONMENT] = { SENSOR_DRIVER_DHT11, DHT_SAMPLE_PERIOD_US }
+};
+
+struct sensor_source_struct{
+    enum SensorRoles role;
+    int pin;                // Driver specific, e.g. adc1_channel_t or gpio_num_t
+    struct sensor_schedule_struct schedule;
+    struct sensor_reading_struct latest;
+};
+
+static struct sensor_source_struct sensor_sources[SENSOR_ROLE_COUNT * PLANT_COUNT];
+static int sensor_source_count = 0;
+
+static int sensorPin(const struct plant_struct *plant, enum SensorRoles role)
 {
-    if(enable_pump && plant->status.poll_median_level_sensor > 2048){
-        gpio_set_level(plant->pins.pump_gpio_pin, 0); // Turn ON pump (active low)
+    switch(role){
+        case SENSOR_ROLE_MOISTURE: return plant->pins.moisture_sensor_adc1_channel;
+        case SENSOR_ROLE_LEVEL: return plant->pins.level_sensor_adc1_channel;
+        default: return plant->pins.dht_gpio_pin;
     }
 }
 
-void turnOffPump(struct plant_struct* plant)
+static struct sensor_source_struct *findSensorSource(enum SensorRoles role, int pin)
 {
-    gpio_set_level(plant->pins.pump_gpio_pin, 1); // Turn OFF pump (active low)
+    for(int i = 0; i < sensor_source_count; i++)
+    {
+        if(sensor_sources[i].role == role && sensor_sources[i].pin == pin){
+            return &sensor_sources[i];
+        }
+    }
+    return NULL;
 }
 
-void initPlant(struct plant_struct* plant, uint64_t now, esp_mqtt_client_handle_t client)
+static struct sensor_source_struct *plantSensor(const struct plant_struct *plant, enum SensorRoles role)
 {
-    // Configure ADC1 level and moisture sensor channels
-    adc1_config_width(ADC_WIDTH_BIT_12);
-    adc1_config_channel_atten(plant->pins.moisture_sensor_adc1_channel, ADC_ATTEN_MAX);   /*!< Moisture Sensor - ADC1 channel 4 is GPIO32 */
-    adc1_config_channel_atten(plant->pins.level_sensor_adc1_channel, ADC_ATTEN_MAX);   /*!< Water Level Sensor - ADC1 channel 5 is GPIO33 */
+    return plant->status.sensor_sources[role];
+}
 
-    // Setup the GPIO pin for controlling the pump (pump is active low)
-    gpio_pad_select_gpio(plant->pins.pump_gpio_pin);
-    gpio_set_direction(plant->pins.pump_gpio_pin, GPIO_MODE_OUTPUT);
-    turnOffPump(plant); // Turn pump OFF (active low)
+// Returns the source for the sensor, adding it unless it is already shared by another plant
+static struct sensor_source_struct *addSensorSource(enum SensorRoles role, int pin, uint64_t now)
+{
+    struct sensor_source_struct *source = findSensorSource(role, pin);
+    if(source){
+        return source;
+    }
+    source = &sensor_sources[sensor_source_count++];
+    const struct sensor_driver_struct *driver = sensor_drivers[sensor_roles[role].driver];
+    memset(source, 0, sizeof(*source));
+    source->role = role;
+    source->pin = pin;
+    if(sensor_roles[role].period_us){
+        // Slot 0 is left to the plants' first poll
+        sensor_schedule_start(&source->schedule, sensor_roles[role].period_us, sensor_source_count, now);
+    }else{
+        source->schedule.next_us = UINT64_MAX;
+    }
+    driver->init(pin);
 
-    // Do initial sensor poll
-    pollSensors(plant, now, client);
+    const struct sensor_description_struct *description = driver->describe(pin);
+    printf("Sensor %-11s %s pin %d:", sensor_role_names[role], description->name, pin);
+    for(int v = 0; v < description->value_count; v++)
+    {
+        printf(" %s (%s)", description->value_names[v], description->value_units[v]);
+    }
+    printf("\n");
+    return source;
+}
 
-    plant->status.state_entry_time_us = now;
-    plant->status.state = PLANT_DRYING;
-    plant->status.initialized = true;
+void initSensorSources(uint64_t now)
+{
+    for(int role = 0; role < SENSOR_ROLE_COUNT; role++)
+    {
+        for(int i = 0; i < PLANT_COUNT; i++)
+        {
+            plants[i].status.sensor_sources[role] = addSensorSource(role, sensorPin(&plants[i], role), now);
+        }
+    }
 }
 
-void changeState(struct plant_struct* plant, enum PlantStates new_state, uint64_t now){
-    bool valid = false;
+// Copies a new reading into the status of every plant wired to the source
+static void applySensorReading(const struct sensor_source_struct *source)
+{
+    const struct sensor_reading_struct *reading = &source->latest;
 
-    switch(plant->status.state){
-        case PLANT_DRYING:
-            switch(new_state){
-                case PLANT_DRY_HOLD: valid = true; break;
-                default: /* invalid */ break;
-            }
-            break;
-        case PLANT_DRY_HOLD:
-            switch(new_state){
-                case PLANT_PUMP_DELAY: valid = true; break;
-                case PLANT_DRYING: valid = true; break;
-                default: /* invalid */ break;
+    if(!reading->ok){
+        return; // Keep the last good values
+    }
+    for(int i = 0; i < PLANT_COUNT; i++)
+    {
+        struct plant_status_struct *status = &plants[i].status;
+        if(plantSensor(&plants[i], source->role) != source){
+            continue;
+        }
+        switch(source->role){
+            case SENSOR_ROLE_MOISTURE:
+                status->poll_median_moisture_sensor = reading->values[0];
+                break;
+            case SENSOR_ROLE_LEVEL:
+                // The state machines and the pre-pump check see the new level right away
+                status->poll_median_level_sensor = reading->values[0];
+                break;
+            default:
+                status->poll_humidity = reading->values[0];
+                status->poll_temperature = reading->values[1];
+                break;
+        }
+    }
+}
+
+// Acquires, in one batched pass, the moisture of the due plants and the scheduled sources that
+// are due (all of them if force).  Returns the earliest next due time of the scheduled sources.
+uint64_t acquireSensors(struct plant_struct **due, int due_count, uint64_t now, bool force)
+{
+    struct sensor_request_struct requests[SENSOR_ROLE_COUNT * PLANT_COUNT];
+    struct sensor_source_struct *acquired[SENSOR_ROLE_COUNT * PLANT_COUNT];
+    int count = 0;
+    uint64_t next_us = UINT64_MAX;
+
+    for(int i = 0; i < sensor_source_count; i++)
+    {
+        struct sensor_source_struct *source = &sensor_sources[i];
+        bool wanted = false;
+        if(source->schedule.period_us){
+            if(sensor_schedule_due(&source->schedule, now)){
+                sensor_schedule_advance(&source->schedule, now);
+                wanted = true;
             }
-            break;
-        case PLANT_PUMP_DELAY:
-            switch(new_state){
-                case PLANT_PUMP_ON: valid = true; break;
-                case PLANT_WET_HOLD: valid = true; break;
-                default: /* invalid */ break;
+            wanted |= force;
+            if(source->schedule.next_us < next_us){
+                next_us = source->schedule.next_us;
             }
-            break;
-        case PLANT_PUMP_ON:
-            switch(new_state){
-                case PLANT_PUMP_DELAY: valid = true; break;
-                default: /* invalid */ break;
+        }else{
+            for(int p = 0; p < due_count && !wanted; p++)
+            {
+                wanted = plantSensor(due[p], source->role) == source;
             }
-            break;
-        case PLANT_WET_HOLD:
-            switch(new_state){
-                case PLANT_DRYING: valid = true; break;
-                case PLANT_PUMP_DELAY: valid = true; break;
-                default: /* invalid */ break;
+        }
+        if(wanted){
+            requests[count] = (struct sensor_request_struct){
+                .driver = sensor_roles[source->role].driver,
+                .pin = source->pin,
+                .reading = &source->latest
+            };
+            acquired[count++] = source;
+        }
+    }
+
+    if(use_fake_poll){
+        // The synthetic model provides moisture and level, but an energy profile counts the reads
+        // a board with sensors would make
+        sensor_drivers_count(requests, count);
+        return next_us;
+    }
+
+    sensor_drivers_acquire(requests, count, now);
+    for(int i = 0; i < count; i++)
+    {
+        applySensorReading(acquired[i]);
+    }
+    return next_us;
+}
+
+// Completes the poll of the due plants from their sources' latest readings
+void pollSensors(struct plant_struct** due, int due_count, uint64_t now, esp_mqtt_client_handle_t client)
+{
+    if(use_fake_poll){
+        for(int p = 0; p < due_count; p++)
+        {
+            stepSyntheticSensors(due[p], now);
+            due[p]->status.last_poll_time_us = now;
+        }
+    }
+    else
+    {
+        // acquireSensors has just sampled their moisture
+        for(int p = 0; p < due_count; p++)
+        {
+            struct plant_struct *plant = due[p];
+            const struct sensor_reading_struct *moisture = &plantSensor(plant, SENSOR_ROLE_MOISTURE)->latest;
+            const struct sensor_reading_struct *level = &plantSensor(plant, SENSOR_ROLE_LEVEL)->latest;
+            const struct sensor_reading_struct *environment = &plantSensor(plant, SENSOR_ROLE_ENVIRONMENT)->latest;
+            plant->status.last_poll_time_us = now;
+
+            // Each level burst goes into the statistics once, however many polls see it
+            bool new_level = level->time_us != plant->status.level_stats_time_us;
+            plant->status.level_stats_time_us = level->time_us;
+            updateSensorStats(plant, moisture->samples, new_level ? level->samples : NULL, client);
+
+            if(trace_enabled){
+                tracePoll(plant, moisture->samples, level->samples, environment->ok, now, client);
             }
-            break;
-        default:
-            break;
+        }
+    }
+
+    for(int p = 0; p < due_count; p++)
+    {
+        logPoll(due[p]);
+    }
+}
+
+void turnOnPump(struct plant_struct* plant)
+{
+    // Faulty sensors must not drive the pump, e.g. a moisture sensor stuck at 0 reads as bone dry
+    if(enable_pump && plant->status.poll_median_level_sensor > LEVEL_SENSOR_EMPTY &&
+        !plant->status.moisture_faults && !plant->status.level_faults){
+        plant->status.pump_on_start_us = esp_timer_get_time();
+        pump_safety_reset(&plant->status.pump_safety);  // The timer is stopped, nothing else touches it now
+        __atomic_store_n(&plant->status.pump_running, true, __ATOMIC_RELEASE);
+        gpio_set_level(plant->pins.pump_gpio_pin, 0); // Turn ON pump (active low)
+        esp_timer_start_periodic(plant->status.pump_safety_timer, PUMP_SAFETY_SAMPLE_PERIOD_US);
+    }
+}
+
+// Called from both the scheduler and the pump safety timer.  Only the caller that clears
+// pump_running accounts the run, so a run racing a safety trip is counted once.
+void turnOffPump(struct plant_struct* plant)
+{
+    gpio_set_level(plant->pins.pump_gpio_pin, 1); // Turn OFF pump (active low)
+    if(__atomic_exchange_n(&plant->status.pump_running, false, __ATOMIC_ACQ_REL)){
+        plant->status.pump_on_total_us += esp_timer_get_time() - plant->status.pump_on_start_us;
+        esp_timer_stop(plant->status.pump_safety_timer);
+    }
+}
+
+// Runs from the esp_timer task every PUMP_SAFETY_SAMPLE_PERIOD_US while the pump is on, so the
+// pump is cut within a few milliseconds of the reservoir running dry no matter how busy the
+// control and network tasks are.  The control loop raises PLANT_ALARM when it next runs.
+static void pump_safety_timer_cb(void *arg)
+{
+    struct plant_struct *plant = arg;
+
+    if(!plant->status.pump_running){
+        return;     // Fired as turnOffPump stopped the timer, turnOnPump resets the run
+    }
+
+    int level;
+    if(use_fake_poll){
+        level = PLANT_SYNTHETIC_LEVEL; // No level sensor is fitted, its pin may read anything
+    }else{
+        int level_readings[3];
+        for(int i = 0; i < 3; i++)
+        {
+            level_readings[i] = adc1_get_raw(plant->pins.level_sensor_adc1_channel);
+        }
+        level = opt_med3(level_readings); // Reject single sample spikes
+    }
+    plant_energy_count(PLANT_ENERGY_SAFETY_READ, 1);   // Synthetic runs too, they profile a real board
+
+    if(pump_safety_sample(&plant->status.pump_safety, level, LEVEL_SENSOR_EMPTY, esp_timer_get_time())){
+        turnOffPump(plant);
+        plant->status.pump_safety_level = level;
+        plant->status.pump_safety_latency_us = esp_timer_get_time() - plant->status.pump_safety.first_empty_us;
+        plant->status.pump_safety_tripped = true;
+        wakePlantScheduler();
+    }
+}
+
+// Publishes the energy model's totals and daily projections for the run so far
+void publishEnergyMetrics(esp_mqtt_client_handle_t client, uint64_t now)
+{
+    struct plant_energy_report_struct report;
+    uint64_t pump_on_us = 0;
+
+    for(int i = 0; i < PLANT_COUNT; i++)
+    {
+        pump_on_us += plants[i].status.pump_on_total_us;
+    }
+    plant_energy_report(&report, now, pump_on_us, CONFIG_PLANT_BASELINE_CURRENT_MA, CONFIG_PLANT_PUMP_CURRENT_MA, CONFIG_PLANT_PUMP_FLOW_ML_PER_MIN);
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "type", "energy");
+    cJSON_AddNumberToObject(root, "uptime_s", now / SEC_IN_MICROSEC);
+    cJSON *counts = cJSON_AddObjectToObject(root, "counts");
+    cJSON *mah = cJSON_AddObjectToObject(root, "mah");
+    for(int i = 0; i < PLANT_ENERGY_EVENT_COUNT; i++)
+    {
+        cJSON_AddNumberToObject(counts, plant_energy_event_names[i], report.counts[i]);
+        cJSON_AddNumberToObject(mah, plant_energy_event_names[i], report.event_mah[i]);
+    }
+    cJSON_AddNumberToObject(mah, "baseline", report.baseline_mah);
+    cJSON_AddNumberToObject(mah, "pump", report.pump_mah);
+    cJSON_AddNumberToObject(root, "total_mah", report.total_mah);
+    cJSON_AddNumberToObject(root, "mah_per_day", report.mah_per_day);
+    cJSON_AddNumberToObject(root, "water_ml", report.water_ml);
+    cJSON_AddNumberToObject(root, "water_ml_per_day", report.water_ml_per_day);
+    cJSON *pump_s = cJSON_AddArrayToObject(root, "pump_s");
+    for(int i = 0; i < PLANT_COUNT; i++)
+    {
+        cJSON_AddItemToArray(pump_s, cJSON_CreateNumber(plants[i].status.pump_on_total_us / (float) SEC_IN_MICROSEC));
     }
+    char *my_json_string = cJSON_PrintUnformatted(root);
+    mqttPublish(client, topics.metrics, my_json_string, 0, 0, 0);
+    free(my_json_string);
+    cJSON_Delete(root);
+}
+
+void publishPumpSafetyAlarm(struct plant_struct* plant, esp_mqtt_client_handle_t client)
+{
+    PLANT_LOG(PLOG_PUMP_SAFETY_TRIP, PLOG_I(plant_index(plant)), PLOG_I(plant->status.pump_safety_level), PLOG_I(plant->status.pump_safety_latency_us));
+
+    if(client && mqtt_connected){
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddNumberToObject(root, "plant", plant_index(plant));
+        cJSON_AddStringToObject(root, "alarm", "reservoir_empty");
+        cJSON_AddNumberToObject(root, "water_available", plant->status.pump_safety_level);
+        cJSON_AddNumberToObject(root, "detect_latency_us", plant->status.pump_safety_latency_us);
+        cJSON_AddNumberToObject(root, "sample_period_us", PUMP_SAFETY_SAMPLE_PERIOD_US);
+        char *my_json_string = cJSON_PrintUnformatted(root);
+        mqttPublish(client, topics.alarm, my_json_string, 0, 1, 0);
+        free(my_json_string);
+        cJSON_Delete(root);
+    }
+}
+
+esp_err_t store_dosing_to_nvs(const struct plant_dosing_struct *dosing, const char *nvs_key);
+
+// Reports how the watering that just ended went: time to reach high_moisture, pulses and overshoot
+void publishWateringMetrics(struct plant_struct* plant, esp_mqtt_client_handle_t client)
+{
+    struct plant_status_struct *status = &plant->status;
+    int overshoot = status->machine.watering_peak_moisture - plant->config.high_moisture;
+    if(overshoot < 0){
+        overshoot = 0;
+    }
+
+    PLANT_LOG(PLOG_WATERED, PLOG_I(plant_index(plant)), PLOG_I(status->machine.watering_time_s), PLOG_I(status->machine.watering_pulses), PLOG_I(overshoot));
+
+    if(client && mqtt_connected){
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "watering");
+        cJSON_AddNumberToObject(root, "plant", plant_index(plant));
+        cJSON_AddNumberToObject(root, "time_to_target_s", status->machine.watering_time_s);
+        cJSON_AddNumberToObject(root, "pulses", status->machine.watering_pulses);
+        cJSON_AddNumberToObject(root, "pump_s", (status->pump_on_total_us - status->machine.watering_start_pump_us) / (float) SEC_IN_MICROSEC);
+        cJSON_AddNumberToObject(root, "overshoot", 100*overshoot / (float) (MOISTURE_SENSOR_WET - MOISTURE_SENSOR_DRY));
+        cJSON_AddNumberToObject(root, "gain", plant_dosing[plant_index(plant)].gain);
+        char *my_json_string = cJSON_PrintUnformatted(root);
+        mqttPublish(client, topics.metrics, my_json_string, 0, 0, 0);
+        free(my_json_string);
+        cJSON_Delete(root);
+    }
+}
+
+// Watering state machine hooks (plant_state.h), ctx is the plant
+static void plantStateChange(void *ctx, enum PlantStates old_state, enum PlantStates new_state, bool valid, uint64_t now)
+{
+    struct plant_struct *plant = ctx;
 
     if(valid){
         if(new_state == PLANT_PUMP_ON)
@@ -509,96 +1494,175 @@ void changeState(struct plant_struct* plant, enum PlantStates new_state, uint64_
         {
             turnOffPump(plant);
         }
-        ESP_LOGI(TAG, "%s -> %s %f", PlantStateString[plant->status.state], PlantStateString[new_state], ((float)now) / SEC_IN_MICROSEC);
-        plant->status.state_entry_time_us = now;
-        plant->status.state = new_state;
+        PLANT_LOG(PLOG_STATE_CHANGE, PLOG_I(plant_index(plant)), PLOG_I(old_state), PLOG_I(new_state), PLOG_F(((float)now) / SEC_IN_MICROSEC));
     }else{
         // Turn Pump Off
-        ESP_LOGI(TAG, "ALARM!  %s -> %s %f", PlantStateString[plant->status.state], PlantStateString[new_state], ((float)now) / SEC_IN_MICROSEC);
-        plant->status.state_entry_time_us = now;
-        plant->status.state = PLANT_ALARM;
+        PLANT_LOG(PLOG_STATE_ALARM, PLOG_I(plant_index(plant)), PLOG_I(old_state), PLOG_I(new_state), PLOG_F(((float)now) / SEC_IN_MICROSEC));
     }
 }
 
-void handleStateMachine(struct plant_struct* plant, esp_mqtt_client_handle_t client)
+static void plantDose(void *ctx)
 {
-    uint64_t now = esp_timer_get_time();
+    struct plant_struct *plant = ctx;
+    struct plant_dosing_struct *dosing = &plant_dosing[plant_index(plant)];
+    PLANT_LOG(PLOG_DOSE, PLOG_I(plant_index(plant)), PLOG_I(plant->status.machine.dose_pulse_ms), PLOG_F(dosing->gain), PLOG_I(dosing->cycles));
+}
+
+static void plantDosingLearned(void *ctx)
+{
+    struct plant_struct *plant = ctx;
+    store_dosing_to_nvs(&plant_dosing[plant_index(plant)], plant_dosing_nvs_keys[plant_index(plant)]);
+}
+
+static void plantWatered(void *ctx)
+{
+    publishWateringMetrics(ctx, mqtt_client);
+}
 
-    if(!plant->status.initialized)
+static const struct plant_state_hooks_struct plant_state_hooks = {
+    .change = plantStateChange,
+    .dose = plantDose,
+    .learned = plantDosingLearned,
+    .watered = plantWatered,
+};
+
+void initPlant(struct plant_struct* plant, uint64_t now)
+{
+    // Level monitor used while the pump runs
+    const esp_timer_create_args_t pump_safety_timer_args = {
+        .callback = &pump_safety_timer_cb,
+        .arg = plant,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "pump_safety"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&pump_safety_timer_args, &plant->status.pump_safety_timer));
+
+    // Setup the GPIO pin for controlling the pump (pump is active low)
+    gpio_pad_select_gpio(plant->pins.pump_gpio_pin);
+    gpio_set_direction(plant->pins.pump_gpio_pin, GPIO_MODE_OUTPUT);
+    turnOffPump(plant); // Turn pump OFF (active low)
+
+    sensor_stats_init(&plant->status.moisture_stats);
+    sensor_stats_init(&plant->status.level_stats);
+
+    plant_state_init(&plant->status.machine, &plant->config, &plant_dosing[plant_index(plant)], PLANT_LEARNED_MAX_PULSE_S,
+        &plant_state_hooks, plant, now);
+    plant->status.initialized = true;
+}
+
+void handleStateMachine(struct plant_struct* plant, uint64_t now, esp_mqtt_client_handle_t client)
+{
+    if(plant->status.pump_safety_tripped)
     {
-        initPlant(plant, now, client);
+        plant->status.pump_safety_tripped = false;
+        plant_state_change(&plant->status.machine, PLANT_ALARM, now);
+        publishPumpSafetyAlarm(plant, client);
+    }
+
+    plant_state_step(&plant->status.machine, plant->status.poll_median_moisture_sensor, plant->status.pump_on_total_us, now);
+}
+
+// Time of the plant's next timed transition or poll, UINT64_MAX if it has none
+uint64_t plantNextDeadline(const struct plant_struct* plant)
+{
+    if(plant->status.machine.state == PLANT_ALARM){
+        return UINT64_MAX; // Not polled until reset
+    }
+    uint64_t state_period_us = plant_state_period_us(&plant->status.machine);
+
+    // Transitions fire once the period has been exceeded, hence the +1
+    uint64_t deadline = plant->status.last_poll_time_us + plant->config.polling_period_s * SEC_IN_MICROSEC + 1;
+    if(state_period_us){
+        uint64_t state_deadline = plant->status.machine.state_entry_time_us + state_period_us + 1;
+        if(state_deadline < deadline){
+            deadline = state_deadline;
+        }
     }
+    return deadline;
+}
 
-    if(plant->status.state < PLANT_ALARM && now - plant->status.last_poll_time_us > plant->config.polling_period_s * SEC_IN_MICROSEC)
+// Services every plant from one loop: polls the plants that are due in one batch, runs each
+// state machine, then sleeps until the earliest deadline across all plants.  MQTT events and
+// the pump safety cutoff wake it early through wakePlantScheduler().
+void runPlantScheduler(void)
+{
+    struct plant_struct *due[PLANT_COUNT];
+    uint64_t now = esp_timer_get_time();
+    uint64_t last_energy_report_us = now;
+
+    plant_scheduler_task = xTaskGetCurrentTaskHandle();
+
+    for(int i = 0; i < PLANT_COUNT; i++)
     {
-        pollSensors(plant, now, client);
+        initPlant(&plants[i], now);
+        due[i] = &plants[i];
     }
+    initSensorSources(now);
+    acquireSensors(due, PLANT_COUNT, now, true);
+    pollSensors(due, PLANT_COUNT, now, mqtt_client);
 
-    switch(plant->status.state){
-        case PLANT_DRYING:
-            if(plant->status.poll_median_moisture_sensor < plant->config.low_moisture)
-            {
-                changeState(plant, PLANT_DRY_HOLD, now);
-            }
-            else
-            {
-                // Stay in PLANT_DRYING state
-            }
-            break;
-        case PLANT_DRY_HOLD:
-            if(plant->status.poll_median_moisture_sensor > plant->config.low_moisture)
-            {
-                changeState(plant, PLANT_DRYING, now);
-            }
-            else if(now - plant->status.state_entry_time_us > plant->config.dry_hold_period_s * SEC_IN_MICROSEC)
-            {
-                changeState(plant, PLANT_PUMP_DELAY, now);
-            }
-            else
-            {
-                // Stay in PLANT_DRY_HOLD state
-            }
-            break;
-        case PLANT_PUMP_DELAY:
-            if(plant->status.poll_median_moisture_sensor >= plant->config.high_moisture)
-            {
-                changeState(plant, PLANT_WET_HOLD, now);
-            }
-            else if(now - plant->status.state_entry_time_us > plant->config.pump_off_period_s * SEC_IN_MICROSEC)
-            {
-                changeState(plant, PLANT_PUMP_ON, now);
-            }
-            else
-            {
-                // Stay in PLANT_PUMP_DELAY state
-            }
-            break;
-        case PLANT_PUMP_ON:
-            if(now - plant->status.state_entry_time_us > plant->config.pump_on_period_s * SEC_IN_MICROSEC)
-            {
-                changeState(plant, PLANT_PUMP_DELAY, now);
-            }
-            else
-            {
-                // Stay in PLANT_PUMP_ON state
-            }
-            break;
-        case PLANT_WET_HOLD:
-            if(plant->status.poll_median_moisture_sensor <= plant->config.watered_moisture)
+    while(1)
+    {
+        now = esp_timer_get_time();
+        esp_mqtt_client_handle_t client = mqtt_client;
+        bool force_publish = publish_requested;
+
+        int due_count = 0;
+        for(int i = 0; i < PLANT_COUNT; i++)
+        {
+            struct plant_struct *plant = &plants[i];
+            if(plant->status.machine.state < PLANT_ALARM && 
+                (force_publish || now - plant->status.last_poll_time_us > plant->config.polling_period_s * SEC_IN_MICROSEC))
             {
-                changeState(plant, PLANT_PUMP_DELAY, now);
+                due[due_count++] = plant;
             }
-            else if(now - plant->status.state_entry_time_us > plant->config.wet_hold_period_s * SEC_IN_MICROSEC)
-            {
-                changeState(plant, PLANT_DRYING, now);
+        }
+        uint64_t next_deadline = acquireSensors(due, due_count, now, false);
+        if(due_count){
+            pollSensors(due, due_count, now, client);
+        }
+
+        for(int i = 0; i < PLANT_COUNT; i++)
+        {
+            struct plant_struct *plant = &plants[i];
+            enum PlantStates old_state = plant->status.machine.state;
+
+            handleStateMachine(plant, now, client);
+            publishPlant(plant, now, force_publish, client);
+
+            uint64_t deadline = plantNextDeadline(plant);
+            if(plant->status.machine.state != old_state){
+                // Conditions in the new state are re-checked after a short delay, as a polled loop would
+                deadline = now + PLANT_SCHEDULER_MIN_SLEEP_US;
             }
-            else
-            {
-                // Stay in PLANT_WET_HOLD state
+            if(deadline < next_deadline){
+                next_deadline = deadline;
             }
-            break;
-        default:
-            break;
+        }
+
+        if(force_publish && telemetryReady(client)){
+            publish_requested = false;
+        }
+
+        plant_ota_poll(now);
+
+        if(!trace_enabled && trace_buffer_len){
+            flushTrace(client);     // Tracing was turned off, send the partial buffer
+        }
+
+        if(now - last_energy_report_us >= ENERGY_REPORT_PERIOD_S * SEC_IN_MICROSEC && client && mqtt_connected){
+            publishEnergyMetrics(client, now);
+            last_energy_report_us = now;
+        }
+
+        now = esp_timer_get_time();
+        uint64_t sleep_us = next_deadline > now ? next_deadline - now : 0;
+        if(sleep_us > PLANT_SCHEDULER_MAX_SLEEP_US){
+            sleep_us = PLANT_SCHEDULER_MAX_SLEEP_US;
+        }
+        // Round up so we wake after the deadline, and always yield at least one tick
+        TickType_t ticks = (sleep_us + portTICK_PERIOD_MS * 1000 - 1) / (portTICK_PERIOD_MS * 1000);
+        ulTaskNotifyTake(pdTRUE, ticks ? ticks : 1);
     }
 }
 
@@ -617,6 +1681,7 @@ esp_err_t store_plant_to_nvs(struct plant_struct *plant, const char *nvs_key){
 
     // Commit
     err = nvs_commit(my_handle);
+    plant_energy_count(PLANT_ENERGY_NVS_COMMIT, 1);
     if (err != ESP_OK) return err;
 
     // Close
@@ -656,20 +1721,129 @@ esp_err_t  read_plant_from_nvs(struct plant_struct *plant, const char *nvs_key){
     return ESP_OK;    
 }
 
-void app_main(void)
+#if CONFIG_PLANT_ROLE_NODE
+static void node_link_receive(void *user, const uint8_t *addr, const uint8_t *data, size_t len)
 {
-    
-    ESP_LOGI(TAG, "[APP] Startup..");
+    static char command[PLANT_LINK_MAX_TEXT + 1];
+    const struct plant_link_header_struct *header = (const struct plant_link_header_struct *) data;
+
+    if(len < sizeof(*header) || header->magic != PLANT_LINK_MAGIC || header->type != PLANT_LINK_COMMAND ||
+        header->seq == link_last_command_seq){
+        return;
+    }
+    link_last_command_seq = header->seq;
+    memcpy(command, data + sizeof(*header), len - sizeof(*header));
+    command[len - sizeof(*header)] = 0;
+    process_mqqt_data(NULL, command);
+}
+
+// Sensor nodes start Wi-Fi without associating and reach the broker through a gateway over ESP-NOW
+static void node_link_start(void)
+{
+    unsigned int mac[PLANT_LINK_ADDR_LEN];
+    if(6 != sscanf(CONFIG_PLANT_LINK_GATEWAY_MAC, "%x:%x:%x:%x:%x:%x", &mac[0], &mac[1], &mac[2], &mac[3], &mac[4], &mac[5])){
+        ESP_ERROR_CHECK(ESP_ERR_INVALID_ARG);
+    }
+    for(int i = 0; i < PLANT_LINK_ADDR_LEN; i++)
+    {
+        link_gateway_addr[i] = mac[i];
+    }
+
+    wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
+    ESP_ERROR_CHECK(esp_wifi_init(&cfg));
+    ESP_ERROR_CHECK(esp_wifi_set_storage(WIFI_STORAGE_RAM));
+    ESP_ERROR_CHECK(esp_wifi_set_mode(WIFI_MODE_STA));
+    ESP_ERROR_CHECK(esp_wifi_start());
+    ESP_ERROR_CHECK(esp_wifi_set_channel(CONFIG_PLANT_LINK_CHANNEL, WIFI_SECOND_CHAN_NONE));
+    ESP_ERROR_CHECK(plant_link_espnow.start(plant_link_espnow.ctx, node_link_receive, NULL) == 0 ? ESP_OK : ESP_FAIL);
+
+    link_ready = true;
+    publish_requested = true; // Send current state right away
+    wakePlantScheduler();
+}
+#endif
+
+esp_err_t store_dosing_to_nvs(const struct plant_dosing_struct *dosing, const char *nvs_key){
+    nvs_handle_t my_handle;
+    esp_err_t err;
+
+    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) return err;
+
+    err = nvs_set_blob(my_handle, nvs_key, dosing, sizeof(*dosing));
+    if (err == ESP_OK){
+        err = nvs_commit(my_handle);
+        plant_energy_count(PLANT_ENERGY_NVS_COMMIT, 1);
+    }
+
+    nvs_close(my_handle);
+    return err;
+}
+
+esp_err_t read_dosing_from_nvs(struct plant_dosing_struct *dosing, const char *nvs_key){
+    nvs_handle_t my_handle;
+    esp_err_t err;
+
+    err = nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &my_handle);
+    if (err != ESP_OK) return err;
+
+    // Nothing learned yet is not an error
+    size_t required_size = sizeof(*dosing);
+    err = nvs_get_blob(my_handle, nvs_key, dosing, &required_size);
+    if (err == ESP_ERR_NVS_NOT_FOUND || err == ESP_ERR_NVS_INVALID_LENGTH){
+        memset(dosing, 0, sizeof(*dosing));
+        err = ESP_OK;
+    }else if (err == ESP_OK){
+        ESP_LOGI(TAG, "Dosing \"%s\": %0.1f counts/s from %d measurements", nvs_key, dosing->gain, dosing->cycles);
+    }
+
+    nvs_close(my_handle);
+    return err;
+}
+
+static void boot_got_ip_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+    if(boot_timing.wifi_got_ip_us == 0){
+        boot_timing.wifi_got_ip_us = esp_timer_get_time();
+    }
+}
+
+// Brings up netif, Wi-Fi and MQTT off the control path so the watering loop
+// does not wait on the network at boot
+static void network_start_task(void *pvParameters)
+{
+    ESP_ERROR_CHECK(esp_netif_init());
+    ESP_ERROR_CHECK(esp_event_loop_create_default());
+    ESP_ERROR_CHECK(esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &boot_got_ip_handler, NULL));
+
+#if CONFIG_PLANT_ROLE_NODE
+    node_link_start();
+#else
+    wifi_init_sta();
+#if CONFIG_PLANT_ROLE_GATEWAY
+    gateway_start();
+#endif
+    mqtt_client = mqtt_app_start();
+#endif
+    boot_timing.network_init_done_us = esp_timer_get_time();
+
     ESP_LOGI(TAG, "[APP] Free memory: %d bytes", esp_get_free_heap_size());
     ESP_LOGI(TAG, "[APP] IDF version: %s", esp_get_idf_version());
+    for(int i = 0; i < PLANT_COUNT; i++)
+    {
+        printf("Plant %d (\"%s\"):\n", i, plant_nvs_keys[i]);
+        print_plant_struct(&plants[i]);
+    }
+
+    vTaskDelete(NULL);
+}
+
+void app_main(void)
+{
+    ESP_LOGI(TAG, "[APP] Startup..");
 
     esp_log_level_set("*", ESP_LOG_INFO);
-    esp_log_level_set("MQTT_CLIENT", ESP_LOG_VERBOSE);
-    esp_log_level_set("MQTT_EXAMPLE", ESP_LOG_VERBOSE);
-    esp_log_level_set("TRANSPORT_TCP", ESP_LOG_VERBOSE);
-    esp_log_level_set("TRANSPORT_SSL", ESP_LOG_VERBOSE);
-    esp_log_level_set("TRANSPORT", ESP_LOG_VERBOSE);
-    esp_log_level_set("OUTBOX", ESP_LOG_VERBOSE);
+    plant_log_init();
 
     // Initialize flash if not already initialized
     esp_err_t err = nvs_flash_init();
@@ -681,19 +1855,19 @@ void app_main(void)
     }
     ESP_ERROR_CHECK( err );
 
-    ESP_ERROR_CHECK(esp_netif_init());
-    ESP_ERROR_CHECK(esp_event_loop_create_default());
-
-    ESP_ERROR_CHECK(read_plant_from_nvs(&global_plant, PLANT_NVS_KEY));
-    print_plant_struct(&global_plant);
-
-    // Enable wifi and mqtt by removing these comments
-    wifi_init_sta();
-    esp_mqtt_client_handle_t client = mqtt_app_start();
-
-    while(1)
+    init_device_id();
+    plant_ota_init(device_id);
+    initPlantRegistry();
+    for(int i = 0; i < PLANT_COUNT; i++)
     {
-        handleStateMachine(&global_plant, client);
-        vTaskDelay(100 / portTICK_PERIOD_MS); // Allow other tasks to run
+        ESP_ERROR_CHECK(read_plant_from_nvs(&plants[i], plant_nvs_keys[i]));
+        ESP_ERROR_CHECK(read_dosing_from_nvs(&plant_dosing[i], plant_dosing_nvs_keys[i]));
     }
+    boot_timing.nvs_ready_us = esp_timer_get_time();
+
+    // Wifi and mqtt come up in parallel with the control loop
+    xTaskCreate(network_start_task, "network_start", 4096, NULL, 1, NULL);
+
+    boot_timing.control_start_us = esp_timer_get_time();
+    runPlantScheduler();
 }
@@ -0,0 +1,24 @@
+/* Plant Thing host tests
+
+   The portable modules (no ESP-IDF calls) are built and run on the host:
+       make -C main/host_test
+*/
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+static int host_test_failures = 0;
+
+#define CHECK(cond) do{ \
+    if(!(cond)){ \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+        host_test_failures++; \
+    } \
+}while(0)
+
+// Ends main(), printing a summary line
+#define HOST_TEST_DONE() do{ \
+    printf("%s: %s\n", __FILE__, host_test_failures ? "FAILED" : "passed"); \
+    return host_test_failures ? EXIT_FAILURE : EXIT_SUCCESS; \
+}while(0)
@@ -0,0 +1,304 @@
+/* Replays plant sensor traces (main/plant_trace.h) through the firmware's state machine
+
+   plant_replay [-l max_pulse_s] trace.bin
+
+   Feeds each poll's moisture median to plant_state.c, along with the
+   scheduler passes that fall due between polls, and prints one line per
+   transition.  Exits with status 1 if the state the device recorded at a
+   poll differs from the replay's, or if a pump pulse the replay started was
+   sized differently by the device.  -l sizes pulses from the learned gain, as
+   a CONFIG_PLANT_LEARNED_DOSING build with CONFIG_PLANT_DOSING_MAX_PULSE_S
+   max_pulse_s does.
+
+   Until the replay has seen a plant change state on a reading, it takes the
+   plant's state from the trace without checking it, since the time the plant
+   entered that state is unknown.  Each poll takes the gain the device had
+   learned, and a pump pulse the device recorded is used from then on.  The
+   trace does not hold the pump's run time, which the device learns from and
+   which runs over the pulse by up to a scheduler pass, so a pulse is checked
+   by sizing it again from the gain the device recorded while it ran.
+
+   tools/plant_trace_dump.py replay builds and runs this, and compares the
+   transitions to a golden file.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "plant_state.h"
+#include "plant_trace.h"
+
+#define PLANT_SCHEDULER_MIN_SLEEP_US 100000ull  // As app_main.c, the pass after a state change
+#define SLACK_US 250000ull          // The firmware acts on a deadline up to a few scheduler ticks late
+#define MAX_PLANTS 256
+
+static const char *state_names[] = { "DRYING", "PUMP_DELAY", "PUMP_ON", "WET_HOLD", "DRY_HOLD", "ALARM" };
+
+// Transition lines, kept in memory so a lookahead that is not taken can be dropped
+static char *lines = NULL;
+static size_t lines_len = 0, lines_size = 0;
+
+struct replayed_plant_struct{
+    int plant;
+    struct plant_state_struct machine;
+    struct plant_watering_config_struct config;
+    struct plant_dosing_struct dosing;
+    uint16_t reading;               // Last poll's moisture median
+    uint64_t recheck_us;            // Pass after a state change, 0 = none
+    bool entry_known;               // State entry time known, so the recorded states can be checked
+    bool pulse_sized;               // Current pulse sized by the replay, so it can be checked
+    uint64_t pump_on_us;            // As pump_on_total_us, for learning from pulses
+    uint64_t pump_on_start_us;
+};
+
+static void add_line(const char *format, uint64_t now, int plant, const char *a, const char *b)
+{
+    char line[128];
+    int len = snprintf(line, sizeof(line), format, now / 1e6, plant, a, b);
+    if(lines_len + len + 1 > lines_size){
+        lines_size = lines_size ? 2 * lines_size : 1 << 16;
+        lines = realloc(lines, lines_size);
+    }
+    memcpy(lines + lines_len, line, len + 1);
+    lines_len += len;
+}
+
+static const char *state_name(int state)
+{
+    static char number[8];
+    if(state >= 0 && state < (int) (sizeof(state_names) / sizeof(state_names[0]))){
+        return state_names[state];
+    }
+    snprintf(number, sizeof(number), "%d", state);
+    return number;
+}
+
+// turnOnPump and turnOffPump's run time accounting, and the transition line
+static void replay_change(void *ctx, enum PlantStates old_state, enum PlantStates new_state, bool valid, uint64_t now)
+{
+    struct replayed_plant_struct *replayed = ctx;
+    enum PlantStates state = valid ? new_state : PLANT_ALARM;
+
+    if(old_state == PLANT_PUMP_ON){
+        replayed->pump_on_us += now - replayed->pump_on_start_us;
+    }
+    if(state == PLANT_PUMP_ON){
+        replayed->pump_on_start_us = now;
+        replayed->pulse_sized = true;
+    }
+    add_line("%.3f plant %d %s -> %s\n", now, replayed->plant, state_name(old_state), state_name(state));
+}
+
+static const struct plant_state_hooks_struct replay_hooks = {
+    .change = replay_change,
+};
+
+// Points the machine at this copy of the plant, after it was copied for a lookahead
+static void attach(struct replayed_plant_struct *replayed, float max_pulse_s)
+{
+    replayed->machine.config = &replayed->config;
+    replayed->machine.dosing = &replayed->dosing;
+    replayed->machine.max_pulse_s = max_pulse_s;
+    replayed->machine.hooks = &replay_hooks;
+    replayed->machine.ctx = replayed;
+}
+
+// Time the current state's period is exceeded, as plantNextDeadline, 0 if it has none
+static uint64_t state_deadline(const struct replayed_plant_struct *replayed)
+{
+    uint64_t period_us = plant_state_period_us(&replayed->machine);
+    return period_us ? replayed->machine.state_entry_time_us + period_us + 1 : 0;
+}
+
+// One scheduler pass at now on the last poll's reading
+static void step(struct replayed_plant_struct *replayed, uint64_t now)
+{
+    enum PlantStates old_state = replayed->machine.state;
+    uint64_t deadline = state_deadline(replayed);
+    bool timed = deadline && now >= deadline;
+
+    plant_state_step(&replayed->machine, replayed->reading, replayed->pump_on_us, now);
+    if(replayed->machine.state != old_state){
+        replayed->recheck_us = now + PLANT_SCHEDULER_MIN_SLEEP_US;
+        // A transition on a reading happens at a known time, one on a deadline only if the
+        // state's own entry time was known
+        replayed->entry_known |= !timed;
+    }else{
+        replayed->recheck_us = 0;
+    }
+}
+
+// Runs the scheduler passes that fall due before until, on the last poll's reading
+static void advance(struct replayed_plant_struct *replayed, uint64_t until)
+{
+    while(1)
+    {
+        uint64_t wake = state_deadline(replayed);
+        if(replayed->recheck_us && (!wake || replayed->recheck_us < wake)){
+            wake = replayed->recheck_us;
+        }
+        if(!wake || wake >= until){
+            return;
+        }
+        step(replayed, wake);
+    }
+}
+
+// Median of the poll's moisture burst, as poll_median_moisture_sensor
+static uint16_t median9(const struct plant_trace_record_struct *record)
+{
+    uint16_t sorted[PLANT_TRACE_SAMPLES];
+    memcpy(sorted, record->moisture_samples, sizeof(sorted));
+    for(int i = 1; i < PLANT_TRACE_SAMPLES; i++)
+    {
+        for(int j = i; j > 0 && sorted[j - 1] > sorted[j]; j--)
+        {
+            uint16_t swap = sorted[j];
+            sorted[j] = sorted[j - 1];
+            sorted[j - 1] = swap;
+        }
+    }
+    return sorted[PLANT_TRACE_SAMPLES / 2];
+}
+
+static uint8_t *load(const char *path, size_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if(!file){
+        perror(path);
+        exit(2);
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    uint8_t *data = malloc(*size ? *size : 1);
+    if(fread(data, 1, *size, file) != *size){
+        perror(path);
+        exit(2);
+    }
+    fclose(file);
+    return data;
+}
+
+int main(int argc, char **argv)
+{
+    float max_pulse_s = 0;
+
+    if(argc == 4 && 0 == strcmp(argv[1], "-l")){
+        max_pulse_s = atof(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+    if(argc != 2){
+        fprintf(stderr, "usage: %s [-l max_pulse_s] trace.bin\n", argv[0]);
+        return 2;
+    }
+
+    size_t size;
+    uint8_t *data = load(argv[1], &size);
+    clock_t start = clock();
+    static struct replayed_plant_struct plants[MAX_PLANTS];
+    bool known[MAX_PLANTS] = {false};
+    int plant_count = 0, polls = 0, divergences = 0;
+
+    for(size_t offset = 0; offset + sizeof(struct plant_trace_record_struct) <= size; )
+    {
+        struct plant_trace_record_struct record;
+        memcpy(&record, data + offset, sizeof(record));
+        if(record.magic != PLANT_TRACE_MAGIC || record.version != PLANT_TRACE_VERSION){
+            offset++;   // Resync, e.g. after a newline added by the subscriber
+            continue;
+        }
+        offset += sizeof(record);
+        polls++;
+
+        uint64_t t = record.time_us;
+        struct replayed_plant_struct *replayed = &plants[record.plant];
+        if(!known[record.plant]){
+            known[record.plant] = true;
+            plant_count++;
+            memset(replayed, 0, sizeof(*replayed));
+            replayed->plant = record.plant;
+            plant_state_init(&replayed->machine, &replayed->config, &replayed->dosing, max_pulse_s, &replay_hooks, replayed, t);
+            replayed->machine.state = record.state;
+            replayed->reading = median9(&record);
+        }
+        // Config commands apply from the next pass
+        replayed->config = (struct plant_watering_config_struct){
+            .low_moisture = record.low_moisture,
+            .watered_moisture = record.watered_moisture,
+            .high_moisture = record.high_moisture,
+            .polling_period_s = record.polling_period_s,
+            .pump_on_period_s = record.pump_on_period_s,
+            .pump_off_period_s = record.pump_off_period_s,
+            .wet_hold_period_s = record.wet_hold_period_s,
+            .dry_hold_period_s = record.dry_hold_period_s,
+        };
+
+        // Transitions the firmware made between the polls.  One whose deadline is within
+        // SLACK_US of this poll may have run just before it or in the same pass.
+        advance(replayed, t > SLACK_US ? t - SLACK_US : 0);
+        if(replayed->machine.state != record.state){
+            static struct replayed_plant_struct late;
+            size_t lines_before = lines_len;
+            late = *replayed;
+            attach(&late, max_pulse_s);
+            advance(&late, t + SLACK_US);
+            if(late.machine.state == record.state){
+                *replayed = late;
+                attach(replayed, max_pulse_s);
+            }else{
+                lines_len = lines_before;
+            }
+        }
+
+        if(replayed->machine.state != record.state){
+            if(replayed->entry_known){
+                add_line("%.3f plant %d DIVERGED: device %s, replay %s\n", t, record.plant, state_name(record.state), state_name(replayed->machine.state));
+                divergences++;
+            }
+            if(replayed->machine.state == PLANT_PUMP_ON){
+                replayed->pump_on_us += t - replayed->pump_on_start_us;
+            }
+            if(record.state == PLANT_PUMP_ON){
+                replayed->pump_on_start_us = t;
+            }
+            replayed->machine.state = record.state;
+            replayed->machine.state_entry_time_us = t;
+            replayed->recheck_us = 0;
+            replayed->entry_known = false;
+            replayed->pulse_sized = false;
+        }
+
+        // The recorded gain already includes what the transitions before the poll learned
+        replayed->dosing.gain = record.gain;
+        replayed->dosing.cycles = record.gain > 0;
+
+        if(record.state == PLANT_PUMP_ON){
+            uint32_t pulse_ms = plant_state_pulse_s(&replayed->machine, replayed->machine.dose_start_moisture) * 1000;
+            if(replayed->pulse_sized && pulse_ms != record.dose_pulse_ms){
+                char device[16], replay[16];
+                snprintf(device, sizeof(device), "%.3f", record.dose_pulse_ms / 1e3);
+                snprintf(replay, sizeof(replay), "%.3f", pulse_ms / 1e3);
+                add_line("%.3f plant %d DIVERGED: device pulse %s s, replay %s s\n", t, record.plant, device, replay);
+                divergences++;
+            }
+            replayed->machine.dose_pulse_ms = record.dose_pulse_ms;
+            replayed->pulse_sized = false;
+        }
+
+        replayed->reading = median9(&record);
+        step(replayed, t);
+    }
+
+    fwrite(lines, 1, lines_len, stdout);
+    fprintf(stderr, "%d polls, %d plants, %d divergences in %.3f s\n", polls, plant_count, divergences,
+        (double) (clock() - start) / CLOCKS_PER_SEC);
+    free(lines);
+    free(data);
+    return divergences ? 1 : 0;
+}
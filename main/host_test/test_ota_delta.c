@@ -0,0 +1,328 @@
+/* ota_delta.c against patches made by tools/plant_ota_delta.py diff, on a file-backed flash shim
+
+   test_ota_delta images old.bin new.bin        writes a pair of firmware-like images
+   test_ota_delta old.bin new.bin patch.bin     applies the patch and checks the result
+
+   The Makefile runs both, with the diff in between.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "host_test.h"
+#include "ota_delta.h"
+
+#define IMAGE_SIZE (200 * 1024)
+#define OTA_CHUNK_SIZE 4096         // PLANT_OTA_CHUNK_SIZE, what a resumed update requests
+
+// A flash partition in a file: erased sectors read 0xff and writes can only clear bits, as NOR flash
+struct flash_struct{
+    FILE *file;
+    uint32_t size;
+    uint32_t erases;
+    bool crossed_sector;
+};
+
+// What the update applies the patch against, and where it writes
+struct partitions_struct{
+    struct flash_struct old;
+    struct flash_struct new;
+    int checkpoints;
+    int cut;                                  // Checkpoint the power is cut after
+    struct ota_delta_state_struct saved;      // ... as saved to NVS
+};
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+    // xorshift32, the low bits of an LCG repeat too soon to stand in for code
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static int read_old(void *ctx, uint32_t offset, void *buf, size_t len)
+{
+    struct flash_struct *flash = &((struct partitions_struct *) ctx)->old;
+    if(offset + len > flash->size || fseek(flash->file, offset, SEEK_SET)){
+        return 1;
+    }
+    return fread(buf, 1, len, flash->file) != len;
+}
+
+static int write_new(void *ctx, uint32_t offset, const void *buf, size_t len)
+{
+    struct flash_struct *flash = &((struct partitions_struct *) ctx)->new;
+    uint8_t sector[OTA_DELTA_SECTOR_SIZE];
+
+    if(offset / OTA_DELTA_SECTOR_SIZE != (offset + len - 1) / OTA_DELTA_SECTOR_SIZE){
+        flash->crossed_sector = true;
+    }
+    if(offset + len > flash->size){
+        return 1;
+    }
+    // Erased as plant_ota.c does, when the output reaches the start of a sector
+    if(offset % OTA_DELTA_SECTOR_SIZE == 0){
+        memset(sector, 0xff, sizeof(sector));
+        fseek(flash->file, offset, SEEK_SET);
+        fwrite(sector, 1, sizeof(sector), flash->file);
+        flash->erases++;
+    }
+    fseek(flash->file, offset, SEEK_SET);
+    if(fread(sector, 1, len, flash->file) != len){
+        return 1;
+    }
+    for(size_t i = 0; i < len; i++)
+    {
+        sector[i] &= ((const uint8_t *) buf)[i];
+    }
+    fseek(flash->file, offset, SEEK_SET);
+    return fwrite(sector, 1, len, flash->file) != len;
+}
+
+static void checkpoint(void *ctx, const struct ota_delta_state_struct *state)
+{
+    struct partitions_struct *parts = ctx;
+    if(++parts->checkpoints == parts->cut){
+        parts->saved = *state;
+    }
+}
+
+static uint8_t *load(const char *path, uint32_t *size)
+{
+    FILE *file = fopen(path, "rb");
+    if(file == NULL){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fseek(file, 0, SEEK_END);
+    *size = ftell(file);
+    uint8_t *data = malloc(*size);
+    fseek(file, 0, SEEK_SET);
+    if(fread(data, 1, *size, file) != *size){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    fclose(file);
+    return data;
+}
+
+static void open_partitions(struct partitions_struct *parts, const uint8_t *old, uint32_t old_size, uint32_t new_size)
+{
+    memset(parts, 0, sizeof(*parts));
+    parts->old.file = tmpfile();
+    parts->old.size = old_size;
+    fwrite(old, 1, old_size, parts->old.file);
+    // The inactive partition holds whatever was there before, rounded up to whole sectors
+    parts->new.size = (new_size + OTA_DELTA_SECTOR_SIZE - 1) / OTA_DELTA_SECTOR_SIZE * OTA_DELTA_SECTOR_SIZE;
+    parts->new.file = tmpfile();
+    for(uint32_t i = 0; i < parts->new.size; i++)
+    {
+        fputc(rng(), parts->new.file);
+    }
+}
+
+static void close_partitions(struct partitions_struct *parts)
+{
+    fclose(parts->old.file);
+    fclose(parts->new.file);
+}
+
+static bool new_partition_holds(struct partitions_struct *parts, const uint8_t *image, uint32_t size)
+{
+    uint8_t *written = malloc(size);
+    fseek(parts->new.file, 0, SEEK_SET);
+    bool same = fread(written, 1, size, parts->new.file) == size && 0 == memcmp(written, image, size);
+    free(written);
+    return same;
+}
+
+// Feeds patch[from..] in chunks of chunk bytes, or of random sizes up to 2 * OTA_CHUNK_SIZE if chunk is 0.
+// Returns the last ota_delta_feed result.
+static int feed(struct ota_delta_state_struct *state, const struct ota_delta_io_struct *io, const uint8_t *patch, uint32_t patch_size,
+    uint32_t from, uint32_t chunk)
+{
+    int result = OTA_DELTA_OK;
+
+    for(uint32_t offset = from; offset < patch_size && result == OTA_DELTA_OK; )
+    {
+        uint32_t n = chunk ? chunk : 1 + rng() % (2 * OTA_CHUNK_SIZE);
+        if(n > patch_size - offset){
+            n = patch_size - offset;
+        }
+        result = ota_delta_feed(state, io, &patch[offset], n);
+        offset += n;
+    }
+    return result;
+}
+
+static void test_chunked(const uint8_t *old, uint32_t old_size, const uint8_t *new, uint32_t new_size, const uint8_t *patch, uint32_t patch_size)
+{
+    // One call, byte at a time, odd sizes, the OTA chunk size and random sizes
+    const uint32_t chunks[] = { patch_size, 1, 7, 255, OTA_CHUNK_SIZE, 0 };
+
+    for(int i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++)
+    {
+        struct partitions_struct parts;
+        struct ota_delta_state_struct state;
+        open_partitions(&parts, old, old_size, new_size);
+        const struct ota_delta_io_struct io = { .ctx = &parts, .read_old = read_old, .write_new = write_new, .checkpoint = checkpoint };
+
+        ota_delta_init(&state);
+        CHECK(feed(&state, &io, patch, patch_size, 0, chunks[i]) == OTA_DELTA_DONE);
+        CHECK(state.patch_offset == patch_size);
+        CHECK(state.output_offset == new_size);
+        CHECK(parts.new.erases == parts.new.size / OTA_DELTA_SECTOR_SIZE);
+        CHECK(parts.checkpoints == new_size / OTA_DELTA_SECTOR_SIZE);
+        CHECK(!parts.new.crossed_sector);
+        CHECK(new_partition_holds(&parts, new, new_size));
+        close_partitions(&parts);
+    }
+}
+
+// Cuts the update off part way after each checkpoint in turn, with the sectors after the checkpoint
+// partly written, and resumes from the checkpoint as plant_ota_init does after a reboot
+static void test_resume(const uint8_t *old, uint32_t old_size, const uint8_t *new, uint32_t new_size, const uint8_t *patch, uint32_t patch_size)
+{
+    int resumes = 0;
+
+    for(int cut = 1; ; cut++)
+    {
+        struct partitions_struct parts;
+        struct ota_delta_state_struct state;
+        open_partitions(&parts, old, old_size, new_size);
+        const struct ota_delta_io_struct io = { .ctx = &parts, .read_old = read_old, .write_new = write_new, .checkpoint = checkpoint };
+        parts.cut = cut;
+
+        ota_delta_init(&state);
+        int result = OTA_DELTA_OK;
+        for(uint32_t offset = 0; offset < patch_size && parts.checkpoints < cut && result == OTA_DELTA_OK; offset += OTA_CHUNK_SIZE)
+        {
+            uint32_t n = patch_size - offset < OTA_CHUNK_SIZE ? patch_size - offset : OTA_CHUNK_SIZE;
+            result = ota_delta_feed(&state, &io, &patch[offset], n);
+        }
+        if(parts.checkpoints < cut){
+            close_partitions(&parts);
+            break;  // No checkpoint left to cut after
+        }
+        CHECK(result == OTA_DELTA_OK || result == OTA_DELTA_DONE);
+
+        // Power cut: only the checkpoint survives
+        state = parts.saved;
+        CHECK(state.output_offset % OTA_DELTA_SECTOR_SIZE == 0);
+        CHECK(feed(&state, &io, patch, patch_size, state.patch_offset, OTA_CHUNK_SIZE) == OTA_DELTA_DONE);
+        CHECK(state.output_offset == new_size);
+        CHECK(new_partition_holds(&parts, new, new_size));
+        close_partitions(&parts);
+        resumes++;
+    }
+    CHECK(resumes == new_size / OTA_DELTA_SECTOR_SIZE);
+}
+
+static void test_bad_input(const uint8_t *old, uint32_t old_size, const uint8_t *new, uint32_t new_size, const uint8_t *patch, uint32_t patch_size)
+{
+    struct partitions_struct parts;
+    struct ota_delta_state_struct state;
+    const struct ota_delta_io_struct io = { .ctx = &parts, .read_old = read_old, .write_new = write_new, .checkpoint = checkpoint };
+    uint8_t *changed = malloc(old_size > patch_size ? old_size : patch_size);
+
+    // A patch for another old image is refused before anything is written
+    memcpy(changed, old, old_size);
+    changed[old_size / 2] ^= 0x01;
+    open_partitions(&parts, changed, old_size, new_size);
+    ota_delta_init(&state);
+    CHECK(feed(&state, &io, patch, patch_size, 0, OTA_CHUNK_SIZE) == OTA_DELTA_ERR_OLD_CRC);
+    CHECK(state.output_offset == 0);
+    close_partitions(&parts);
+
+    // Damage anywhere past the header never completes the update: it is an error, at the latest from
+    // the CRC at the end, or a misread length leaves the applier waiting for more patch
+    for(uint32_t at = sizeof(struct ota_delta_header_struct); at < patch_size; at += 1 + patch_size / 64)
+    {
+        memcpy(changed, patch, patch_size);
+        changed[at] ^= 0x10;
+        open_partitions(&parts, old, old_size, new_size);
+        ota_delta_init(&state);
+        CHECK(feed(&state, &io, changed, patch_size, 0, OTA_CHUNK_SIZE) != OTA_DELTA_DONE);
+        close_partitions(&parts);
+    }
+
+    // A truncated patch never completes
+    open_partitions(&parts, old, old_size, new_size);
+    ota_delta_init(&state);
+    CHECK(feed(&state, &io, patch, patch_size - 1, 0, OTA_CHUNK_SIZE) == OTA_DELTA_OK);
+    close_partitions(&parts);
+
+    free(changed);
+}
+
+// Writes an old image and a new one as a rebuild would change it: edited constants, code inserted,
+// code removed so everything after it moves, and a longer tail
+static void write_images(const char *old_path, const char *new_path)
+{
+    uint8_t *old = malloc(IMAGE_SIZE);
+    uint8_t *new = malloc(IMAGE_SIZE + 8192);
+    uint32_t new_size = 0;
+
+    for(uint32_t i = 0; i < IMAGE_SIZE; i++)
+    {
+        old[i] = rng();
+    }
+    memcpy(&new[new_size], old, 40000);
+    new_size += 40000;
+    for(int i = 0; i < 3000; i++)
+    {
+        new[new_size++] = rng();
+    }
+    memcpy(&new[new_size], &old[40000], 60000);
+    new_size += 60000;
+    memcpy(&new[new_size], &old[106000], IMAGE_SIZE - 106000);
+    new_size += IMAGE_SIZE - 106000;
+    for(int i = 0; i < 50; i++)
+    {
+        new[rng() % new_size] ^= 1 << (rng() % 8);
+    }
+    for(int i = 0; i < 5000; i++)
+    {
+        new[new_size++] = rng();
+    }
+
+    FILE *file = fopen(old_path, "wb");
+    fwrite(old, 1, IMAGE_SIZE, file);
+    fclose(file);
+    file = fopen(new_path, "wb");
+    fwrite(new, 1, new_size, file);
+    fclose(file);
+    free(old);
+    free(new);
+}
+
+int main(int argc, char **argv)
+{
+    if(argc == 4 && 0 == strcmp(argv[1], "images")){
+        write_images(argv[2], argv[3]);
+        return EXIT_SUCCESS;
+    }
+    if(argc != 4){
+        fprintf(stderr, "usage: %s images old.bin new.bin | %s old.bin new.bin patch.bin\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    uint32_t old_size, new_size, patch_size;
+    uint8_t *old = load(argv[1], &old_size);
+    uint8_t *new = load(argv[2], &new_size);
+    uint8_t *patch = load(argv[3], &patch_size);
+    CHECK(patch_size < new_size / 4);   // The diff found the moved code
+
+    test_chunked(old, old_size, new, new_size, patch, patch_size);
+    test_resume(old, old_size, new, new_size, patch, patch_size);
+    test_bad_input(old, old_size, new, new_size, patch, patch_size);
+
+    free(old);
+    free(new);
+    free(patch);
+    HOST_TEST_DONE();
+}
@@ -0,0 +1,370 @@
+/* Gateway aggregation over an in-process loopback link, with hundreds of thousands of frames */
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_test.h"
+#include "plant_gateway.h"
+
+#define THROUGHPUT_PLANTS 4
+#define THROUGHPUT_ROUNDS 2000          // Samples per plant
+#define THROUGHPUT_FLUSH_ROUNDS 10      // Rounds per flush, ~CONFIG_PLANT_GATEWAY_FLUSH_MS over the poll period
+#define THROUGHPUT_RETRANSMIT_EVERY 16  // Frames, as lost link-layer acks
+#define THROUGHPUT_MIN_FRAMES_PER_S 100000
+
+// The air between the nodes and the gateway: frames to the gateway go straight to its receive
+// callback, frames to a node are kept for the test to look at
+struct loopback_medium_struct{
+    plant_link_receive_cb_t receive;
+    void *user;
+    uint8_t to_addr[PLANT_LINK_ADDR_LEN];      // Last frame sent by the gateway
+    uint8_t frame[PLANT_LINK_MAX_FRAME];
+    size_t frame_len;
+    int frames_to_nodes;
+};
+
+// One node's end of the link, the sender address is the node's own
+struct loopback_node_struct{
+    struct loopback_medium_struct *medium;
+    uint8_t addr[PLANT_LINK_ADDR_LEN];
+    uint16_t seq;
+    struct plant_link_transport_struct link;
+};
+
+// What the gateway published
+struct published_struct{
+    int samples;
+    int responses;
+    char node_id[PLANT_LINK_ID_SIZE];
+    struct plant_link_sample_struct last;
+    char response[PLANT_LINK_MAX_TEXT + 1];
+};
+
+struct gateway_rig_struct{
+    struct plant_gateway_struct gw;
+    struct loopback_medium_struct medium;
+    struct published_struct published;
+    uint64_t now;
+};
+
+static int gateway_start(void *ctx, plant_link_receive_cb_t receive, void *user)
+{
+    struct loopback_medium_struct *medium = ctx;
+    medium->receive = receive;
+    medium->user = user;
+    return 0;
+}
+
+static int gateway_send(void *ctx, const uint8_t *addr, const void *data, size_t len)
+{
+    struct loopback_medium_struct *medium = ctx;
+    memcpy(medium->to_addr, addr, PLANT_LINK_ADDR_LEN);
+    memcpy(medium->frame, data, len);
+    medium->frame_len = len;
+    medium->frames_to_nodes++;
+    return 0;
+}
+
+static int node_send(void *ctx, const uint8_t *addr, const void *data, size_t len)
+{
+    struct loopback_node_struct *node = ctx;
+    node->medium->receive(node->medium->user, node->addr, data, len);
+    return 0;
+}
+
+static void publish_sample(void *ctx, const char *node_id, const struct plant_link_sample_struct *sample)
+{
+    struct published_struct *published = ctx;
+    published->samples++;
+    snprintf(published->node_id, sizeof(published->node_id), "%s", node_id);
+    published->last = *sample;
+}
+
+static void publish_response(void *ctx, const char *node_id, const char *text, size_t len)
+{
+    struct published_struct *published = ctx;
+    published->responses++;
+    snprintf(published->node_id, sizeof(published->node_id), "%s", node_id);
+    snprintf(published->response, sizeof(published->response), "%.*s", (int) len, text);
+}
+
+// The receive callback app_main.c registers, without the mutex and task notification
+static void gateway_receive(void *user, const uint8_t *addr, const uint8_t *data, size_t len)
+{
+    struct gateway_rig_struct *rig = user;
+    plant_gateway_receive(&rig->gw, addr, data, len, rig->now);
+}
+
+static void init_rig(struct gateway_rig_struct *rig, struct plant_link_transport_struct *link, struct plant_gateway_output_struct *output)
+{
+    memset(rig, 0, sizeof(*rig));
+    *link = (struct plant_link_transport_struct){ .ctx = &rig->medium, .start = gateway_start, .send = gateway_send };
+    *output = (struct plant_gateway_output_struct){ .ctx = &rig->published, .publish_sample = publish_sample, .publish_response = publish_response };
+    plant_gateway_init(&rig->gw, link, output);
+    link->start(link->ctx, gateway_receive, rig);
+}
+
+static void init_node(struct loopback_node_struct *node, struct gateway_rig_struct *rig, uint32_t number)
+{
+    memset(node, 0, sizeof(*node));
+    node->medium = &rig->medium;
+    const uint8_t addr[PLANT_LINK_ADDR_LEN] = { 0x24, 0x0a, 0xc4, number >> 16, number >> 8, number };
+    memcpy(node->addr, addr, sizeof(addr));
+    node->link = (struct plant_link_transport_struct){ .ctx = node, .send = node_send };
+}
+
+// Sends a sample as sendPlantSample does, returns the frame for retransmitting
+static struct plant_link_sample_struct send_sample(struct loopback_node_struct *node, int plant, uint16_t moisture, bool urgent)
+{
+    static const uint8_t gateway_addr[PLANT_LINK_ADDR_LEN] = { 0x24, 0x0a, 0xc4, 0xff, 0xff, 0xff };
+    struct plant_link_sample_struct sample = {
+        .header = { .magic = PLANT_LINK_MAGIC, .type = PLANT_LINK_SAMPLE, .seq = node->seq++ },
+        .plant = plant,
+        .flags = urgent ? PLANT_LINK_FLAG_URGENT : 0,
+        .moisture = moisture,
+        .level = 3000,
+        .temperature_x10 = 215,
+        .humidity_x10 = 450,
+    };
+    node->link.send(node->link.ctx, gateway_addr, &sample, sizeof(sample));
+    return sample;
+}
+
+static void test_batching_and_merge(void)
+{
+    struct gateway_rig_struct rig;
+    struct plant_link_transport_struct link;
+    struct plant_gateway_output_struct output;
+    struct loopback_node_struct nodes[3];
+    init_rig(&rig, &link, &output);
+
+    // Every plant sends several samples between flushes, only the latest is published
+    for(int round = 0; round < 5; round++)
+    {
+        for(int n = 0; n < 3; n++)
+        {
+            if(round == 0){
+                init_node(&nodes[n], &rig, n);
+            }
+            for(int plant = 0; plant < 2; plant++)
+            {
+                send_sample(&nodes[n], plant, 1000 + 100 * n + 10 * plant + round, false);
+            }
+        }
+    }
+    CHECK(rig.gw.node_count == 3);
+    CHECK(plant_gateway_flush(&rig.gw) == 6);
+    CHECK(rig.published.samples == 6);
+    CHECK(0 == strcmp(rig.published.node_id, "240ac4000002"));
+    CHECK(rig.published.last.plant == 1);
+    CHECK(rig.published.last.moisture == 1000 + 200 + 10 + 4);
+    CHECK(plant_gateway_flush(&rig.gw) == 0);
+
+    // A retransmission (lost ack) is dropped, a new sample is published on the next flush
+    struct plant_link_sample_struct sample = send_sample(&nodes[1], 0, 1500, false);
+    node_send(&nodes[1], NULL, &sample, sizeof(sample));
+    CHECK(rig.gw.nodes[1].duplicates == 1);
+    CHECK(plant_gateway_flush(&rig.gw) == 1);
+    CHECK(rig.published.last.moisture == 1500);
+
+    // Urgent samples ask for a flush now
+    sample = send_sample(&nodes[2], 1, 1600, true);
+    CHECK(plant_gateway_receive(&rig.gw, nodes[2].addr, (const uint8_t *) &sample, sizeof(sample), 0) == false);     // Duplicate
+    sample.header.seq = nodes[2].seq++;
+    CHECK(plant_gateway_receive(&rig.gw, nodes[2].addr, (const uint8_t *) &sample, sizeof(sample), 0) == true);
+    sample.header.seq = nodes[2].seq++;
+    sample.flags = 0;
+    CHECK(plant_gateway_receive(&rig.gw, nodes[2].addr, (const uint8_t *) &sample, sizeof(sample), 0) == false);
+}
+
+static void test_collect(void)
+{
+    struct gateway_rig_struct rig;
+    struct plant_link_transport_struct link;
+    struct plant_gateway_output_struct output;
+    struct loopback_node_struct node;
+    struct plant_gateway_batch_struct batch[4];
+    init_rig(&rig, &link, &output);
+
+    // 10 dirty plants over 2 nodes come out 4 at a time, each once
+    for(int n = 0; n < 2; n++)
+    {
+        init_node(&node, &rig, 100 + n);
+        for(int plant = 0; plant < 5; plant++)
+        {
+            send_sample(&node, plant, 2000 + 10 * n + plant, false);
+        }
+    }
+    int sum = 0;
+    int counts[3];
+    for(int i = 0; i < 3; i++)
+    {
+        counts[i] = plant_gateway_collect(&rig.gw, batch, 4);
+        for(int j = 0; j < counts[i]; j++)
+        {
+            sum += batch[j].sample.moisture;
+        }
+    }
+    CHECK(counts[0] == 4 && counts[1] == 4 && counts[2] == 2);
+    CHECK(sum == 10 * 2000 + 5 * 10 + 2 * (0 + 1 + 2 + 3 + 4));
+    CHECK(0 == strcmp(batch[1].node_id, "240ac4000065"));
+    CHECK(plant_gateway_collect(&rig.gw, batch, 4) == 0);
+    CHECK(rig.published.samples == 0);
+}
+
+static void test_commands_and_responses(void)
+{
+    struct gateway_rig_struct rig;
+    struct plant_link_transport_struct link;
+    struct plant_gateway_output_struct output;
+    struct loopback_node_struct nodes[2];
+    char text[PLANT_LINK_MAX_TEXT + 1];
+    init_rig(&rig, &link, &output);
+    init_node(&nodes[0], &rig, 0x10);
+    init_node(&nodes[1], &rig, 0x20);
+    send_sample(&nodes[0], 0, 1000, false);
+    send_sample(&nodes[1], 0, 1000, false);
+    CHECK(plant_gateway_flush(&rig.gw) == 2);
+
+    // Commands go to the node with that id only
+    CHECK(plant_gateway_send_command(&rig.gw, "240ac4000020", "query 0", 7) == 0);
+    CHECK(rig.medium.frames_to_nodes == 1);
+    CHECK(0 == memcmp(rig.medium.to_addr, nodes[1].addr, PLANT_LINK_ADDR_LEN));
+    CHECK(rig.medium.frame_len == sizeof(struct plant_link_header_struct) + 7);
+    CHECK(rig.medium.frame[1] == PLANT_LINK_COMMAND);
+    CHECK(0 == memcmp(&rig.medium.frame[sizeof(struct plant_link_header_struct)], "query 0", 7));
+    CHECK(plant_gateway_send_command(&rig.gw, "240ac4000030", "query 0", 7) == -1);
+    memset(text, 'x', sizeof(text));
+    CHECK(plant_gateway_send_command(&rig.gw, "240ac4000010", text, sizeof(text)) == -2);
+    CHECK(rig.medium.frames_to_nodes == 1);
+
+    // Responses are queued for the node and ask for a flush, they are not published from receive
+    uint8_t frame[PLANT_LINK_MAX_FRAME];
+    struct plant_link_header_struct header = { .magic = PLANT_LINK_MAGIC, .type = PLANT_LINK_RESPONSE, .seq = nodes[0].seq++ };
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), "CONFIG OK", 9);
+    CHECK(plant_gateway_receive(&rig.gw, nodes[0].addr, frame, sizeof(header) + 9, rig.now));
+    CHECK(rig.published.responses == 0);
+    CHECK(plant_gateway_flush(&rig.gw) == 0);
+    CHECK(rig.published.responses == 1);
+    CHECK(0 == strcmp(rig.published.node_id, "240ac4000010"));
+    CHECK(0 == strcmp(rig.published.response, "CONFIG OK"));
+
+    // Taken oldest first, as gateway_task does, and dropped once the queue is full
+    struct plant_gateway_response_struct response;
+    for(int i = 0; i < PLANT_GATEWAY_MAX_RESPONSES + 1; i++)
+    {
+        header.seq = nodes[1].seq++;
+        memcpy(frame, &header, sizeof(header));
+        frame[sizeof(header)] = '0' + i;
+        node_send(&nodes[1], NULL, frame, sizeof(header) + 1);
+    }
+    CHECK(rig.gw.responses_dropped == 1);
+    for(int i = 0; i < PLANT_GATEWAY_MAX_RESPONSES; i++)
+    {
+        CHECK(plant_gateway_take_response(&rig.gw, &response));
+        CHECK(0 == strcmp(response.node_id, "240ac4000020"));
+        CHECK(response.len == 1 && response.text[0] == '0' + i);
+    }
+    CHECK(!plant_gateway_take_response(&rig.gw, &response));
+    CHECK(rig.published.responses == 1);
+}
+
+static void test_bad_frames_and_full_table(void)
+{
+    struct gateway_rig_struct rig;
+    struct plant_link_transport_struct link;
+    struct plant_gateway_output_struct output;
+    struct loopback_node_struct node;
+    init_rig(&rig, &link, &output);
+    init_node(&node, &rig, 1);
+
+    struct plant_link_sample_struct sample = send_sample(&node, 0, 1000, false);
+    sample.header.magic = 0;
+    node_send(&node, NULL, &sample, sizeof(sample));
+    sample.header.magic = PLANT_LINK_MAGIC;
+    sample.header.seq = node.seq++;
+    node_send(&node, NULL, &sample, sizeof(sample) - 1);
+    sample.header.seq = node.seq++;
+    sample.plant = PLANT_GATEWAY_MAX_PLANTS;
+    node_send(&node, NULL, &sample, sizeof(sample));
+    node_send(&node, NULL, &sample, 2);
+    CHECK(rig.gw.bad_frames == 4);
+    CHECK(plant_gateway_flush(&rig.gw) == 1);
+
+    for(int n = 2; n <= PLANT_GATEWAY_MAX_NODES + 1; n++)
+    {
+        init_node(&node, &rig, n);
+        send_sample(&node, 0, 1000, false);
+    }
+    CHECK(rig.gw.node_count == PLANT_GATEWAY_MAX_NODES);
+    CHECK(rig.gw.table_full == 1);
+    CHECK(plant_gateway_flush(&rig.gw) == PLANT_GATEWAY_MAX_NODES - 1);
+}
+
+// A full node table sending every plant every round, with retransmissions, flushed every few rounds
+static void test_throughput(void)
+{
+    static struct gateway_rig_struct rig;
+    static struct loopback_node_struct nodes[PLANT_GATEWAY_MAX_NODES];
+    struct plant_link_transport_struct link;
+    struct plant_gateway_output_struct output;
+    struct timespec start, end;
+    int frames = 0;
+    int retransmitted = 0;
+    int published = 0;
+    init_rig(&rig, &link, &output);
+    for(int n = 0; n < PLANT_GATEWAY_MAX_NODES; n++)
+    {
+        init_node(&nodes[n], &rig, n);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(int round = 0; round < THROUGHPUT_ROUNDS; round++)
+    {
+        rig.now = round * 10000000ull;
+        for(int n = 0; n < PLANT_GATEWAY_MAX_NODES; n++)
+        {
+            for(int plant = 0; plant < THROUGHPUT_PLANTS; plant++)
+            {
+                struct plant_link_sample_struct sample = send_sample(&nodes[n], plant, 1000 + round, false);
+                frames++;
+                if(frames % THROUGHPUT_RETRANSMIT_EVERY == 0){
+                    node_send(&nodes[n], NULL, &sample, sizeof(sample));
+                    retransmitted++;
+                }
+            }
+        }
+        if((round + 1) % THROUGHPUT_FLUSH_ROUNDS == 0){
+            published += plant_gateway_flush(&rig.gw);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    int duplicates = 0;
+    for(int n = 0; n < PLANT_GATEWAY_MAX_NODES; n++)
+    {
+        duplicates += rig.gw.nodes[n].duplicates;
+    }
+    printf("%d nodes, %d frames (%d retransmitted) in %.3f s, %.0f frames/s, %d published (%.1f%%)\n",
+        PLANT_GATEWAY_MAX_NODES, frames + retransmitted, retransmitted, seconds, (frames + retransmitted) / seconds,
+        published, 100.0 * published / (frames + retransmitted));
+
+    CHECK(duplicates == retransmitted);
+    CHECK(published == PLANT_GATEWAY_MAX_NODES * THROUGHPUT_PLANTS * (THROUGHPUT_ROUNDS / THROUGHPUT_FLUSH_ROUNDS));
+    CHECK(rig.published.last.moisture == 1000 + THROUGHPUT_ROUNDS - 1);
+    CHECK((frames + retransmitted) / seconds > THROUGHPUT_MIN_FRAMES_PER_S);
+}
+
+int main(void)
+{
+    test_batching_and_merge();
+    test_collect();
+    test_commands_and_responses();
+    test_bad_frames_and_full_table();
+    test_throughput();
+    HOST_TEST_DONE();
+}
@@ -0,0 +1,368 @@
+/* The watering state machine (plant_state.c) on the synthetic soil, and traces for plant_replay
+
+   test_plant_state                    runs the tests
+   test_plant_state trace trace.bin    writes the trace of a simulated 90 day run
+
+   The Makefile replays the trace through plant_replay, which must follow the
+   run with and only with the learned pulse sizing the run used.  The tests
+   also time the scheduler loop, as runPlantScheduler runs it, for 1 to 7
+   plants and print its cost per plant.
+*/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_test.h"
+#include "plant_state.h"
+#include "plant_synthetic.h"
+#include "plant_trace.h"
+
+#define MOISTURE_SENSOR_DRY 720     // As app_main.c
+#define MOISTURE_SENSOR_WET 2616
+#define MOISTURE(ratio) ((uint16_t) ((ratio) * (MOISTURE_SENSOR_WET - MOISTURE_SENSOR_DRY) + MOISTURE_SENSOR_DRY))
+#define SEC_IN_MICROSEC 1000000ull
+#define PLANT_SCHEDULER_MIN_SLEEP_US 100000ull
+#define PLANT_SCHEDULER_MAX_SLEEP_US SEC_IN_MICROSEC
+#define TICK_US 10000ull            // FreeRTOS tick, the scheduler wakes on one
+#define MAX_PULSE_S 10.0f           // CONFIG_PLANT_DOSING_MAX_PULSE_S default
+#define SIM_PLANTS 2
+#define SIM_DAYS 90
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// A plant as runPlantScheduler drives it, with the pump accounting of turnOnPump and turnOffPump
+struct sim_plant_struct{
+    struct plant_state_struct machine;
+    struct plant_watering_config_struct config;
+    struct plant_dosing_struct dosing;
+    struct plant_synthetic_struct soil;
+    uint16_t reading;
+    uint64_t last_poll_us;
+    uint64_t pump_on_us;
+    uint64_t pump_on_start_us;
+    int changes, alarms, doses, learned, watered;
+};
+
+static void sim_change(void *ctx, enum PlantStates old_state, enum PlantStates new_state, bool valid, uint64_t now)
+{
+    struct sim_plant_struct *plant = ctx;
+    if(old_state == PLANT_PUMP_ON){
+        plant->pump_on_us += now - plant->pump_on_start_us;
+    }
+    if(valid && new_state == PLANT_PUMP_ON){
+        plant->pump_on_start_us = now;
+    }
+    plant->changes++;
+    plant->alarms += !valid;
+}
+
+static void sim_dose(void *ctx)
+{
+    ((struct sim_plant_struct *) ctx)->doses++;
+}
+
+static void sim_learned(void *ctx)
+{
+    ((struct sim_plant_struct *) ctx)->learned++;
+}
+
+static void sim_watered(void *ctx)
+{
+    ((struct sim_plant_struct *) ctx)->watered++;
+}
+
+static const struct plant_state_hooks_struct sim_hooks = {
+    .change = sim_change,
+    .dose = sim_dose,
+    .learned = sim_learned,
+    .watered = sim_watered,
+};
+
+static const struct plant_watering_config_struct default_config = {
+    .low_moisture = MOISTURE(.80),
+    .watered_moisture = MOISTURE(.92),
+    .high_moisture = MOISTURE(.93),
+    .polling_period_s = 10,
+    .pump_on_period_s = 1,
+    .pump_off_period_s = 59,
+    .wet_hold_period_s = 30*60,
+    .dry_hold_period_s = 5*60
+};
+
+static void sim_init(struct sim_plant_struct *plant, const struct plant_watering_config_struct *config, float max_pulse_s)
+{
+    memset(plant, 0, sizeof(*plant));
+    plant->config = *config;
+    plant->soil.moisture = config->high_moisture;
+    plant_state_init(&plant->machine, &plant->config, &plant->dosing, max_pulse_s, &sim_hooks, plant, 0);
+}
+
+// Polls the synthetic soil as stepSyntheticSensors does, with sensor noise on the raw samples
+static void sim_poll(struct sim_plant_struct *plant, uint64_t now, uint16_t *samples)
+{
+    uint16_t soil = plant_synthetic_step(&plant->soil, (now - plant->last_poll_us) / (float) SEC_IN_MICROSEC, plant->pump_on_us,
+        MOISTURE_SENSOR_DRY, MOISTURE_SENSOR_WET);
+    uint16_t sorted[PLANT_TRACE_SAMPLES];
+    for(int i = 0; i < PLANT_TRACE_SAMPLES; i++)
+    {
+        samples[i] = soil + rng() % 9 - 4;
+        int j = i;
+        for(; j > 0 && sorted[j - 1] > samples[i]; j--)
+        {
+            sorted[j] = sorted[j - 1];
+        }
+        sorted[j] = samples[i];
+    }
+    plant->reading = sorted[PLANT_TRACE_SAMPLES / 2];
+    plant->last_poll_us = now;
+}
+
+// Runs the plants as runPlantScheduler does for days, writing a trace record per poll if trace is set.
+// Returns the number of scheduler passes.
+static uint64_t simulate(struct sim_plant_struct *plants, int count, int days, FILE *trace)
+{
+    uint64_t now = 0, passes = 0;
+    uint64_t end = days * 24 * 3600 * SEC_IN_MICROSEC;
+    bool first = true;
+
+    while(now < end)
+    {
+        uint64_t next_deadline = UINT64_MAX;
+        passes++;
+        for(int i = 0; i < count; i++)
+        {
+            struct sim_plant_struct *plant = &plants[i];
+            if(plant->machine.state < PLANT_ALARM &&
+                (first || now - plant->last_poll_us > plant->config.polling_period_s * SEC_IN_MICROSEC)){
+                struct plant_trace_record_struct record = {
+                    .magic = PLANT_TRACE_MAGIC,
+                    .version = PLANT_TRACE_VERSION,
+                    .plant = i,
+                    .time_us = now,
+                    .low_moisture = plant->config.low_moisture,
+                    .watered_moisture = plant->config.watered_moisture,
+                    .high_moisture = plant->config.high_moisture,
+                    .polling_period_s = plant->config.polling_period_s,
+                    .pump_on_period_s = plant->config.pump_on_period_s,
+                    .pump_off_period_s = plant->config.pump_off_period_s,
+                    .wet_hold_period_s = plant->config.wet_hold_period_s,
+                    .dry_hold_period_s = plant->config.dry_hold_period_s,
+                    .temperature = 21.5f,
+                    .humidity = 45.0f,
+                    .dht_ok = 1,
+                    .gain = plant->dosing.gain,
+                    .dose_pulse_ms = plant->machine.dose_pulse_ms,
+                    .state = plant->machine.state
+                };
+                uint16_t samples[PLANT_TRACE_SAMPLES], levels[PLANT_TRACE_SAMPLES];
+                sim_poll(plant, now, samples);
+                for(int s = 0; s < PLANT_TRACE_SAMPLES; s++)
+                {
+                    levels[s] = PLANT_SYNTHETIC_LEVEL;
+                }
+                memcpy(record.moisture_samples, samples, sizeof(samples));   // The record is packed
+                memcpy(record.level_samples, levels, sizeof(levels));
+                if(trace){
+                    fwrite(&record, sizeof(record), 1, trace);
+                }
+            }
+        }
+        first = false;
+
+        for(int i = 0; i < count; i++)
+        {
+            struct sim_plant_struct *plant = &plants[i];
+            enum PlantStates old_state = plant->machine.state;
+            plant_state_step(&plant->machine, plant->reading, plant->pump_on_us, now);
+
+            // plantNextDeadline
+            uint64_t deadline = plant->last_poll_us + plant->config.polling_period_s * SEC_IN_MICROSEC + 1;
+            uint64_t period_us = plant_state_period_us(&plant->machine);
+            if(period_us && plant->machine.state_entry_time_us + period_us + 1 < deadline){
+                deadline = plant->machine.state_entry_time_us + period_us + 1;
+            }
+            if(plant->machine.state == PLANT_ALARM){
+                deadline = UINT64_MAX;
+            }
+            if(plant->machine.state != old_state){
+                deadline = now + PLANT_SCHEDULER_MIN_SLEEP_US;
+            }
+            if(deadline < next_deadline){
+                next_deadline = deadline;
+            }
+        }
+
+        // Sleep in whole ticks, then a little pass overhead
+        uint64_t sleep_us = next_deadline > now ? next_deadline - now : 0;
+        if(sleep_us > PLANT_SCHEDULER_MAX_SLEEP_US){
+            sleep_us = PLANT_SCHEDULER_MAX_SLEEP_US;
+        }
+        uint64_t ticks = (sleep_us + TICK_US - 1) / TICK_US;
+        now += (ticks ? ticks : 1) * TICK_US + rng() % 2000;
+    }
+    return passes;
+}
+
+static void test_watering_cycle(void)
+{
+    struct sim_plant_struct plant;
+    sim_init(&plant, &default_config, 0);
+    plant.reading = MOISTURE(.85);
+
+    // Dries into DRY_HOLD, waters after dry_hold_period_s
+    plant_state_step(&plant.machine, plant.reading, 0, 0);
+    CHECK(plant.machine.state == PLANT_DRYING);
+    plant.reading = MOISTURE(.75);
+    plant_state_step(&plant.machine, plant.reading, 0, 1000000);
+    CHECK(plant.machine.state == PLANT_DRY_HOLD);
+    CHECK(plant_state_period_us(&plant.machine) == 300 * SEC_IN_MICROSEC);
+    plant_state_step(&plant.machine, plant.reading, 0, 301000000);
+    CHECK(plant.machine.state == PLANT_DRY_HOLD);
+    plant_state_step(&plant.machine, plant.reading, 0, 301000001);
+    CHECK(plant.machine.state == PLANT_PUMP_DELAY);
+    CHECK(plant.machine.watering_start_us == 301000001);
+
+    // Fixed pulses without a learned pulse limit
+    plant_state_step(&plant.machine, plant.reading, 0, 361000002);
+    CHECK(plant.machine.state == PLANT_PUMP_ON);
+    CHECK(plant.machine.dose_pulse_ms == 1000);
+    CHECK(plant.doses == 1 && plant.machine.watering_pulses == 1);
+    plant_state_step(&plant.machine, plant.reading, 0, 362000003);
+    CHECK(plant.machine.state == PLANT_PUMP_DELAY);
+    CHECK(plant.pump_on_us == 1000001);
+
+    // Reaching high_moisture learns from the pulse and holds
+    plant.reading = MOISTURE(.94);
+    plant_state_step(&plant.machine, plant.reading, plant.pump_on_us, 422000004);
+    CHECK(plant.machine.state == PLANT_WET_HOLD);
+    CHECK(plant.learned == 1 && plant.dosing.cycles == 1);
+    CHECK(plant.machine.watering_time_s == 121);
+    CHECK(plant.machine.watering_peak_moisture == MOISTURE(.94));
+
+    // Waters again at watered_moisture, reporting the watering that ended
+    plant.reading = MOISTURE(.91);
+    plant_state_step(&plant.machine, plant.reading, plant.pump_on_us, 500000000);
+    CHECK(plant.machine.state == PLANT_PUMP_DELAY);
+    CHECK(plant.watered == 1 && plant.machine.watering_pulses == 0);
+    CHECK(plant.alarms == 0);
+
+    // An invalid transition raises ALARM, which the machine never leaves
+    plant_state_change(&plant.machine, PLANT_DRYING, 500000001);
+    CHECK(plant.machine.state == PLANT_ALARM && plant.alarms == 1);
+    plant_state_step(&plant.machine, MOISTURE(.5), plant.pump_on_us, 900000000);
+    CHECK(plant.machine.state == PLANT_ALARM);
+    CHECK(plant_state_period_us(&plant.machine) == 0);
+}
+
+static void test_learned_pulses(void)
+{
+    struct sim_plant_struct plant;
+    sim_init(&plant, &default_config, MAX_PULSE_S);
+
+    // Until a pulse has been measured, pulses are pump_on_period_s
+    plant.machine.state = PLANT_PUMP_DELAY;
+    plant_state_step(&plant.machine, MOISTURE(.60), 0, 60 * SEC_IN_MICROSEC);
+    CHECK(plant.machine.dose_pulse_ms == 1000);
+
+    // Then they close most of the gap to high_moisture, up to the limit
+    plant.dosing = (struct plant_dosing_struct){ .gain = 40.0f, .cycles = 1 };
+    plant.machine.state = PLANT_PUMP_DELAY;
+    plant.machine.dose_pending = false;
+    plant_state_step(&plant.machine, MOISTURE(.90), 0, 200 * SEC_IN_MICROSEC);
+    uint32_t expected_ms = PLANT_DOSING_AIM * (MOISTURE(.93) - MOISTURE(.90)) / 40.0f * 1000;
+    CHECK(plant.machine.dose_pulse_ms == expected_ms);
+    plant.machine.state = PLANT_PUMP_DELAY;
+    plant.machine.dose_pending = false;
+    plant_state_step(&plant.machine, MOISTURE(.30), 0, 400 * SEC_IN_MICROSEC);
+    CHECK(plant.machine.dose_pulse_ms == MAX_PULSE_S * 1000);
+}
+
+// A long synthetic run keeps watering, within the moisture band and without alarms
+static void test_long_run(void)
+{
+    struct sim_plant_struct plants[SIM_PLANTS];
+    struct plant_watering_config_struct slow = default_config;
+    slow.polling_period_s = 30;
+    slow.pump_on_period_s = 2;
+    sim_init(&plants[0], &default_config, MAX_PULSE_S);
+    sim_init(&plants[1], &slow, MAX_PULSE_S);
+
+    simulate(plants, SIM_PLANTS, SIM_DAYS, NULL);
+    for(int i = 0; i < SIM_PLANTS; i++)
+    {
+        CHECK(plants[i].alarms == 0);
+        CHECK(plants[i].watered > SIM_DAYS);
+        CHECK(plants[i].learned > 0);
+        CHECK(plants[i].reading > MOISTURE(.75));
+    }
+}
+
+// A scheduler pass costs the same per plant for any CONFIG_PLANT_COUNT (1-7)
+static void test_scheduler_scaling(void)
+{
+    static const int counts[] = { 1, 2, 4, 7 };
+    double first_ns = 0;
+
+    for(int c = 0; c < (int) (sizeof(counts) / sizeof(counts[0])); c++)
+    {
+        struct sim_plant_struct plants[7];
+        for(int i = 0; i < counts[c]; i++)
+        {
+            struct plant_watering_config_struct config = default_config;
+            config.polling_period_s += i;   // Out of step, as plants configured one by one are
+            sim_init(&plants[i], &config, MAX_PULSE_S);
+        }
+
+        clock_t start = clock();
+        uint64_t passes = simulate(plants, counts[c], 10, NULL);
+        double ns = 1e9 * (clock() - start) / CLOCKS_PER_SEC / passes / counts[c];
+        printf("%d plants: %llu scheduler passes, %.1f ns per plant per pass\n", counts[c], (unsigned long long) passes, ns);
+        if(c == 0){
+            first_ns = ns;
+        }
+        // Linear within timing noise, a quadratic pass would cost 7 times as much per plant
+        CHECK(ns < 2 * first_ns);
+    }
+}
+
+static void write_trace(const char *path)
+{
+    struct sim_plant_struct plants[SIM_PLANTS];
+    struct plant_watering_config_struct slow = default_config;
+    slow.polling_period_s = 30;
+    slow.pump_on_period_s = 2;
+    sim_init(&plants[0], &default_config, MAX_PULSE_S);
+    sim_init(&plants[1], &slow, MAX_PULSE_S);
+
+    FILE *trace = fopen(path, "wb");
+    if(!trace){
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    simulate(plants, SIM_PLANTS, SIM_DAYS, trace);
+    fclose(trace);
+}
+
+int main(int argc, char **argv)
+{
+    if(argc == 3 && 0 == strcmp(argv[1], "trace")){
+        write_trace(argv[2]);
+        return EXIT_SUCCESS;
+    }
+
+    test_watering_cycle();
+    test_learned_pulses();
+    test_long_run();
+    test_scheduler_scaling();
+    HOST_TEST_DONE();
+}
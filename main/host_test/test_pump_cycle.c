@@ -0,0 +1,115 @@
+/* A synthetic watering pulse, with the pump safety cutoff sampling the level as on the board */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "host_test.h"
+#include "plant_synthetic.h"
+#include "pump_safety.h"
+
+#define MOISTURE_SENSOR_DRY 720     // As app_main.c
+#define MOISTURE_SENSOR_WET 2616
+#define LEVEL_SENSOR_EMPTY 2048
+#define SAMPLE_PERIOD_US 2000       // PUMP_SAFETY_SAMPLE_PERIOD_US
+#define PULSE_US 3000000ull
+#define SOAK_US 60000000ull
+
+// Runs the pump for PULSE_US sampling level every SAMPLE_PERIOD_US.  Returns the pump time
+// before a cutoff, PULSE_US if there was none.
+static uint64_t run_pulse(struct pump_safety_struct *safety, int level)
+{
+    for(uint64_t t = 0; t < PULSE_US; t += SAMPLE_PERIOD_US)
+    {
+        if(pump_safety_sample(safety, level, LEVEL_SENSOR_EMPTY, t)){
+            return t;
+        }
+    }
+    return PULSE_US;
+}
+
+static void test_synthetic_pulse(void)
+{
+    struct plant_synthetic_struct soil = { .moisture = 1500 };
+    struct pump_safety_struct safety = {0};
+
+    // The synthetic reservoir never reads empty, so the whole pulse runs
+    uint64_t pumped_us = run_pulse(&safety, PLANT_SYNTHETIC_LEVEL);
+    CHECK(pumped_us == PULSE_US);
+
+    // The water reaches the sensor over the soak, as polls every 10 s would see it
+    float before = soil.moisture;
+    float last = before;
+    bool rising = true;
+    for(uint64_t t = 10000000ull; t <= SOAK_US; t += 10000000ull)
+    {
+        uint16_t reading = plant_synthetic_step(&soil, 10.0f, pumped_us, MOISTURE_SENSOR_DRY, MOISTURE_SENSOR_WET);
+        rising &= reading > last;
+        last = reading;
+    }
+    CHECK(rising);
+    float expected = PLANT_SYNTHETIC_PUMP_COUNTS_PER_S * pumped_us / 1e6f;
+    CHECK(soil.moisture - before > 0.9f * expected);
+    CHECK(soil.moisture - before < expected);
+
+    // Pump time already applied is not applied again, the soil only dries
+    float soaked = soil.moisture;
+    plant_synthetic_step(&soil, 600.0f, pumped_us, MOISTURE_SENSOR_DRY, MOISTURE_SENSOR_WET);
+    CHECK(soil.moisture < soaked + 0.05f * expected);
+}
+
+static void test_empty_reservoir(void)
+{
+    struct pump_safety_struct safety = {0};
+
+    // Cut on the PUMP_SAFETY_TRIP_SAMPLES-th consecutive empty sample
+    uint64_t pumped_us = run_pulse(&safety, LEVEL_SENSOR_EMPTY);
+    CHECK(pumped_us == (PUMP_SAFETY_TRIP_SAMPLES - 1) * SAMPLE_PERIOD_US);
+    CHECK(safety.first_empty_us == 0);
+
+    // A good sample between empty ones restarts the count
+    pump_safety_reset(&safety);
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 0));
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 2000));
+    CHECK(!pump_safety_sample(&safety, PLANT_SYNTHETIC_LEVEL, LEVEL_SENSOR_EMPTY, 4000));
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 6000));
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 8000));
+    CHECK(pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 10000));
+    CHECK(safety.first_empty_us == 6000);
+}
+
+static void test_run_restarts(void)
+{
+    struct pump_safety_struct safety = {0};
+
+    // The scheduler ends a run on its pulse time just after the level first reads empty
+    pump_safety_reset(&safety);
+    CHECK(!pump_safety_sample(&safety, PLANT_SYNTHETIC_LEVEL, LEVEL_SENSOR_EMPTY, 0));
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 2000));
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 4000));
+
+    // The next run, started as turnOnPump does, needs its own PUMP_SAFETY_TRIP_SAMPLES empty samples
+    // and measures the latency from its own first one
+    pump_safety_reset(&safety);
+    for(int i = 0; i < PUMP_SAFETY_TRIP_SAMPLES - 1; i++)
+    {
+        CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 60000000ull + i * SAMPLE_PERIOD_US));
+    }
+    CHECK(safety.first_empty_us == 60000000ull);
+    CHECK(pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 60000000ull + (PUMP_SAFETY_TRIP_SAMPLES - 1) * SAMPLE_PERIOD_US));
+
+    // One empty sample carried over is not enough either
+    pump_safety_reset(&safety);
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 0));
+    pump_safety_reset(&safety);
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 60000000ull));
+    CHECK(!pump_safety_sample(&safety, LEVEL_SENSOR_EMPTY, LEVEL_SENSOR_EMPTY, 60002000ull));
+    CHECK(safety.first_empty_us == 60000000ull);
+}
+
+int main(void)
+{
+    test_synthetic_pulse();
+    test_empty_reservoir();
+    test_run_restarts();
+    HOST_TEST_DONE();
+}
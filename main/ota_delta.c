@@ -0,0 +1,207 @@
+/* Plant Thing delta patch applier */
+
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ota_delta.h"
+
+// CRC-32 (reflected, polynomial 0xEDB88320) a nibble at a time, small enough to keep in flash
+static const uint32_t crc32_nibble_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, size_t len)
+{
+    for(size_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ crc32_nibble_table[crc & 0x0f];
+        crc = (crc >> 4) ^ crc32_nibble_table[crc & 0x0f];
+    }
+    return crc;
+}
+
+uint32_t ota_delta_crc32(uint32_t crc, const uint8_t *data, size_t len)
+{
+    return ~crc32_update(~crc, data, len);
+}
+
+static uint32_t read_u32(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+void ota_delta_init(struct ota_delta_state_struct *state)
+{
+    memset(state, 0, sizeof(*state));
+    state->phase = OTA_DELTA_PHASE_HEADER;
+}
+
+// Collects the next `need` bytes of a header or op argument into state->field
+static bool collect_field(struct ota_delta_state_struct *state, const uint8_t *data, size_t len, size_t *pos, uint8_t need)
+{
+    while(state->field_len < need && *pos < len){
+        state->field[state->field_len++] = data[(*pos)++];
+        state->patch_offset++;
+    }
+    if(state->field_len < need){
+        return false;
+    }
+    state->field_len = 0;
+    return true;
+}
+
+static int check_old_image(const struct ota_delta_state_struct *state, const struct ota_delta_io_struct *io)
+{
+    uint8_t buf[OTA_DELTA_COPY_BUFFER];
+    uint32_t crc = 0;
+
+    for(uint32_t offset = 0; offset < state->header.old_size; offset += sizeof(buf))
+    {
+        size_t n = state->header.old_size - offset < sizeof(buf) ? state->header.old_size - offset : sizeof(buf);
+        if(io->read_old(io->ctx, offset, buf, n)){
+            return OTA_DELTA_ERR_IO;
+        }
+        crc = ota_delta_crc32(crc, buf, n);
+    }
+    return crc == state->header.old_crc32 ? OTA_DELTA_OK : OTA_DELTA_ERR_OLD_CRC;
+}
+
+// Writes up to `len` bytes of output without crossing a sector and returns how many were written,
+// or a negative error
+static int write_output(struct ota_delta_state_struct *state, const struct ota_delta_io_struct *io, const uint8_t *buf, size_t len)
+{
+    size_t room = OTA_DELTA_SECTOR_SIZE - state->output_offset % OTA_DELTA_SECTOR_SIZE;
+    size_t n = len < room ? len : room;
+
+    if(state->output_offset + n > state->header.new_size){
+        return OTA_DELTA_ERR_RANGE;
+    }
+    if(io->write_new(io->ctx, state->output_offset, buf, n)){
+        return OTA_DELTA_ERR_IO;
+    }
+    state->new_crc = crc32_update(state->new_crc, buf, n);
+    state->output_offset += n;
+    return n;
+}
+
+static void sector_checkpoint(struct ota_delta_state_struct *state, const struct ota_delta_io_struct *io)
+{
+    if(io->checkpoint && state->output_offset % OTA_DELTA_SECTOR_SIZE == 0){
+        io->checkpoint(io->ctx, state);
+    }
+}
+
+int ota_delta_feed(struct ota_delta_state_struct *state, const struct ota_delta_io_struct *io, const uint8_t *data, size_t len)
+{
+    size_t pos = 0;
+    int err;
+
+    while(1)
+    {
+        switch(state->phase){
+            case OTA_DELTA_PHASE_HEADER:
+                if(!collect_field(state, data, len, &pos, sizeof(struct ota_delta_header_struct))){
+                    return OTA_DELTA_OK;
+                }
+                state->header.magic = read_u32(&state->field[0]);
+                state->header.old_size = read_u32(&state->field[4]);
+                state->header.old_crc32 = read_u32(&state->field[8]);
+                state->header.new_size = read_u32(&state->field[12]);
+                state->header.new_crc32 = read_u32(&state->field[16]);
+                if(state->header.magic != OTA_DELTA_MAGIC){
+                    return OTA_DELTA_ERR_FORMAT;
+                }
+                err = check_old_image(state, io);
+                if(err){
+                    return err;
+                }
+                state->new_crc = ~0u;
+                state->phase = OTA_DELTA_PHASE_OP;
+                break;
+
+            case OTA_DELTA_PHASE_OP:
+                if(pos == len){
+                    return OTA_DELTA_OK;
+                }
+                state->patch_offset++;
+                switch(data[pos++]){
+                    case OTA_DELTA_OP_END:
+                        if(state->output_offset != state->header.new_size || ~state->new_crc != state->header.new_crc32){
+                            return OTA_DELTA_ERR_NEW_CRC;
+                        }
+                        state->phase = OTA_DELTA_PHASE_DONE;
+                        break;
+                    case OTA_DELTA_OP_COPY: state->phase = OTA_DELTA_PHASE_COPY_ARGS; break;
+                    case OTA_DELTA_OP_INSERT: state->phase = OTA_DELTA_PHASE_INSERT_ARGS; break;
+                    default: return OTA_DELTA_ERR_FORMAT;
+                }
+                break;
+
+            case OTA_DELTA_PHASE_COPY_ARGS:
+                if(!collect_field(state, data, len, &pos, 8)){
+                    return OTA_DELTA_OK;
+                }
+                state->copy_offset = read_u32(&state->field[0]);
+                state->remaining = read_u32(&state->field[4]);
+                if(state->copy_offset > state->header.old_size || state->remaining > state->header.old_size - state->copy_offset){
+                    return OTA_DELTA_ERR_RANGE;
+                }
+                state->phase = OTA_DELTA_PHASE_COPY;
+                break;
+
+            case OTA_DELTA_PHASE_INSERT_ARGS:
+                if(!collect_field(state, data, len, &pos, 4)){
+                    return OTA_DELTA_OK;
+                }
+                state->remaining = read_u32(&state->field[0]);
+                state->phase = OTA_DELTA_PHASE_INSERT;
+                break;
+
+            case OTA_DELTA_PHASE_COPY:
+                // Needs no patch data, so always runs to completion
+                while(state->remaining){
+                    uint8_t buf[OTA_DELTA_COPY_BUFFER];
+                    size_t n = state->remaining < sizeof(buf) ? state->remaining : sizeof(buf);
+                    if(io->read_old(io->ctx, state->copy_offset, buf, n)){
+                        return OTA_DELTA_ERR_IO;
+                    }
+                    int written = write_output(state, io, buf, n);
+                    if(written < 0){
+                        return written;
+                    }
+                    state->copy_offset += written;
+                    state->remaining -= written;
+                    sector_checkpoint(state, io);
+                }
+                state->phase = OTA_DELTA_PHASE_OP;
+                break;
+
+            case OTA_DELTA_PHASE_INSERT:
+                while(state->remaining){
+                    if(pos == len){
+                        return OTA_DELTA_OK;
+                    }
+                    size_t n = len - pos < state->remaining ? len - pos : state->remaining;
+                    int written = write_output(state, io, &data[pos], n);
+                    if(written < 0){
+                        return written;
+                    }
+                    pos += written;
+                    state->patch_offset += written;
+                    state->remaining -= written;
+                    sector_checkpoint(state, io);
+                }
+                state->phase = OTA_DELTA_PHASE_OP;
+                break;
+
+            case OTA_DELTA_PHASE_DONE:
+                return OTA_DELTA_DONE;
+
+            default:
+                return OTA_DELTA_ERR_FORMAT;
+        }
+    }
+}
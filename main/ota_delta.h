@@ -0,0 +1,83 @@
+/* Plant Thing delta patch applier
+
+   Streams a binary delta patch (see tools/plant_ota_delta.py) against the
+   old image and writes the new image sequentially, in bounded RAM and with
+   no assumptions about how the patch is chunked.
+
+   Patch format, little endian:
+     header   "PTD1", old_size, old_crc32, new_size, new_crc32   (5 x u32)
+     ops      0x01 COPY    old_offset u32, length u32
+              0x02 INSERT  length u32, <length literal bytes>
+              0x00 END
+
+   All state lives in struct ota_delta_state_struct, a plain struct that can
+   be saved and restored to resume an interrupted update.  The checkpoint
+   callback is called each time the output reaches an OTA_DELTA_SECTOR_SIZE
+   boundary, which is where a resumed update restarts writing.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define OTA_DELTA_MAGIC 0x31445450      // "PTD1"
+#define OTA_DELTA_SECTOR_SIZE 4096
+#define OTA_DELTA_COPY_BUFFER 256
+
+#define OTA_DELTA_OP_END 0x00
+#define OTA_DELTA_OP_COPY 0x01
+#define OTA_DELTA_OP_INSERT 0x02
+
+// Return codes
+#define OTA_DELTA_OK 0              // Needs more patch data
+#define OTA_DELTA_DONE 1            // New image complete and verified
+#define OTA_DELTA_ERR_FORMAT -1     // Corrupt patch
+#define OTA_DELTA_ERR_IO -2         // read_old or write_new failed
+#define OTA_DELTA_ERR_RANGE -3      // Copy outside the old image or output beyond new_size
+#define OTA_DELTA_ERR_OLD_CRC -4    // Patch was made against a different old image
+#define OTA_DELTA_ERR_NEW_CRC -5    // Output does not match the new image
+
+enum OtaDeltaPhases{
+    OTA_DELTA_PHASE_HEADER = 0,
+    OTA_DELTA_PHASE_OP,
+    OTA_DELTA_PHASE_COPY_ARGS,
+    OTA_DELTA_PHASE_INSERT_ARGS,
+    OTA_DELTA_PHASE_COPY,
+    OTA_DELTA_PHASE_INSERT,
+    OTA_DELTA_PHASE_DONE
+};
+
+struct ota_delta_header_struct{
+    uint32_t magic;
+    uint32_t old_size;
+    uint32_t old_crc32;
+    uint32_t new_size;
+    uint32_t new_crc32;
+};
+
+struct ota_delta_state_struct{
+    uint32_t patch_offset;      // Patch bytes consumed
+    uint32_t output_offset;     // New image bytes written
+    uint32_t new_crc;           // Running CRC of the output (pre-inverted)
+    uint32_t copy_offset;       // Next old image byte of the current COPY
+    uint32_t remaining;         // Bytes left in the current COPY/INSERT
+    uint8_t phase;
+    uint8_t field_len;          // Bytes collected in field[]
+    uint8_t field[sizeof(struct ota_delta_header_struct)];
+    struct ota_delta_header_struct header;
+};
+
+struct ota_delta_io_struct{
+    void *ctx;
+    int (*read_old)(void *ctx, uint32_t offset, void *buf, size_t len);         // 0 on success
+    int (*write_new)(void *ctx, uint32_t offset, const void *buf, size_t len);  // 0 on success, never crosses a sector
+    void (*checkpoint)(void *ctx, const struct ota_delta_state_struct *state);  // Optional
+};
+
+void ota_delta_init(struct ota_delta_state_struct *state);
+
+// Consumes a chunk of patch data.  Returns OTA_DELTA_OK, OTA_DELTA_DONE or an error.
+int ota_delta_feed(struct ota_delta_state_struct *state, const struct ota_delta_io_struct *io, const uint8_t *data, size_t len);
+
+// Standard CRC-32 (as zlib), crc is the value returned by a previous call or 0
+uint32_t ota_delta_crc32(uint32_t crc, const uint8_t *data, size_t len);
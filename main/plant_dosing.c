@@ -0,0 +1,41 @@
+/* Plant Thing learned pump dosing */
+
+#include "plant_dosing.h"
+
+float plant_dosing_pulse_s(const struct plant_dosing_struct *dosing, uint16_t moisture, uint16_t target, float min_s, float max_s)
+{
+    if(dosing->cycles == 0 || moisture >= target){
+        return min_s;
+    }
+
+    float pulse_s = PLANT_DOSING_AIM * (target - moisture) / dosing->gain;
+    if(pulse_s < min_s){
+        return min_s;
+    }
+    if(pulse_s > max_s){
+        return max_s;
+    }
+    return pulse_s;
+}
+
+bool plant_dosing_learn(struct plant_dosing_struct *dosing, uint16_t before, uint16_t after, float pumped_s)
+{
+    if(pumped_s < PLANT_DOSING_MIN_MEASURE_S){
+        return false;
+    }
+
+    float gain = ((float) after - before) / pumped_s;
+    if(gain < PLANT_DOSING_MIN_GAIN || gain > PLANT_DOSING_MAX_GAIN){
+        return false;
+    }
+
+    if(dosing->cycles == 0){
+        dosing->gain = gain;
+    }else{
+        dosing->gain += PLANT_DOSING_LEARN_RATE * (gain - dosing->gain);
+    }
+    if(dosing->cycles < UINT16_MAX){
+        dosing->cycles++;
+    }
+    return true;
+}
@@ -0,0 +1,34 @@
+/* Plant Thing learned pump dosing
+
+   Learns how many moisture sensor counts one second of pumping adds to a
+   pot (measured after the pump_off_period_s soak that follows each pulse)
+   and sizes the next pulse to close most of the remaining gap to the
+   target in one go.  Pulses aim short of the target so the soil is never
+   overshot on a bad estimate; a second, smaller pulse tops up.
+
+   Until a pot has been measured, pulses are the configured pump_on_period_s,
+   i.e. the old fixed-pulse behaviour.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PLANT_DOSING_AIM 0.85f              // Fraction of the remaining gap a pulse aims to close
+#define PLANT_DOSING_LEARN_RATE 0.3f        // Weight of the newest measurement in the gain estimate
+#define PLANT_DOSING_MIN_GAIN 1.0f          // Counts per pump second, measurements outside are discarded
+#define PLANT_DOSING_MAX_GAIN 2000.0f
+#define PLANT_DOSING_MIN_MEASURE_S 0.5f     // Shorter (e.g. blocked or cut) pulses are not learned from
+
+// Per-plant learned state, persisted in NVS
+struct plant_dosing_struct{
+    float gain;             // Moisture counts per pump second
+    uint16_t cycles;        // Measurements so far, 0 = gain unknown
+};
+
+// Pulse length in seconds to take the moisture reading towards target, within [min_s, max_s]
+float plant_dosing_pulse_s(const struct plant_dosing_struct *dosing, uint16_t moisture, uint16_t target, float min_s, float max_s);
+
+// Updates the gain from a pulse of pumped_s seconds that moved the reading from before to after.
+// Returns true if the measurement was used.
+bool plant_dosing_learn(struct plant_dosing_struct *dosing, uint16_t before, uint16_t after, float pumped_s);
@@ -0,0 +1,48 @@
+/* Plant Thing energy accounting */
+
+#include <string.h>
+
+#include "plant_energy.h"
+
+#define MA_MS_PER_MAH 3600000.0f
+#define US_PER_DAY 86400000000.0f
+
+static uint32_t energy_counts[PLANT_ENERGY_EVENT_COUNT];
+static const float energy_costs_ma_ms[PLANT_ENERGY_EVENT_COUNT] = PLANT_ENERGY_COSTS_MA_MS;
+
+const char *const plant_energy_event_names[PLANT_ENERGY_EVENT_COUNT] = {
+    "adc_burst",
+    "dht_read",
+    "publish",
+    "tx_byte",
+    "link_frame",
+    "nvs_commit",
+    "safety_read",
+};
+
+void plant_energy_count(enum PlantEnergyEvents event, uint32_t n)
+{
+    __atomic_fetch_add(&energy_counts[event], n, __ATOMIC_RELAXED);
+}
+
+void plant_energy_report(struct plant_energy_report_struct *report, uint64_t elapsed_us, uint64_t pump_on_us,
+    float baseline_ma, float pump_ma, float pump_ml_per_min)
+{
+    memset(report, 0, sizeof(*report));
+    for(int i = 0; i < PLANT_ENERGY_EVENT_COUNT; i++)
+    {
+        report->counts[i] = __atomic_load_n(&energy_counts[i], __ATOMIC_RELAXED);
+        report->event_mah[i] = report->counts[i] * energy_costs_ma_ms[i] / MA_MS_PER_MAH;
+        report->total_mah += report->event_mah[i];
+    }
+
+    report->baseline_mah = baseline_ma * (elapsed_us / 1000.0f) / MA_MS_PER_MAH;
+    report->pump_mah = pump_ma * (pump_on_us / 1000.0f) / MA_MS_PER_MAH;
+    report->total_mah += report->baseline_mah + report->pump_mah;
+    report->water_ml = pump_ml_per_min * pump_on_us / 60000000.0f;
+
+    if(elapsed_us){
+        report->mah_per_day = report->total_mah * US_PER_DAY / elapsed_us;
+        report->water_ml_per_day = report->water_ml * US_PER_DAY / elapsed_us;
+    }
+}
@@ -0,0 +1,164 @@
+/* Plant Thing gateway aggregation */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "plant_gateway.h"
+
+void plant_gateway_init(struct plant_gateway_struct *gw, const struct plant_link_transport_struct *link, const struct plant_gateway_output_struct *output)
+{
+    memset(gw, 0, sizeof(*gw));
+    gw->link = link;
+    gw->output = output;
+}
+
+static struct plant_gateway_node_struct *find_node(struct plant_gateway_struct *gw, const uint8_t *addr)
+{
+    for(int i = 0; i < gw->node_count; i++)
+    {
+        if(0 == memcmp(gw->nodes[i].addr, addr, PLANT_LINK_ADDR_LEN)){
+            return &gw->nodes[i];
+        }
+    }
+    if(gw->node_count == PLANT_GATEWAY_MAX_NODES){
+        return NULL;
+    }
+
+    struct plant_gateway_node_struct *node = &gw->nodes[gw->node_count++];
+    memset(node, 0, sizeof(*node));
+    memcpy(node->addr, addr, PLANT_LINK_ADDR_LEN);
+    plant_link_format_id(node->id, addr);
+    return node;
+}
+
+bool plant_gateway_receive(struct plant_gateway_struct *gw, const uint8_t *addr, const uint8_t *data, size_t len, uint64_t now)
+{
+    const struct plant_link_header_struct *header = (const struct plant_link_header_struct *) data;
+
+    if(len < sizeof(*header) || header->magic != PLANT_LINK_MAGIC){
+        gw->bad_frames++;
+        return false;
+    }
+    struct plant_gateway_node_struct *node = find_node(gw, addr);
+    if(node == NULL){
+        gw->table_full++;
+        return false;
+    }
+
+    // A lost link-layer ack makes the node send the same frame again
+    if(node->frames && header->seq == node->last_seq){
+        node->duplicates++;
+        return false;
+    }
+    node->frames++;
+    node->last_seq = header->seq;
+    node->last_seen_us = now;
+
+    switch(header->type){
+        case PLANT_LINK_SAMPLE: {
+            const struct plant_link_sample_struct *sample = (const struct plant_link_sample_struct *) data;
+            if(len != sizeof(*sample) || sample->plant >= PLANT_GATEWAY_MAX_PLANTS){
+                gw->bad_frames++;
+                return false;
+            }
+            node->samples[sample->plant] = *sample;
+            node->dirty |= 1 << sample->plant;
+            return sample->flags & PLANT_LINK_FLAG_URGENT;
+        }
+        case PLANT_LINK_RESPONSE: {
+            if(len > sizeof(*header) + PLANT_LINK_MAX_TEXT){
+                gw->bad_frames++;
+                return false;
+            }
+            if(gw->response_count == PLANT_GATEWAY_MAX_RESPONSES){
+                gw->responses_dropped++;
+                return true;
+            }
+            struct plant_gateway_response_struct *response = &gw->responses[gw->response_count++];
+            memcpy(response->node_id, node->id, sizeof(node->id));
+            response->len = len - sizeof(*header);
+            memcpy(response->text, data + sizeof(*header), response->len);
+            return true;
+        }
+        default:
+            gw->bad_frames++;
+            return false;
+    }
+}
+
+int plant_gateway_collect(struct plant_gateway_struct *gw, struct plant_gateway_batch_struct *batch, int max)
+{
+    int collected = 0;
+
+    for(int i = 0; i < gw->node_count && collected < max; i++)
+    {
+        struct plant_gateway_node_struct *node = &gw->nodes[i];
+        for(int plant = 0; node->dirty && collected < max; plant++)
+        {
+            if(node->dirty & (1 << plant)){
+                memcpy(batch[collected].node_id, node->id, sizeof(node->id));
+                batch[collected].sample = node->samples[plant];
+                node->dirty &= ~(1 << plant);
+                collected++;
+            }
+        }
+    }
+    return collected;
+}
+
+bool plant_gateway_take_response(struct plant_gateway_struct *gw, struct plant_gateway_response_struct *response)
+{
+    if(gw->response_count == 0){
+        return false;
+    }
+    *response = gw->responses[0];
+    gw->response_count--;
+    memmove(&gw->responses[0], &gw->responses[1], gw->response_count * sizeof(gw->responses[0]));
+    return true;
+}
+
+int plant_gateway_flush(struct plant_gateway_struct *gw)
+{
+    struct plant_gateway_batch_struct batch[PLANT_GATEWAY_MAX_PLANTS];
+    struct plant_gateway_response_struct response;
+    int published = 0;
+    int collected;
+
+    while(plant_gateway_take_response(gw, &response))
+    {
+        gw->output->publish_response(gw->output->ctx, response.node_id, response.text, response.len);
+    }
+
+    do{
+        collected = plant_gateway_collect(gw, batch, PLANT_GATEWAY_MAX_PLANTS);
+        for(int i = 0; i < collected; i++)
+        {
+            gw->output->publish_sample(gw->output->ctx, batch[i].node_id, &batch[i].sample);
+        }
+        published += collected;
+    }while(collected == PLANT_GATEWAY_MAX_PLANTS);
+    return published;
+}
+
+int plant_gateway_send_command(struct plant_gateway_struct *gw, const char *node_id, const char *text, size_t len)
+{
+    uint8_t frame[PLANT_LINK_MAX_FRAME];
+    struct plant_link_header_struct *header = (struct plant_link_header_struct *) frame;
+
+    for(int i = 0; i < gw->node_count; i++)
+    {
+        struct plant_gateway_node_struct *node = &gw->nodes[i];
+        if(0 != strcmp(node->id, node_id)){
+            continue;
+        }
+        if(len > PLANT_LINK_MAX_TEXT){
+            return -2;
+        }
+        header->magic = PLANT_LINK_MAGIC;
+        header->type = PLANT_LINK_COMMAND;
+        header->seq = gw->seq++;
+        memcpy(frame + sizeof(*header), text, len);
+        return gw->link->send(gw->link->ctx, node->addr, frame, sizeof(*header) + len) ? -2 : 0;
+    }
+    return -1;
+}
@@ -0,0 +1,90 @@
+/* Plant Thing gateway aggregation
+
+   Keeps the latest sample of every plant on every node heard over the link
+   and hands them to the MQTT side in batches: plant_gateway_flush() publishes
+   each plant that changed since the last flush once, however many frames it
+   sent in between.  plant_gateway_collect() takes the same samples out a few
+   at a time instead, so they can be published without holding the lock that
+   serialises the gateway.  Urgent samples (state or fault changes) make
+   plant_gateway_receive() ask for a flush right away.  Commands for a node
+   are fanned back out over the same link, and the node's responses are
+   queued until plant_gateway_take_response() or a flush, for the same reason.
+
+   Plain C over struct plant_link_transport_struct, no ESP-IDF dependencies.
+   Not thread safe, the caller serialises receive, flush and send_command.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "plant_link.h"
+
+#ifndef PLANT_GATEWAY_MAX_NODES
+#define PLANT_GATEWAY_MAX_NODES 64      // More than ESP-NOW peers, plant_link_espnow.c recycles those
+#endif
+#define PLANT_GATEWAY_MAX_PLANTS 8      // Per node, one dirty bit each
+#define PLANT_GATEWAY_MAX_RESPONSES 4   // Command responses waiting to be published
+
+struct plant_gateway_node_struct{
+    uint8_t addr[PLANT_LINK_ADDR_LEN];
+    char id[PLANT_LINK_ID_SIZE];    // Device id as the node derives it
+    uint16_t last_seq;
+    uint8_t dirty;              // Plants with a sample not yet published, bit per plant
+    uint64_t last_seen_us;
+    uint32_t frames;
+    uint32_t duplicates;
+    struct plant_link_sample_struct samples[PLANT_GATEWAY_MAX_PLANTS];
+};
+
+// A sample taken out by plant_gateway_collect()
+struct plant_gateway_batch_struct{
+    char node_id[PLANT_LINK_ID_SIZE];
+    struct plant_link_sample_struct sample;
+};
+
+// A node's command response, queued by plant_gateway_receive()
+struct plant_gateway_response_struct{
+    char node_id[PLANT_LINK_ID_SIZE];
+    uint16_t len;
+    char text[PLANT_LINK_MAX_TEXT];
+};
+
+// Where aggregated data goes, normally the gateway's MQTT session
+struct plant_gateway_output_struct{
+    void *ctx;
+    void (*publish_sample)(void *ctx, const char *node_id, const struct plant_link_sample_struct *sample);
+    void (*publish_response)(void *ctx, const char *node_id, const char *text, size_t len);
+};
+
+struct plant_gateway_struct{
+    const struct plant_link_transport_struct *link;
+    const struct plant_gateway_output_struct *output;
+    struct plant_gateway_node_struct nodes[PLANT_GATEWAY_MAX_NODES];
+    int node_count;
+    uint16_t seq;               // Of frames sent to nodes
+    struct plant_gateway_response_struct responses[PLANT_GATEWAY_MAX_RESPONSES];
+    int response_count;
+    uint32_t responses_dropped; // Responses that arrived with the queue full
+    uint32_t bad_frames;
+    uint32_t table_full;        // Frames from nodes that did not fit the node table
+};
+
+void plant_gateway_init(struct plant_gateway_struct *gw, const struct plant_link_transport_struct *link, const struct plant_gateway_output_struct *output);
+
+// Handles one frame from a node, returns true if a flush should happen now (an urgent sample or
+// a response)
+bool plant_gateway_receive(struct plant_gateway_struct *gw, const uint8_t *addr, const uint8_t *data, size_t len, uint64_t now);
+
+// Moves up to max of the samples that changed since the last flush into batch, returns how many.
+// Samples are left for the next call once batch is full.
+int plant_gateway_collect(struct plant_gateway_struct *gw, struct plant_gateway_batch_struct *batch, int max);
+
+// Moves the oldest queued response into response, returns false if there is none
+bool plant_gateway_take_response(struct plant_gateway_struct *gw, struct plant_gateway_response_struct *response);
+
+// Publishes the queued responses and every sample that changed since the last flush, returns how
+// many samples
+int plant_gateway_flush(struct plant_gateway_struct *gw);
+
+// Forwards a command to a node, 0 on success, -1 for an unknown node, -2 if it could not be sent
+int plant_gateway_send_command(struct plant_gateway_struct *gw, const char *node_id, const char *text, size_t len);
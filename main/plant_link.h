@@ -0,0 +1,75 @@
+/* Plant Thing node to gateway link
+
+   Sensor nodes (CONFIG_PLANT_ROLE_NODE) have no Wi-Fi association or MQTT
+   session of their own.  They send compact frames to a gateway
+   (CONFIG_PLANT_ROLE_GATEWAY) over a connectionless link, and the gateway
+   carries them on its single MQTT session (plant_gateway.h).
+
+   The aggregation code only sees struct plant_link_transport_struct, so any
+   datagram transport can stand in for ESP-NOW (plant_link_espnow.c), e.g.
+   an in-process loopback on a host.
+
+   Frames are packed, little endian and at most PLANT_LINK_MAX_FRAME bytes:
+     SAMPLE    node -> gateway   telemetry of one plant
+     COMMAND   gateway -> node   command text, as received on pt/<node>/cmd
+     RESPONSE  node -> gateway   command response text, for pt/<node>/rsp
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define PLANT_LINK_MAX_FRAME 250        // ESP-NOW payload limit
+#define PLANT_LINK_ADDR_LEN 6
+#define PLANT_LINK_MAGIC 0x50           // 'P'
+#define PLANT_LINK_ID_SIZE (2 * PLANT_LINK_ADDR_LEN + 1)
+
+// Formats a device id, all bytes of the station MAC in hex.  A node's ESP-NOW address is its
+// station MAC, so the gateway derives the same id the node uses for its topics.
+static inline void plant_link_format_id(char *id, const uint8_t *addr)
+{
+    snprintf(id, PLANT_LINK_ID_SIZE, "%02x%02x%02x%02x%02x%02x", addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+}
+
+enum PlantLinkFrameTypes{
+    PLANT_LINK_SAMPLE = 1,
+    PLANT_LINK_COMMAND = 2,
+    PLANT_LINK_RESPONSE = 3
+};
+
+#define PLANT_LINK_FLAG_URGENT 0x01     // State or fault change, forward without waiting for the batch
+
+struct __attribute__((packed)) plant_link_header_struct{
+    uint8_t magic;
+    uint8_t type;
+    uint16_t seq;       // Per sender, lets the receiver drop link-layer retransmissions
+};
+
+struct __attribute__((packed)) plant_link_sample_struct{
+    struct plant_link_header_struct header;
+    uint8_t plant;
+    uint8_t state;
+    uint8_t faults;             // Moisture faults | level faults << 4
+    uint8_t flags;
+    uint16_t moisture;          // Raw sensor medians
+    uint16_t level;
+    int16_t temperature_x10;    // 0.1 degrees C
+    uint16_t humidity_x10;      // 0.1 % RH
+};
+
+#define PLANT_LINK_MAX_TEXT (PLANT_LINK_MAX_FRAME - sizeof(struct plant_link_header_struct))
+
+// Delivers one received frame, addr is the sender
+typedef void (*plant_link_receive_cb_t)(void *user, const uint8_t *addr, const uint8_t *data, size_t len);
+
+struct plant_link_transport_struct{
+    void *ctx;
+    // Starts the transport, received frames are passed to receive from a task context
+    int (*start)(void *ctx, plant_link_receive_cb_t receive, void *user);
+    // Sends one frame, 0 on success
+    int (*send)(void *ctx, const uint8_t *addr, const void *data, size_t len);
+};
+
+// ESP-NOW transport, see plant_link_espnow.c
+extern const struct plant_link_transport_struct plant_link_espnow;
@@ -0,0 +1,143 @@
+/* Plant Thing node to gateway link over ESP-NOW
+
+   Wi-Fi must be started (station mode) before the link.  Nodes never
+   associate, so they must be on the channel of the gateway's AP.
+
+   ESP-NOW holds at most ESP_NOW_MAX_TOTAL_PEER_NUM (20) peers, fewer than a
+   gateway may have nodes.  Peers are only needed to send, and receiving
+   from any node works without one, so the least recently sent to peer is
+   removed to make room for a new one.
+*/
+
+#include <string.h>
+#include "esp_log.h"
+#include "esp_now.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+
+#include "plant_link.h"
+
+#define PLANT_LINK_QUEUE_LENGTH 16
+
+static const char *TAG = "plant_link";
+
+// Frames are copied out of the Wi-Fi task's receive callback and handled in our own task
+struct plant_link_rx_struct{
+    uint8_t addr[PLANT_LINK_ADDR_LEN];
+    uint8_t len;
+    uint8_t data[PLANT_LINK_MAX_FRAME];
+};
+
+static QueueHandle_t rx_queue = NULL;
+static plant_link_receive_cb_t rx_handler = NULL;
+static void *rx_user = NULL;
+static uint32_t rx_dropped = 0;
+
+struct plant_link_peer_struct{
+    uint8_t addr[PLANT_LINK_ADDR_LEN];
+    bool used;
+    uint32_t last_send;         // peer_clock at the last send, for LRU eviction
+};
+
+static struct plant_link_peer_struct peers[ESP_NOW_MAX_TOTAL_PEER_NUM];
+static uint32_t peer_clock = 0;
+static SemaphoreHandle_t peer_mutex = NULL;    // Sends come from the scheduler, MQTT and link tasks
+
+static void espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int data_len)
+{
+    struct plant_link_rx_struct rx;
+
+    if(data_len <= 0 || data_len > PLANT_LINK_MAX_FRAME){
+        return;
+    }
+    memcpy(rx.addr, mac_addr, PLANT_LINK_ADDR_LEN);
+    rx.len = data_len;
+    memcpy(rx.data, data, data_len);
+    if(xQueueSend(rx_queue, &rx, 0) != pdTRUE){
+        rx_dropped++;
+    }
+}
+
+static void espnow_rx_task(void *pvParameters)
+{
+    struct plant_link_rx_struct rx;
+
+    while(1)
+    {
+        if(xQueueReceive(rx_queue, &rx, portMAX_DELAY) == pdTRUE){
+            rx_handler(rx_user, rx.addr, rx.data, rx.len);
+        }
+    }
+}
+
+static int espnow_start(void *ctx, plant_link_receive_cb_t receive, void *user)
+{
+    rx_handler = receive;
+    rx_user = user;
+    rx_queue = xQueueCreate(PLANT_LINK_QUEUE_LENGTH, sizeof(struct plant_link_rx_struct));
+    peer_mutex = xSemaphoreCreateMutex();
+    if(rx_queue == NULL || peer_mutex == NULL){
+        return -1;
+    }
+    if(esp_now_init() != ESP_OK || esp_now_register_recv_cb(espnow_recv_cb) != ESP_OK){
+        return -1;
+    }
+    xTaskCreate(espnow_rx_task, "plant_link", 4096, NULL, 5, NULL);
+    return 0;
+}
+
+// Makes addr a peer if it is not one, replacing the least recently used peer when the table is full
+static int use_peer(const uint8_t *addr)
+{
+    struct plant_link_peer_struct *slot = NULL;
+
+    for(int i = 0; i < ESP_NOW_MAX_TOTAL_PEER_NUM; i++)
+    {
+        struct plant_link_peer_struct *peer = &peers[i];
+        if(peer->used && 0 == memcmp(peer->addr, addr, PLANT_LINK_ADDR_LEN)){
+            peer->last_send = ++peer_clock;
+            return 0;
+        }
+        if(slot == NULL || (slot->used && (!peer->used || peer->last_send < slot->last_send))){
+            slot = peer;
+        }
+    }
+
+    if(slot->used){
+        esp_now_del_peer(slot->addr);
+        slot->used = false;
+    }
+    esp_now_peer_info_t peer = {0};
+    memcpy(peer.peer_addr, addr, PLANT_LINK_ADDR_LEN);
+    peer.channel = 0;   // Current channel
+    peer.ifidx = WIFI_IF_STA;
+    peer.encrypt = false;
+    if(esp_now_add_peer(&peer) != ESP_OK){
+        ESP_LOGW(TAG, "Could not add peer %02x:%02x:%02x:%02x:%02x:%02x", addr[0], addr[1], addr[2], addr[3], addr[4], addr[5]);
+        return -1;
+    }
+    memcpy(slot->addr, addr, PLANT_LINK_ADDR_LEN);
+    slot->used = true;
+    slot->last_send = ++peer_clock;
+    return 0;
+}
+
+static int espnow_send(void *ctx, const uint8_t *addr, const void *data, size_t len)
+{
+    // Peers are added on first use, the gateway learns its nodes from their frames
+    xSemaphoreTake(peer_mutex, portMAX_DELAY);
+    int err = use_peer(addr);
+    xSemaphoreGive(peer_mutex);
+    if(err){
+        return -1;
+    }
+    return esp_now_send(addr, data, len) != ESP_OK;
+}
+
+const struct plant_link_transport_struct plant_link_espnow = {
+    .ctx = NULL,
+    .start = espnow_start,
+    .send = espnow_send,
+};
@@ -0,0 +1,145 @@
+/* Plant Thing deferred logging
+
+   Each core owns one ring of 32-bit words.  Writers mask interrupts on their own
+   core for the few word copies of a record, so there is never a lock shared
+   between cores; the drain task is the only reader and only moves the tail.
+
+   Record layout (words):
+     [0] argc << 16 | id
+     [1] timestamp (ms since boot)
+     [2..] arguments
+*/
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+
+#include "plant_log.h"
+
+#define PLOG_FMT(id, fmt) fmt,
+static const char *plant_log_formats[] = {
+#include "plant_log_formats.h"
+};
+#undef PLOG_FMT
+
+static const char *TAG = "plant";
+
+#define PLANT_LOG_TEXT_MAX 256     // Longest formatted text record, longer ones are cut
+
+#if CONFIG_PLANT_LOG_DEFERRED
+
+#define PLANT_LOG_RING_WORDS 512     // Per core, must be a power of 2
+#define PLANT_LOG_RING_MASK (PLANT_LOG_RING_WORDS - 1)
+#define PLANT_LOG_DRAIN_PERIOD_MS 50
+
+struct plant_log_ring_struct{
+    uint32_t words[PLANT_LOG_RING_WORDS];
+    uint32_t head;      // Next word to write, only moved by the owning core
+    uint32_t tail;      // Next word to read, only moved by the drain task
+    uint32_t dropped;   // Records lost because the ring was full
+};
+
+static struct plant_log_ring_struct plant_log_rings[portNUM_PROCESSORS];
+
+void IRAM_ATTR plant_log_write(uint16_t id, const uint32_t *args, size_t argc)
+{
+    if(argc > PLANT_LOG_MAX_ARGS){
+        argc = PLANT_LOG_MAX_ARGS;
+    }
+    uint32_t record_words = 2 + argc;
+    uint32_t timestamp = esp_log_timestamp();
+
+    // Masking interrupts keeps this core's writers (tasks and ISRs) from interleaving
+    // and pins us to the core whose ring we are filling
+    uint32_t irq_state = portSET_INTERRUPT_MASK_FROM_ISR();
+    struct plant_log_ring_struct *ring = &plant_log_rings[xPortGetCoreID()];
+
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if(PLANT_LOG_RING_WORDS - (head - tail) < record_words){
+        ring->dropped++;
+    }else{
+        ring->words[head++ & PLANT_LOG_RING_MASK] = (argc << 16) | id;
+        ring->words[head++ & PLANT_LOG_RING_MASK] = timestamp;
+        for(size_t i = 0; i < argc; i++){
+            ring->words[head++ & PLANT_LOG_RING_MASK] = args[i];
+        }
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    portCLEAR_INTERRUPT_MASK_FROM_ISR(irq_state);
+}
+
+static void plant_log_drain_ring(struct plant_log_ring_struct *ring, int core)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+
+    while(tail != head){
+        uint32_t header = ring->words[tail++ & PLANT_LOG_RING_MASK];
+        uint32_t timestamp = ring->words[tail++ & PLANT_LOG_RING_MASK];
+        uint32_t argc = header >> 16;
+
+        printf("@PL %d %x %x", core, timestamp, header & 0xffff);
+        for(uint32_t i = 0; i < argc; i++){
+            printf(" %x", ring->words[tail++ & PLANT_LOG_RING_MASK]);
+        }
+        printf("\n");
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    // Racy read/clear is fine, a lost increment only under-reports drops
+    if(ring->dropped){
+        printf("@PL %d dropped %u\n", core, ring->dropped);
+        ring->dropped = 0;
+    }
+}
+
+static void plant_log_drain_task(void *pvParameters)
+{
+    while(1)
+    {
+        for(int core = 0; core < portNUM_PROCESSORS; core++){
+            plant_log_drain_ring(&plant_log_rings[core], core);
+        }
+        vTaskDelay(PLANT_LOG_DRAIN_PERIOD_MS / portTICK_PERIOD_MS);
+    }
+}
+
+void plant_log_init(void)
+{
+    xTaskCreate(plant_log_drain_task, "plant_log", 3072, NULL, tskIDLE_PRIORITY + 1, NULL);
+}
+
+#else
+
+void plant_log_init(void)
+{
+}
+
+void plant_log_write(uint16_t id, const uint32_t *args, size_t argc)
+{
+}
+
+#endif
+
+void plant_log_text(uint16_t id, ...)
+{
+    if(id >= PLOG_FORMAT_COUNT){
+        return;
+    }
+
+    // Formatted first and printed through ESP_LOGI, so esp_log_level_set() and
+    // CONFIG_LOG_DEFAULT_LEVEL can quieten the text fallback like any other log
+    char text[PLANT_LOG_TEXT_MAX];
+    va_list args;
+    va_start(args, id);
+    vsnprintf(text, sizeof(text), plant_log_formats[id], args);
+    va_end(args);
+    ESP_LOGI(TAG, "%s", text);
+}
@@ -0,0 +1,56 @@
+/* Plant Thing deferred logging
+
+   PLANT_LOG(id, args...) logs one of the formats in plant_log_formats.h.
+
+   With CONFIG_PLANT_LOG_DEFERRED the call site only copies the format id, a
+   timestamp and the raw argument words into a ring buffer owned by the current
+   core; a low priority task drains the rings and prints one compact "@PL" line
+   per record.  tools/plant_log_decode.py expands those lines back into text.
+   Without it the format is printed immediately, like ESP_LOGI.
+
+   Wrap every argument in PLOG_I() (integers) or PLOG_F() (floats).
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "sdkconfig.h"
+
+#define PLOG_FMT(id, fmt) id,
+enum PlantLogFormats{
+#include "plant_log_formats.h"
+    PLOG_FORMAT_COUNT
+};
+#undef PLOG_FMT
+
+#define PLANT_LOG_MAX_ARGS 12
+
+#if CONFIG_PLANT_LOG_DEFERRED
+
+static inline uint32_t plant_log_float_bits(float value){
+    union { float f; uint32_t u; } bits = { .f = value };
+    return bits.u;
+}
+
+#define PLOG_I(x) ((uint32_t)(x))
+#define PLOG_F(x) plant_log_float_bits(x)
+#define PLANT_LOG(id, ...) \
+    plant_log_write((id), (const uint32_t[]){ __VA_ARGS__ }, sizeof((const uint32_t[]){ __VA_ARGS__ }) / sizeof(uint32_t))
+
+#else
+
+#define PLOG_I(x) ((int)(x))
+#define PLOG_F(x) ((double)(x))
+#define PLANT_LOG(id, ...) plant_log_text((id), ##__VA_ARGS__)
+
+#endif
+
+// Starts the drain task (deferred mode only).  Records logged before this are kept.
+void plant_log_init(void);
+
+// Copies a record into the current core's ring.  Safe from tasks and ISRs; drops the
+// record (and counts it) if the ring is full.
+void plant_log_write(uint16_t id, const uint32_t *args, size_t argc);
+
+// Prints a record immediately (non-deferred mode)
+void plant_log_text(uint16_t id, ...);
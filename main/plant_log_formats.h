@@ -0,0 +1,28 @@
+/* Plant Thing tokenized log formats
+
+   One entry per PLANT_LOG() call site:  PLOG_FMT(id, "format")
+
+   Ids are numbered in the order they appear here, and tools/plant_log_decode.py
+   reads this file to turn captured "@PL" records back into text, so only ever
+   append new entries.  An entry whose call sites are gone or whose arguments
+   change stays in place under a retired name, so older captures still
+   decode.  Arguments are stored as raw 32-bit words, so formats may only use
+   %d, %i, %u, %x and %f/%e/%g conversions (no strings, no 64-bit).
+*/
+
+PLOG_FMT(PLOG_POLL_V0,           "[%d] moisture = %0.4f (%d), water_available = %d, temperature = %0.1f, humidity = %0.1f, state = %d, sum_heap_free=%u")
+PLOG_FMT(PLOG_STATE_CHANGE_V0,   "state %d -> %d %f")
+PLOG_FMT(PLOG_STATE_ALARM_V0,    "ALARM!  state %d -> %d %f")
+PLOG_FMT(PLOG_MQTT_CONNECTED,    "MQTT_EVENT_CONNECTED, subscribe msg_id=%d")
+PLOG_FMT(PLOG_MQTT_DISCONNECTED, "MQTT_EVENT_DISCONNECTED")
+PLOG_FMT(PLOG_MQTT_SUBSCRIBED,   "MQTT_EVENT_SUBSCRIBED, msg_id=%d")
+PLOG_FMT(PLOG_MQTT_PUBLISHED,    "MQTT_EVENT_PUBLISHED, msg_id=%d")
+PLOG_FMT(PLOG_MQTT_DATA,         "MQTT_EVENT_DATA, topic_len=%d, data_len=%d")
+PLOG_FMT(PLOG_PUMP_SAFETY_TRIP_V0, "pump safety cutoff: water_available = %d, detect latency = %u us")
+PLOG_FMT(PLOG_SENSOR_FAULTS,     "plant %d sensor faults: moisture = 0x%x, level = 0x%x")
+PLOG_FMT(PLOG_DOSE,              "plant %d dose %u ms, gain %0.1f counts/s from %d measurements")
+PLOG_FMT(PLOG_WATERED,           "plant %d watered in %u s, %d pulses, overshoot %d counts")
+PLOG_FMT(PLOG_POLL,              "plant %d [%d] moisture = %0.4f (%d), water_available = %d, temperature = %0.1f, humidity = %0.1f, state = %d, sum_heap_free=%u")
+PLOG_FMT(PLOG_STATE_CHANGE,      "plant %d state %d -> %d %f")
+PLOG_FMT(PLOG_STATE_ALARM,       "plant %d ALARM!  state %d -> %d %f")
+PLOG_FMT(PLOG_PUMP_SAFETY_TRIP,  "plant %d pump safety cutoff: water_available = %d, detect latency = %u us")
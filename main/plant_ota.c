@@ -0,0 +1,398 @@
+/* Plant Thing delta OTA over MQTT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "esp_partition.h"
+#include "esp_ota_ops.h"
+#include "nvs_flash.h"
+#include "cJSON.h"
+#include "mbedtls/sha256.h"
+
+#include "ota_delta.h"
+#include "plant_ota.h"
+#include "plant_energy.h"
+
+#define OTA_NVS_NAMESPACE "storage"
+#define OTA_NVS_KEY "ota_ckpt"
+#define OTA_RESTART_DELAY_US (2 * 1000000ull)    // Lets the "done" status go out before rebooting
+
+static const char *TAG = "plant_ota";
+
+// Everything needed to resume an update, saved to NVS as one blob
+struct plant_ota_checkpoint_struct{
+    uint32_t patch_size;
+    uint32_t old_address;       // Partition the patch is applied against (the running one)
+    uint32_t new_address;       // Partition being written
+    uint8_t sha256[PLANT_OTA_SHA256_SIZE];      // Of the new image, from the start command
+    struct ota_delta_state_struct delta;
+};
+
+static struct plant_ota_checkpoint_struct ota;
+static bool ota_active = false;
+static const esp_partition_t *old_partition = NULL;
+static const esp_partition_t *new_partition = NULL;
+static esp_mqtt_client_handle_t ota_client = NULL;
+static esp_timer_handle_t restart_timer = NULL;
+static uint32_t requested_offset = 0;
+static volatile uint64_t request_time_us = 0;   // When the outstanding chunk was requested, 0 if none
+static bool ota_message = false;       // Fragments of the current MQTT message are OTA data
+static bool chunk_receiving = false;   // ... and are the chunk we are waiting for
+
+static char ota_req_topic[32];
+static char ota_data_topic[32];
+static char ota_status_topic[32];
+
+static int read_old(void *ctx, uint32_t offset, void *buf, size_t len)
+{
+    return esp_partition_read(old_partition, offset, buf, len) != ESP_OK;
+}
+
+static int write_new(void *ctx, uint32_t offset, const void *buf, size_t len)
+{
+    // Output is written sequentially, so erase each sector as it is reached
+    if(offset % OTA_DELTA_SECTOR_SIZE == 0){
+        if(esp_partition_erase_range(new_partition, offset, OTA_DELTA_SECTOR_SIZE) != ESP_OK){
+            return 1;
+        }
+    }
+    return esp_partition_write(new_partition, offset, buf, len) != ESP_OK;
+}
+
+static void save_checkpoint(void)
+{
+    nvs_handle_t my_handle;
+    esp_err_t err = nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &my_handle);
+    if(err == ESP_OK){
+        err = nvs_set_blob(my_handle, OTA_NVS_KEY, &ota, sizeof(ota));
+        if(err == ESP_OK){
+            err = nvs_commit(my_handle);
+        }
+        nvs_close(my_handle);
+    }
+    if(err != ESP_OK){
+        ESP_LOGW(TAG, "Checkpoint failed: %s", esp_err_to_name(err));
+    }
+}
+
+static void clear_checkpoint(void)
+{
+    nvs_handle_t my_handle;
+    if(nvs_open(OTA_NVS_NAMESPACE, NVS_READWRITE, &my_handle) == ESP_OK){
+        nvs_erase_key(my_handle, OTA_NVS_KEY);
+        nvs_commit(my_handle);
+        nvs_close(my_handle);
+    }
+}
+
+// Publishes on the OTA client, accounting the radio cost as app_main.c's mqttPublish does
+static void ota_publish(const char *topic, const char *data, int qos)
+{
+    plant_energy_count(PLANT_ENERGY_PUBLISH, 1);
+    plant_energy_count(PLANT_ENERGY_TX_BYTE, strlen(data));
+    esp_mqtt_client_publish(ota_client, topic, data, 0, qos, 0);
+}
+
+static void publish_status(const char *state, const char *error)
+{
+    if(ota_client == NULL){
+        return;
+    }
+
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddStringToObject(root, "state", state);
+    cJSON_AddNumberToObject(root, "offset", ota.delta.patch_offset);
+    cJSON_AddNumberToObject(root, "size", ota.patch_size);
+    cJSON_AddNumberToObject(root, "written", ota.delta.output_offset);
+    if(error){
+        cJSON_AddStringToObject(root, "error", error);
+    }
+    char *my_json_string = cJSON_PrintUnformatted(root);
+    ota_publish(ota_status_topic, my_json_string, 1);
+    free(my_json_string);
+    cJSON_Delete(root);
+}
+
+static void publish_request(void)
+{
+    char request[48];
+    uint32_t len = ota.patch_size - requested_offset;
+    if(len > PLANT_OTA_CHUNK_SIZE){
+        len = PLANT_OTA_CHUNK_SIZE;
+    }
+    snprintf(request, sizeof(request), "{\"offset\":%u,\"len\":%u}", requested_offset, len);
+    ota_publish(ota_req_topic, request, 0);
+    request_time_us = esp_timer_get_time();
+}
+
+static void stop_update(void)
+{
+    ota_active = false;
+    chunk_receiving = false;
+    request_time_us = 0;
+    clear_checkpoint();
+}
+
+static void fail_update(const char *error)
+{
+    ESP_LOGE(TAG, "Update failed at patch offset %u: %s", ota.delta.patch_offset, error);
+    stop_update();
+    publish_status("failed", error);
+}
+
+static void request_next_chunk(void)
+{
+    if(ota.delta.patch_offset >= ota.patch_size){
+        fail_update("Patch ended early");
+        return;
+    }
+    requested_offset = ota.delta.patch_offset;
+    if(ota_client){
+        publish_request();
+    }
+}
+
+static void restart_timer_cb(void *arg)
+{
+    esp_restart();
+}
+
+static void checkpoint_cb(void *ctx, const struct ota_delta_state_struct *state)
+{
+    // Called per output sector, NVS only needs to see every few
+    if((state->output_offset / OTA_DELTA_SECTOR_SIZE) % PLANT_OTA_CHECKPOINT_SECTORS == 0){
+        save_checkpoint();
+        publish_status("running", NULL);
+    }
+}
+
+static const struct ota_delta_io_struct ota_io = {
+    .ctx = NULL,
+    .read_old = read_old,
+    .write_new = write_new,
+    .checkpoint = checkpoint_cb,
+};
+
+static const char *delta_error_text(int err)
+{
+    switch(err){
+        case OTA_DELTA_ERR_FORMAT: return "Corrupt patch";
+        case OTA_DELTA_ERR_IO: return "Flash access failed";
+        case OTA_DELTA_ERR_RANGE: return "Patch out of range";
+        case OTA_DELTA_ERR_OLD_CRC: return "Patch is for a different firmware";
+        case OTA_DELTA_ERR_NEW_CRC: return "New image CRC mismatch";
+        default: return "Unknown error";
+    }
+}
+
+// Reads back the written image and compares its SHA-256 with the one the start command gave
+static bool new_image_matches(void)
+{
+    uint8_t buf[OTA_DELTA_COPY_BUFFER];
+    uint8_t digest[PLANT_OTA_SHA256_SIZE];
+    bool ok = true;
+    mbedtls_sha256_context ctx;
+
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx, 0);
+    for(uint32_t offset = 0; ok && offset < ota.delta.output_offset; offset += sizeof(buf))
+    {
+        size_t n = ota.delta.output_offset - offset < sizeof(buf) ? ota.delta.output_offset - offset : sizeof(buf);
+        ok = esp_partition_read(new_partition, offset, buf, n) == ESP_OK;
+        if(ok){
+            mbedtls_sha256_update_ret(&ctx, buf, n);
+        }
+    }
+    mbedtls_sha256_finish_ret(&ctx, digest);
+    mbedtls_sha256_free(&ctx);
+    return ok && 0 == memcmp(digest, ota.sha256, sizeof(digest));
+}
+
+// Decodes 64 hex digits into sha256, false if the string is anything else
+static bool parse_sha256(const char *hex, uint8_t *sha256)
+{
+    if(hex == NULL || strlen(hex) != 2 * PLANT_OTA_SHA256_SIZE){
+        return false;
+    }
+    for(int i = 0; i < PLANT_OTA_SHA256_SIZE; i++)
+    {
+        char hex_byte[3] = { hex[2*i], hex[2*i + 1], 0 };
+        if(!isxdigit((unsigned char) hex_byte[0]) || !isxdigit((unsigned char) hex_byte[1])){
+            return false;
+        }
+        sha256[i] = strtol(hex_byte, NULL, 16);
+    }
+    return true;
+}
+
+static void finish_update(void)
+{
+    stop_update();
+
+    // The CRC only guards against a patch applied to the wrong image, the SHA-256 proves the result
+    if(!new_image_matches()){
+        ESP_LOGE(TAG, "New image SHA-256 mismatch");
+        publish_status("failed", "New image SHA-256 mismatch");
+        return;
+    }
+
+    // Also validates the image header, segments and SHA-256 before switching
+    esp_err_t err = esp_ota_set_boot_partition(new_partition);
+    if(err != ESP_OK){
+        publish_status("failed", esp_err_to_name(err));
+        return;
+    }
+    ESP_LOGI(TAG, "Update complete (%u byte patch, %u byte image), restarting", ota.patch_size, ota.delta.output_offset);
+    publish_status("done", NULL);
+    esp_timer_start_once(restart_timer, OTA_RESTART_DELAY_US);
+}
+
+void plant_ota_init(const char *device_id)
+{
+    snprintf(ota_req_topic, sizeof(ota_req_topic), "pt/%s/ota/req", device_id);
+    snprintf(ota_data_topic, sizeof(ota_data_topic), "pt/%s/ota/data", device_id);
+    snprintf(ota_status_topic, sizeof(ota_status_topic), "pt/%s/ota/status", device_id);
+
+    const esp_timer_create_args_t restart_timer_args = {
+        .callback = restart_timer_cb,
+        .name = "ota_restart",
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&restart_timer_args, &restart_timer));
+
+    old_partition = esp_ota_get_running_partition();
+    new_partition = esp_ota_get_next_update_partition(NULL);
+
+    nvs_handle_t my_handle;
+    if(nvs_open(OTA_NVS_NAMESPACE, NVS_READONLY, &my_handle) != ESP_OK){
+        return;
+    }
+    size_t required_size = sizeof(ota);
+    esp_err_t err = nvs_get_blob(my_handle, OTA_NVS_KEY, &ota, &required_size);
+    nvs_close(my_handle);
+    if(err != ESP_OK || required_size != sizeof(ota)){
+        memset(&ota, 0, sizeof(ota));
+        return;
+    }
+
+    // Only resume against the same partitions, e.g. not after a manual reflash
+    if(new_partition && old_partition->address == ota.old_address && new_partition->address == ota.new_address){
+        ota_active = true;
+        requested_offset = ota.delta.patch_offset;
+        ESP_LOGI(TAG, "Resuming update at patch offset %u of %u", ota.delta.patch_offset, ota.patch_size);
+    }else{
+        clear_checkpoint();
+        memset(&ota, 0, sizeof(ota));
+    }
+}
+
+void plant_ota_poll(uint64_t now)
+{
+    uint64_t requested = request_time_us;
+    if(ota_active && ota_client && requested && now > requested && now - requested > PLANT_OTA_RETRY_US){
+        ESP_LOGW(TAG, "Chunk %u timed out, requesting again", requested_offset);
+        publish_request();
+    }
+}
+
+void plant_ota_on_connected(esp_mqtt_client_handle_t client, bool session_present)
+{
+    ota_client = client;
+    if(!session_present){
+        esp_mqtt_client_subscribe(client, ota_data_topic, 1);
+    }
+
+#ifdef CONFIG_BOOTLOADER_APP_ROLLBACK_ENABLE
+    // Reaching the broker proves the new image works, so stop the bootloader rolling it back
+    esp_ota_img_states_t img_state;
+    if(esp_ota_get_state_partition(old_partition, &img_state) == ESP_OK && img_state == ESP_OTA_IMG_PENDING_VERIFY){
+        esp_ota_mark_app_valid_cancel_rollback();
+    }
+#endif
+
+    if(ota_active){
+        chunk_receiving = false;
+        publish_status("running", NULL);
+        request_next_chunk();
+    }
+}
+
+const char *plant_ota_start(esp_mqtt_client_handle_t client, uint32_t patch_size, const char *sha256_hex)
+{
+    uint8_t sha256[PLANT_OTA_SHA256_SIZE];
+
+    if(client == NULL){
+        return "OTA REJECTED - No MQTT session";
+    }
+    if(ota_active){
+        return "OTA REJECTED - Update already running";
+    }
+    if(new_partition == NULL){
+        return "OTA REJECTED - No OTA partition";
+    }
+    if(patch_size <= sizeof(struct ota_delta_header_struct)){
+        return "OTA REJECTED - Bad size";
+    }
+    if(!parse_sha256(sha256_hex, sha256)){
+        return "OTA REJECTED - Bad sha256";
+    }
+
+    memset(&ota, 0, sizeof(ota));
+    ota.patch_size = patch_size;
+    ota.old_address = old_partition->address;
+    ota.new_address = new_partition->address;
+    memcpy(ota.sha256, sha256, sizeof(ota.sha256));
+    ota_delta_init(&ota.delta);
+    ota_client = client;
+    ota_active = true;
+    save_checkpoint();
+
+    ESP_LOGI(TAG, "Starting update, %u byte patch into \"%s\"", patch_size, new_partition->label);
+    request_next_chunk();
+    return "OTA STARTED";
+}
+
+bool plant_ota_handle_data(esp_mqtt_event_handle_t event)
+{
+    const uint8_t *data = (const uint8_t *) event->data;
+    size_t len = event->data_len;
+
+    // Only the first fragment of a message carries the topic
+    if(event->current_data_offset == 0){
+        ota_message = event->topic_len == strlen(ota_data_topic) && 0 == strncmp(event->topic, ota_data_topic, event->topic_len);
+        chunk_receiving = false;
+        if(!ota_message){
+            return false;
+        }
+        if(!ota_active || len < 4){
+            return true;
+        }
+        uint32_t offset = data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t) data[3] << 24);
+        if(offset != ota.delta.patch_offset){
+            return true;   // Duplicate of a retried request
+        }
+        chunk_receiving = true;
+        data += 4;
+        len -= 4;
+    }else if(!ota_message){
+        return false;
+    }
+
+    if(!chunk_receiving){
+        return true;
+    }
+
+    int result = ota_delta_feed(&ota.delta, &ota_io, data, len);
+    if(result < 0){
+        fail_update(delta_error_text(result));
+    }else if(result == OTA_DELTA_DONE){
+        finish_update();
+    }else if(event->current_data_offset + event->data_len >= event->total_data_len){
+        chunk_receiving = false;
+        request_next_chunk();
+    }
+    return true;
+}
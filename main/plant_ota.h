@@ -0,0 +1,45 @@
+/* Plant Thing delta OTA over MQTT
+
+   Pulls a delta patch (main/ota_delta.h) from the broker a chunk at a time
+   and applies it straight into the inactive OTA partition:
+
+     device -> pt/<id>/ota/req     {"offset":N,"len":L}
+     server -> pt/<id>/ota/data    u32 offset (LE) + patch bytes
+     device -> pt/<id>/ota/status  progress, errors and completion
+
+   The start command carries the SHA-256 of the new image, which is checked
+   against the written partition before it is made the boot partition.
+
+   Only one chunk is outstanding.  Chunks for any other offset are dropped and
+   a lost chunk is requested again after PLANT_OTA_RETRY_US, so the server is
+   stateless.  Progress is checkpointed to NVS so an update interrupted by a
+   reboot or power cut carries on where it left off.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mqtt_client.h"
+
+#define PLANT_OTA_CHUNK_SIZE 4096                 // Patch bytes requested at a time
+#define PLANT_OTA_RETRY_US (10 * 1000000ull)      // Re-request a chunk not received within this time
+#define PLANT_OTA_CHECKPOINT_SECTORS 16           // Output sectors (64 KB) between NVS checkpoints
+#define PLANT_OTA_SHA256_SIZE 32
+
+// Builds the OTA topics and picks up an interrupted update from NVS
+void plant_ota_init(const char *device_id);
+
+// Requests the outstanding chunk again once PLANT_OTA_RETRY_US has passed without it.  Called from
+// the plant scheduler task rather than a timer, as publishing can block.
+void plant_ota_poll(uint64_t now);
+
+// Subscribes to chunk data if needed and (re)requests the next chunk of an update in progress
+void plant_ota_on_connected(esp_mqtt_client_handle_t client, bool session_present);
+
+// Starts applying a patch of patch_size bytes whose new image has the SHA-256 sha256_hex (64 hex
+// digits), returns the command response text
+const char *plant_ota_start(esp_mqtt_client_handle_t client, uint32_t patch_size, const char *sha256_hex);
+
+// Consumes an MQTT_EVENT_DATA if it belongs to the OTA data topic, including the later
+// fragments of a chunk larger than the MQTT buffer.  Returns false for other messages.
+bool plant_ota_handle_data(esp_mqtt_event_handle_t event);
@@ -0,0 +1,226 @@
+/* Plant Thing watering state machine */
+
+#include <stddef.h>
+
+#include "plant_state.h"
+
+#define SEC_IN_MICROSEC 1000000ull
+
+void plant_state_init(struct plant_state_struct *machine, const struct plant_watering_config_struct *config,
+    struct plant_dosing_struct *dosing, float max_pulse_s, const struct plant_state_hooks_struct *hooks, void *ctx, uint64_t now)
+{
+    *machine = (struct plant_state_struct){
+        .state = PLANT_DRYING,
+        .state_entry_time_us = now,
+        .config = config,
+        .dosing = dosing,
+        .max_pulse_s = max_pulse_s,
+        .hooks = hooks,
+        .ctx = ctx,
+    };
+}
+
+void plant_state_change(struct plant_state_struct *machine, enum PlantStates new_state, uint64_t now)
+{
+    bool valid = false;
+
+    switch(machine->state){
+        case PLANT_DRYING:
+            switch(new_state){
+                case PLANT_DRY_HOLD: valid = true; break;
+                default: /* invalid */ break;
+            }
+            break;
+        case PLANT_DRY_HOLD:
+            switch(new_state){
+                case PLANT_PUMP_DELAY: valid = true; break;
+                case PLANT_DRYING: valid = true; break;
+                default: /* invalid */ break;
+            }
+            break;
+        case PLANT_PUMP_DELAY:
+            switch(new_state){
+                case PLANT_PUMP_ON: valid = true; break;
+                case PLANT_WET_HOLD: valid = true; break;
+                default: /* invalid */ break;
+            }
+            break;
+        case PLANT_PUMP_ON:
+            switch(new_state){
+                case PLANT_PUMP_DELAY: valid = true; break;
+                case PLANT_ALARM: valid = true; break; // Pump safety cutoff
+                default: /* invalid */ break;
+            }
+            break;
+        case PLANT_WET_HOLD:
+            switch(new_state){
+                case PLANT_DRYING: valid = true; break;
+                case PLANT_PUMP_DELAY: valid = true; break;
+                default: /* invalid */ break;
+            }
+            break;
+        default:
+            break;
+    }
+
+    if(machine->hooks->change){
+        machine->hooks->change(machine->ctx, machine->state, new_state, valid, now);
+    }
+    machine->state_entry_time_us = now;
+    machine->state = valid ? new_state : PLANT_ALARM;
+}
+
+static void start_watering(struct plant_state_struct *machine, uint64_t pump_on_us, uint64_t now)
+{
+    machine->watering_start_us = now;
+    machine->watering_start_pump_us = pump_on_us;
+    machine->watering_pulses = 0;
+    machine->dose_pending = false;
+}
+
+// Sizes the pulse from the learned response of this pot, within the configured limits
+float plant_state_pulse_s(const struct plant_state_struct *machine, uint16_t moisture)
+{
+    float min_s = machine->config->pump_on_period_s;
+
+    if(!machine->max_pulse_s){
+        return min_s;
+    }
+    float max_s = machine->max_pulse_s > min_s ? machine->max_pulse_s : min_s;
+    return plant_dosing_pulse_s(machine->dosing, moisture, machine->config->high_moisture, min_s, max_s);
+}
+
+static void start_dose(struct plant_state_struct *machine, uint16_t moisture, uint64_t pump_on_us)
+{
+    machine->dose_pulse_ms = plant_state_pulse_s(machine, moisture) * 1000;
+    machine->dose_pending = true;
+    machine->dose_start_moisture = moisture;
+    machine->dose_start_pump_us = pump_on_us;
+    machine->watering_pulses++;
+    if(machine->hooks->dose){
+        machine->hooks->dose(machine->ctx);
+    }
+}
+
+// Learns from the last pulse once its water has soaked in for a full pump_off_period_s
+static void measure_dose(struct plant_state_struct *machine, uint16_t moisture, uint64_t pump_on_us, uint64_t now)
+{
+    if(!machine->dose_pending){
+        return;
+    }
+    machine->dose_pending = false;
+    if(now - machine->state_entry_time_us < machine->config->pump_off_period_s * SEC_IN_MICROSEC){
+        return;
+    }
+
+    // Actual pump time, the pulse may have been blocked or cut short by the safety checks
+    float pumped_s = (pump_on_us - machine->dose_start_pump_us) / (float) SEC_IN_MICROSEC;
+    if(plant_dosing_learn(machine->dosing, machine->dose_start_moisture, moisture, pumped_s) && machine->hooks->learned){
+        machine->hooks->learned(machine->ctx);
+    }
+}
+
+static void watered(struct plant_state_struct *machine)
+{
+    if(machine->hooks->watered){
+        machine->hooks->watered(machine->ctx);
+    }
+}
+
+void plant_state_step(struct plant_state_struct *machine, uint16_t moisture, uint64_t pump_on_us, uint64_t now)
+{
+    const struct plant_watering_config_struct *config = machine->config;
+    uint64_t elapsed_us = now - machine->state_entry_time_us;
+
+    switch(machine->state){
+        case PLANT_DRYING:
+            if(moisture < config->low_moisture)
+            {
+                plant_state_change(machine, PLANT_DRY_HOLD, now);
+            }
+            else
+            {
+                // Stay in PLANT_DRYING state
+            }
+            break;
+        case PLANT_DRY_HOLD:
+            if(moisture > config->low_moisture)
+            {
+                plant_state_change(machine, PLANT_DRYING, now);
+            }
+            else if(elapsed_us > config->dry_hold_period_s * SEC_IN_MICROSEC)
+            {
+                start_watering(machine, pump_on_us, now);
+                plant_state_change(machine, PLANT_PUMP_DELAY, now);
+            }
+            else
+            {
+                // Stay in PLANT_DRY_HOLD state
+            }
+            break;
+        case PLANT_PUMP_DELAY:
+            if(moisture >= config->high_moisture)
+            {
+                measure_dose(machine, moisture, pump_on_us, now);
+                machine->watering_time_s = (now - machine->watering_start_us) / SEC_IN_MICROSEC;
+                machine->watering_peak_moisture = moisture;
+                plant_state_change(machine, PLANT_WET_HOLD, now);
+            }
+            else if(elapsed_us > config->pump_off_period_s * SEC_IN_MICROSEC)
+            {
+                measure_dose(machine, moisture, pump_on_us, now);
+                start_dose(machine, moisture, pump_on_us);
+                plant_state_change(machine, PLANT_PUMP_ON, now);
+            }
+            else
+            {
+                // Stay in PLANT_PUMP_DELAY state
+            }
+            break;
+        case PLANT_PUMP_ON:
+            if(elapsed_us > machine->dose_pulse_ms * 1000ull)
+            {
+                plant_state_change(machine, PLANT_PUMP_DELAY, now);
+            }
+            else
+            {
+                // Stay in PLANT_PUMP_ON state
+            }
+            break;
+        case PLANT_WET_HOLD:
+            if(moisture > machine->watering_peak_moisture){
+                machine->watering_peak_moisture = moisture;
+            }
+            if(moisture <= config->watered_moisture)
+            {
+                watered(machine);
+                start_watering(machine, pump_on_us, now);
+                plant_state_change(machine, PLANT_PUMP_DELAY, now);
+            }
+            else if(elapsed_us > config->wet_hold_period_s * SEC_IN_MICROSEC)
+            {
+                watered(machine);
+                plant_state_change(machine, PLANT_DRYING, now);
+            }
+            else
+            {
+                // Stay in PLANT_WET_HOLD state
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+uint64_t plant_state_period_us(const struct plant_state_struct *machine)
+{
+    const struct plant_watering_config_struct *config = machine->config;
+
+    switch(machine->state){
+        case PLANT_DRY_HOLD:   return config->dry_hold_period_s * SEC_IN_MICROSEC;
+        case PLANT_PUMP_DELAY: return config->pump_off_period_s * SEC_IN_MICROSEC;
+        case PLANT_PUMP_ON:    return machine->dose_pulse_ms * 1000ull;
+        case PLANT_WET_HOLD:   return config->wet_hold_period_s * SEC_IN_MICROSEC;
+        default:               return 0;
+    }
+}
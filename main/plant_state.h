@@ -0,0 +1,83 @@
+/* Plant Thing watering state machine
+
+   One plant's watering states and the transitions between them, driven by
+   its moisture reading and the time spent in each state, with the learned
+   dosing (plant_dosing.h) that sizes each pump pulse.
+
+   Plain C, no ESP-IDF dependencies, so the firmware's scheduler and the host
+   tools in main/host_test run the same transitions.  What a transition does
+   to the board (the pump, logs, NVS and metrics) goes through the hooks.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "plant_dosing.h"
+
+enum PlantStates{
+    PLANT_DRYING = 0,
+    PLANT_PUMP_DELAY = 1,
+    PLANT_PUMP_ON = 2,
+    PLANT_WET_HOLD = 3,
+    PLANT_DRY_HOLD = 4,
+    PLANT_ALARM = 5
+};
+
+// Watering Algorithm Parameters for plant
+struct plant_watering_config_struct{
+    uint16_t low_moisture;
+    uint16_t watered_moisture;
+    uint16_t high_moisture;
+    uint16_t polling_period_s;
+    uint16_t pump_on_period_s;
+    uint16_t pump_off_period_s;
+    uint16_t wet_hold_period_s;
+    uint16_t dry_hold_period_s;
+};
+
+// What the owner does on the machine's events, ctx is the machine's.  Any may be NULL.
+struct plant_state_hooks_struct{
+    // Called before a transition to new_state, or before an invalid one is turned into PLANT_ALARM
+    void (*change)(void *ctx, enum PlantStates old_state, enum PlantStates new_state, bool valid, uint64_t now);
+    void (*dose)(void *ctx);        // A pulse was sized, see dose_pulse_ms
+    void (*learned)(void *ctx);     // The dosing gain was updated
+    void (*watered)(void *ctx);     // A watering ended, see the watering_* results
+};
+
+struct plant_state_struct{
+    enum PlantStates state;
+    uint64_t state_entry_time_us;
+    // Set by plant_state_init
+    const struct plant_watering_config_struct *config;
+    struct plant_dosing_struct *dosing;
+    float max_pulse_s;                  // Longest learned pulse, 0 = pulses are always pump_on_period_s
+    const struct plant_state_hooks_struct *hooks;
+    void *ctx;
+    // Learned dosing - the current pulse and the watering it belongs to
+    uint32_t dose_pulse_ms;
+    bool dose_pending;                  // Pulse given, its effect not yet measured
+    uint16_t dose_start_moisture;
+    uint64_t dose_start_pump_us;        // Pump run time at the start of the pulse
+    uint64_t watering_start_us;         // Entry into PUMP_DELAY from a hold state
+    uint64_t watering_start_pump_us;
+    uint32_t watering_time_s;           // Watering start to reaching high_moisture
+    uint16_t watering_pulses;
+    uint16_t watering_peak_moisture;    // Highest reading in the WET_HOLD that followed
+};
+
+// Starts the machine in PLANT_DRYING at now
+void plant_state_init(struct plant_state_struct *machine, const struct plant_watering_config_struct *config,
+    struct plant_dosing_struct *dosing, float max_pulse_s, const struct plant_state_hooks_struct *hooks, void *ctx, uint64_t now);
+
+// Moves to new_state, or to PLANT_ALARM if that is not a valid transition from the current state
+void plant_state_change(struct plant_state_struct *machine, enum PlantStates new_state, uint64_t now);
+
+// One scheduler pass at now on the latest moisture reading.  pump_on_us is the pump's total run
+// time so far, for measuring pulses.
+void plant_state_step(struct plant_state_struct *machine, uint16_t moisture, uint64_t pump_on_us, uint64_t now);
+
+// Length of a pump pulse started at moisture, learned if the machine has a max_pulse_s
+float plant_state_pulse_s(const struct plant_state_struct *machine, uint16_t moisture);
+
+// How long the current state lasts before a timed transition, 0 if it has no time limit
+uint64_t plant_state_period_us(const struct plant_state_struct *machine);
@@ -0,0 +1,25 @@
+/* Plant Thing synthetic soil */
+
+#include <math.h>
+
+#include "plant_synthetic.h"
+
+uint16_t plant_synthetic_step(struct plant_synthetic_struct *soil, float elapsed_s, uint64_t pump_on_total_us,
+    uint16_t dry, uint16_t wet)
+{
+    float pumped_s = (pump_on_total_us - soil->pump_on_us) / 1000000.0f;
+    soil->pump_on_us = pump_on_total_us;
+
+    // Pumped water reaches the sensor gradually, so a pulse keeps raising the reading during the soak
+    soil->soak += pumped_s * PLANT_SYNTHETIC_PUMP_COUNTS_PER_S;
+    float absorbed = soil->soak * (1.0f - expf(-elapsed_s / PLANT_SYNTHETIC_SOAK_TIME_S));
+    soil->soak -= absorbed;
+
+    soil->moisture += absorbed - elapsed_s * PLANT_SYNTHETIC_DRY_COUNTS_PER_S;
+    if(soil->moisture < dry){
+        soil->moisture = dry;
+    }else if(soil->moisture > wet){
+        soil->moisture = wet;
+    }
+    return soil->moisture;
+}
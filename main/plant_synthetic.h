@@ -0,0 +1,27 @@
+/* Plant Thing synthetic soil
+
+   Stands in for the moisture and level sensors when polling is faked
+   (CONFIG_PLANT_SYNTHETIC_SENSORS): moisture dries at a constant rate and
+   rises with pump run time, so the state machine, pump timing and telemetry
+   all run on a board, or a host, without sensors.  The reservoir never runs
+   dry.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#define PLANT_SYNTHETIC_DRY_COUNTS_PER_S 0.02f    // Moisture sensor counts lost per second
+#define PLANT_SYNTHETIC_PUMP_COUNTS_PER_S 40.0f   // Moisture sensor counts gained per pump second
+#define PLANT_SYNTHETIC_SOAK_TIME_S 20.0f         // Time constant of pumped water reaching the sensor
+#define PLANT_SYNTHETIC_LEVEL 3000                // Reservoir level reading
+
+struct plant_synthetic_struct{
+    float moisture;         // Sensor counts, 0 = not started
+    float soak;             // Pumped water (in sensor counts) not yet at the sensor
+    uint64_t pump_on_us;    // Pump run time already applied
+};
+
+// Advances the soil by elapsed_s, given the pump's total run time so far.  Returns the moisture
+// reading, kept within [dry, wet].
+uint16_t plant_synthetic_step(struct plant_synthetic_struct *soil, float elapsed_s, uint64_t pump_on_total_us,
+    uint16_t dry, uint16_t wet);
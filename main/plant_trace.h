@@ -0,0 +1,46 @@
+/* Plant Thing sensor trace format
+
+   With tracing on ("trace on" over MQTT), every real sensor poll appends one
+   record per plant to a buffer that is published to pt/<device_id>/trace when full.
+   A record holds everything needed to replay the poll through the state
+   machine offline: the plant's watering config, the raw ADC bursts before
+   median filtering, the DHT reading, the learned dosing state and the state
+   the device was in.
+
+   Records are packed, little endian, and concatenated back to back in the
+   published payloads.  Bump PLANT_TRACE_VERSION when the layout changes.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#define PLANT_TRACE_MAGIC 0x5054         // "PT"
+#define PLANT_TRACE_VERSION 2
+#define PLANT_TRACE_SAMPLES 9
+
+struct __attribute__((packed)) plant_trace_record_struct{
+    uint16_t magic;
+    uint8_t version;
+    uint8_t plant;
+    uint64_t time_us;
+    // Watering config in effect (sensor counts and seconds)
+    uint16_t low_moisture;
+    uint16_t watered_moisture;
+    uint16_t high_moisture;
+    uint16_t polling_period_s;
+    uint16_t pump_on_period_s;
+    uint16_t pump_off_period_s;
+    uint16_t wet_hold_period_s;
+    uint16_t dry_hold_period_s;
+    // Raw inputs
+    uint16_t moisture_samples[PLANT_TRACE_SAMPLES];
+    uint16_t level_samples[PLANT_TRACE_SAMPLES];
+    float temperature;
+    float humidity;
+    uint8_t dht_ok;
+    // Learned dosing (plant_dosing.h): the pot's gain and the pulse startDose last sized
+    float gain;
+    uint32_t dose_pulse_ms;
+    // State when the poll was taken, before any transition it causes
+    uint8_t state;
+};
@@ -0,0 +1,20 @@
+/* Plant Thing pump safety cutoff */
+
+#include "pump_safety.h"
+
+bool pump_safety_sample(struct pump_safety_struct *safety, int level, int empty_level, uint64_t now)
+{
+    if(level > empty_level){
+        safety->empty_samples = 0;
+        return false;
+    }
+
+    if(safety->empty_samples++ == 0){
+        safety->first_empty_us = now;
+    }
+    if(safety->empty_samples >= PUMP_SAFETY_TRIP_SAMPLES){
+        safety->empty_samples = 0;
+        return true;
+    }
+    return false;
+}
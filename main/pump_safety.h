@@ -0,0 +1,28 @@
+/* Plant Thing pump safety cutoff
+
+   While a pump runs its reservoir level is sampled every few milliseconds.
+   The pump is cut after PUMP_SAFETY_TRIP_SAMPLES consecutive empty samples,
+   so a single noisy sample never stops a watering but a dry reservoir is
+   caught within a few sample periods.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PUMP_SAFETY_TRIP_SAMPLES 3      // Consecutive empty samples needed to cut the pump
+
+struct pump_safety_struct{
+    int empty_samples;
+    uint64_t first_empty_us;    // Time of the first sample of the current empty run
+};
+
+// Starts a pump run afresh, an empty run left from the last one must not count towards a trip
+static inline void pump_safety_reset(struct pump_safety_struct *safety){
+    safety->empty_samples = 0;
+    safety->first_empty_us = 0;
+}
+
+// Adds one filtered level sample taken at now.  Returns true when the pump must be cut, after
+// which the run starts again.
+bool pump_safety_sample(struct pump_safety_struct *safety, int level, int empty_level, uint64_t now);
@@ -0,0 +1,30 @@
+/* Plant Thing sensor driver table and batched acquisition */
+
+#include "sensor_driver.h"
+
+const struct sensor_driver_struct *const sensor_drivers[SENSOR_DRIVER_COUNT] = {
+    [SENSOR_DRIVER_ADC] = &sensor_driver_adc,
+    [SENSOR_DRIVER_DHT11] = &sensor_driver_dht11,
+};
+
+void sensor_drivers_acquire(const struct sensor_request_struct *requests, int count, uint64_t now)
+{
+    for(int i = 0; i < count; i++)
+    {
+        sensor_drivers[requests[i].driver]->start(requests[i].pin);
+    }
+    for(int i = 0; i < count; i++)
+    {
+        if(sensor_drivers[requests[i].driver]->collect(requests[i].pin, requests[i].reading)){
+            requests[i].reading->time_us = now;
+        }
+    }
+}
+
+void sensor_drivers_count(const struct sensor_request_struct *requests, int count)
+{
+    for(int i = 0; i < count; i++)
+    {
+        plant_energy_count(sensor_drivers[requests[i].driver]->energy_event, 1);
+    }
+}
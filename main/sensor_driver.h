@@ -0,0 +1,76 @@
+/* Plant Thing sensor drivers
+
+   Every sensor is read through a struct sensor_driver_struct, registered
+   in sensor_drivers[] by type.  A new kind of sensor is a new driver and
+   table entry, the plant loop only sees readings.
+
+   Acquisition is split in two so a pass over many sensors is batched:
+     start     queues or begins an acquisition, never waits
+     collect   finishes it and fills in the reading
+   sensor_drivers_acquire() starts every request before collecting any.
+   The ADC driver reads all channels started in a pass in one interleaved
+   scan on the first collect, and the DHT driver reads on its own task, so
+   a DHT transfer runs alongside the ADC scan rather than after it.
+
+   Drivers are only called from the plant scheduler task.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "plant_energy.h"
+
+#define SENSOR_BURST_SAMPLES 9          // Raw samples per ADC reading, the median is the value
+#define SENSOR_MAX_VALUES 2
+
+struct sensor_reading_struct{
+    bool ok;
+    uint8_t sample_count;                   // Raw samples kept, 0 if the sensor has none
+    int samples[SENSOR_BURST_SAMPLES];      // Raw burst, for statistics and tracing
+    float values[SENSOR_MAX_VALUES];        // As named in the driver's description
+    uint64_t time_us;                       // Last successful acquisition, 0 = none yet
+};
+
+struct sensor_description_struct{
+    const char *name;
+    uint8_t value_count;
+    const char *value_names[SENSOR_MAX_VALUES];
+    const char *value_units[SENSOR_MAX_VALUES];
+};
+
+struct sensor_driver_struct{
+    // Configures the pin, once per distinct pin before the first start
+    void (*init)(int pin);
+    // Begins an acquisition on pin
+    void (*start)(int pin);
+    // Completes the acquisition started on pin, returns reading->ok
+    bool (*collect)(int pin, struct sensor_reading_struct *reading);
+    const struct sensor_description_struct *(*describe)(int pin);
+    // What one acquisition costs, see sensor_drivers_count()
+    enum PlantEnergyEvents energy_event;
+};
+
+enum SensorDriverTypes{
+    SENSOR_DRIVER_ADC = 0,
+    SENSOR_DRIVER_DHT11,
+    SENSOR_DRIVER_COUNT
+};
+
+extern const struct sensor_driver_struct *const sensor_drivers[SENSOR_DRIVER_COUNT];
+
+// ADC1 channel, raw counts (sensor_driver_adc.c)
+extern const struct sensor_driver_struct sensor_driver_adc;
+// DHT11 on a GPIO pin, humidity and temperature (sensor_driver_dht.c)
+extern const struct sensor_driver_struct sensor_driver_dht11;
+
+struct sensor_request_struct{
+    enum SensorDriverTypes driver;
+    int pin;
+    struct sensor_reading_struct *reading;
+};
+
+// Acquires every request in one batched pass, stamping each reading with now
+void sensor_drivers_acquire(const struct sensor_request_struct *requests, int count, uint64_t now);
+
+// Counts the energy of acquiring every request without reading the sensors, for synthetic readings
+void sensor_drivers_count(const struct sensor_request_struct *requests, int count);
@@ -0,0 +1,96 @@
+/* Plant Thing ADC1 sensor driver
+
+   start only marks the channel.  The first collect of a pass samples every
+   marked channel SENSOR_BURST_SAMPLES times, interleaved so that all
+   channels see the same supply conditions, and later collects in the pass
+   just take their channel's burst.
+*/
+
+#include <string.h>
+#include "driver/adc.h"
+
+#include "sensor_driver.h"
+#include "plant_energy.h"
+#include "optmed.h"
+
+static uint32_t started_channels = 0;       // Bit per channel, marked but not yet scanned
+static uint32_t scanned_channels = 0;       // Scanned but not yet collected
+static int scan[ADC1_CHANNEL_MAX][SENSOR_BURST_SAMPLES];
+
+static const struct sensor_description_struct adc_description = {
+    .name = "adc1",
+    .value_count = 1,
+    .value_names = {"counts"},
+    .value_units = {"raw"},
+};
+
+static void adc_init(int pin)
+{
+    adc1_config_width(ADC_WIDTH_BIT_12);
+    adc1_config_channel_atten(pin, ADC_ATTEN_MAX);
+}
+
+static void adc_start(int pin)
+{
+    started_channels |= 1u << pin;
+}
+
+static void adc_scan(void)
+{
+    adc1_channel_t channels[ADC1_CHANNEL_MAX];
+    int channel_count = 0;
+
+    for(int c = 0; c < ADC1_CHANNEL_MAX; c++)
+    {
+        if(started_channels & (1u << c)){
+            channels[channel_count++] = c;
+        }
+    }
+    for(int i = 0; i < SENSOR_BURST_SAMPLES; i++)
+    {
+        for(int c = 0; c < channel_count; c++)
+        {
+            scan[channels[c]][i] = adc1_get_raw(channels[c]);
+        }
+    }
+    plant_energy_count(PLANT_ENERGY_ADC_BURST, channel_count);
+
+    scanned_channels |= started_channels;
+    started_channels = 0;
+}
+
+static bool adc_collect(int pin, struct sensor_reading_struct *reading)
+{
+    uint32_t bit = 1u << pin;
+
+    if(started_channels & bit){
+        adc_scan();
+    }
+    if(!(scanned_channels & bit)){
+        reading->ok = false;    // Not started
+        return false;
+    }
+    scanned_channels &= ~bit;
+
+    // Median of a copy so the raw burst stays available for tracing
+    int sorted[SENSOR_BURST_SAMPLES];
+    memcpy(reading->samples, scan[pin], sizeof(reading->samples));
+    memcpy(sorted, scan[pin], sizeof(sorted));
+    reading->sample_count = SENSOR_BURST_SAMPLES;
+    reading->values[0] = opt_med9(sorted);
+    reading->ok = true;
+    return true;
+}
+
+static const struct sensor_description_struct *adc_describe(int pin)
+{
+    return &adc_description;
+}
+
+const struct sensor_driver_struct sensor_driver_adc = {
+    .init = adc_init,
+    .start = adc_start,
+    .collect = adc_collect,
+    .describe = adc_describe,
+    .energy_event = PLANT_ENERGY_ADC_BURST,
+};
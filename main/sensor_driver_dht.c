@@ -0,0 +1,119 @@
+/* Plant Thing DHT11 sensor driver
+
+   A DHT11 transfer takes about 25 ms of bit banging, so reads run on their
+   own task: start queues the pin and collect waits for the result.  The
+   scheduler task meanwhile collects the other sensors in the pass, e.g. the
+   ADC scan.
+*/
+
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "dht.h"
+
+#include "sensor_driver.h"
+#include "plant_energy.h"
+
+#define DHT_QUEUE_LENGTH 8
+#define DHT_COLLECT_TIMEOUT_MS 200      // A read that takes longer has hung, collect reports failure
+
+static const char *TAG = "sensor_dht";
+
+struct dht_result_struct{
+    volatile bool pending;      // Queued or being read, owned by the DHT task until cleared
+    bool ok;
+    float humidity;
+    float temperature;
+};
+
+static QueueHandle_t dht_requests = NULL;
+static SemaphoreHandle_t dht_done = NULL;      // Given after each read
+static struct dht_result_struct dht_results[GPIO_NUM_MAX];
+
+static const struct sensor_description_struct dht11_description = {
+    .name = "dht11",
+    .value_count = 2,
+    .value_names = {"humidity", "temperature"},
+    .value_units = {"%", "C"},
+};
+
+static void dht_task(void *pvParameters)
+{
+    gpio_num_t pin;
+
+    while(1)
+    {
+        if(xQueueReceive(dht_requests, &pin, portMAX_DELAY) == pdTRUE){
+            struct dht_result_struct *result = &dht_results[pin];
+            plant_energy_count(PLANT_ENERGY_DHT_READ, 1);
+            result->ok = (ESP_OK == dht_read_float_data(DHT_TYPE_DHT11, pin, &result->humidity, &result->temperature));
+            __atomic_store_n(&result->pending, false, __ATOMIC_RELEASE);
+            xSemaphoreGive(dht_done);
+        }
+    }
+}
+
+static void dht11_init(int pin)
+{
+    if(dht_requests == NULL){
+        dht_requests = xQueueCreate(DHT_QUEUE_LENGTH, sizeof(gpio_num_t));
+        dht_done = xSemaphoreCreateCounting(DHT_QUEUE_LENGTH, 0);
+        xTaskCreate(dht_task, "sensor_dht", 2048, NULL, 5, NULL);
+    }
+}
+
+static void dht11_start(int pin)
+{
+    struct dht_result_struct *result = &dht_results[pin];
+    gpio_num_t gpio = pin;
+
+    if(result->pending){
+        return; // An earlier read is still running, collect takes its result
+    }
+    result->pending = true;
+    if(xQueueSend(dht_requests, &gpio, 0) != pdTRUE){
+        result->pending = false;
+        result->ok = false;
+    }
+}
+
+static bool dht11_collect(int pin, struct sensor_reading_struct *reading)
+{
+    struct dht_result_struct *result = &dht_results[pin];
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(DHT_COLLECT_TIMEOUT_MS);
+
+    // dht_done is given for every pin's read, so wait until it is this pin's
+    while(__atomic_load_n(&result->pending, __ATOMIC_ACQUIRE))
+    {
+        TickType_t waited = xTaskGetTickCount() - start;
+        if(waited >= timeout || xSemaphoreTake(dht_done, timeout - waited) != pdTRUE){
+            ESP_LOGW(TAG, "Read on GPIO %d timed out", pin);
+            reading->ok = false;
+            return false;
+        }
+    }
+
+    reading->ok = result->ok;
+    reading->sample_count = 0;
+    if(result->ok){
+        reading->values[0] = result->humidity;
+        reading->values[1] = result->temperature;
+    }
+    return reading->ok;
+}
+
+static const struct sensor_description_struct *dht11_describe(int pin)
+{
+    return &dht11_description;
+}
+
+const struct sensor_driver_struct sensor_driver_dht11 = {
+    .init = dht11_init,
+    .start = dht11_start,
+    .collect = dht11_collect,
+    .describe = dht11_describe,
+    .energy_event = PLANT_ENERGY_DHT_READ,
+};
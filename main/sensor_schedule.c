@@ -0,0 +1,18 @@
+/* Plant Thing sensor sampling schedules */
+
+#include "sensor_schedule.h"
+
+void sensor_schedule_start(struct sensor_schedule_struct *schedule, uint64_t period_us, int slot, uint64_t now)
+{
+    schedule->period_us = period_us;
+    schedule->next_us = now + slot * SENSOR_SCHEDULE_SLOT_US;
+}
+
+void sensor_schedule_advance(struct sensor_schedule_struct *schedule, uint64_t now)
+{
+    schedule->next_us += schedule->period_us;
+    if(schedule->next_us <= now){
+        uint64_t missed = (now - schedule->next_us) / schedule->period_us + 1;
+        schedule->next_us += missed * schedule->period_us;
+    }
+}
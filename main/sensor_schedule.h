@@ -0,0 +1,28 @@
+/* Plant Thing sensor sampling schedules
+
+   Each sensor source is sampled on its own fixed period.  Sources are
+   started one SENSOR_SCHEDULE_SLOT_US apart and keep that phase, so with
+   whole-second periods two sources never fall due in the same scheduler
+   pass, and a slow read (the DHT) never delays a fast one.
+*/
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SENSOR_SCHEDULE_SLOT_US 100000ull   // Phase offset between consecutive sources
+
+struct sensor_schedule_struct{
+    uint64_t period_us;
+    uint64_t next_us;       // Next due time
+};
+
+// Starts a schedule due slot slots after now
+void sensor_schedule_start(struct sensor_schedule_struct *schedule, uint64_t period_us, int slot, uint64_t now);
+
+static inline bool sensor_schedule_due(const struct sensor_schedule_struct *schedule, uint64_t now){
+    return now >= schedule->next_us;
+}
+
+// Moves the schedule to its next due time after now, skipping any missed periods but keeping the phase
+void sensor_schedule_advance(struct sensor_schedule_struct *schedule, uint64_t now);
@@ -0,0 +1,211 @@
+/* Plant Thing streaming sensor statistics */
+
+#include <string.h>
+#include <stdint.h>
+
+#include "sensor_stats.h"
+
+static void sort_floats(float *values, int count)
+{
+    for(int i = 1; i < count; i++)
+    {
+        float v = values[i];
+        int j = i - 1;
+        while(j >= 0 && values[j] > v){
+            values[j + 1] = values[j];
+            j--;
+        }
+        values[j + 1] = v;
+    }
+}
+
+void p2_quantile_init(struct p2_quantile_struct *est, float p)
+{
+    memset(est, 0, sizeof(*est));
+    est->p = p;
+}
+
+static float p2_parabolic(const struct p2_quantile_struct *est, int i, int d)
+{
+    const float *q = est->q;
+    const int *n = est->n;
+    return q[i] + (float) d / (n[i+1] - n[i-1]) *
+        ((n[i] - n[i-1] + d) * (q[i+1] - q[i]) / (n[i+1] - n[i]) +
+         (n[i+1] - n[i] - d) * (q[i] - q[i-1]) / (n[i] - n[i-1]));
+}
+
+static float p2_linear(const struct p2_quantile_struct *est, int i, int d)
+{
+    return est->q[i] + d * (est->q[i+d] - est->q[i]) / (est->n[i+d] - est->n[i]);
+}
+
+void p2_quantile_add(struct p2_quantile_struct *est, float x)
+{
+    // The first five samples seed the markers
+    if(est->count < 5){
+        est->q[est->count++] = x;
+        if(est->count == 5){
+            sort_floats(est->q, 5);
+            for(int i = 0; i < 5; i++)
+            {
+                est->n[i] = i;
+            }
+            est->np[0] = 0;
+            est->np[1] = 2 * est->p;
+            est->np[2] = 4 * est->p;
+            est->np[3] = 2 + 2 * est->p;
+            est->np[4] = 4;
+        }
+        return;
+    }
+
+    // Find the cell k with q[k] <= x < q[k+1], extending the extremes if needed
+    int k;
+    if(x < est->q[0]){
+        est->q[0] = x;
+        k = 0;
+    }else if(x >= est->q[4]){
+        est->q[4] = x;
+        k = 3;
+    }else{
+        k = 0;
+        while(x >= est->q[k+1]){
+            k++;
+        }
+    }
+
+    for(int i = k + 1; i < 5; i++)
+    {
+        est->n[i]++;
+    }
+    est->np[1] += est->p / 2;
+    est->np[2] += est->p;
+    est->np[3] += (1 + est->p) / 2;
+    est->np[4] += 1;
+    est->count++;
+
+    // Move the middle markers towards their desired positions
+    for(int i = 1; i <= 3; i++)
+    {
+        float d = est->np[i] - est->n[i];
+        if((d >= 1 && est->n[i+1] - est->n[i] > 1) || (d <= -1 && est->n[i-1] - est->n[i] < -1)){
+            int ds = d >= 0 ? 1 : -1;
+            float q = p2_parabolic(est, i, ds);
+            if(est->q[i-1] < q && q < est->q[i+1]){
+                est->q[i] = q;
+            }else{
+                est->q[i] = p2_linear(est, i, ds);
+            }
+            est->n[i] += ds;
+        }
+    }
+}
+
+float p2_quantile_value(const struct p2_quantile_struct *est)
+{
+    if(est->count == 0){
+        return 0;
+    }
+    if(est->count < 5){
+        float sorted[5];
+        memcpy(sorted, est->q, sizeof(sorted));
+        sort_floats(sorted, est->count);
+        return sorted[(int) (est->p * (est->count - 1) + 0.5f)];
+    }
+    return est->q[2];
+}
+
+void sensor_stats_init(struct sensor_stats_struct *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    sensor_stats_reset(stats);
+}
+
+void sensor_stats_reset(struct sensor_stats_struct *stats)
+{
+    stats->count = 0;
+    stats->mean = 0;
+    stats->m2 = 0;
+    stats->min = UINT16_MAX;
+    stats->max = 0;
+    p2_quantile_init(&stats->median, 0.5f);
+    p2_quantile_init(&stats->abs_deviation, 0.5f);
+}
+
+void sensor_stats_add(struct sensor_stats_struct *stats, uint16_t sample)
+{
+    // Welford's running mean and variance
+    stats->count++;
+    float delta = sample - stats->mean;
+    stats->mean += delta / stats->count;
+    stats->m2 += delta * (sample - stats->mean);
+
+    if(sample < stats->min){
+        stats->min = sample;
+    }
+    if(sample > stats->max){
+        stats->max = sample;
+    }
+
+    // MAD is estimated against the running median rather than the final one
+    p2_quantile_add(&stats->median, sample);
+    float deviation = sample - p2_quantile_value(&stats->median);
+    p2_quantile_add(&stats->abs_deviation, deviation < 0 ? -deviation : deviation);
+
+    if(sample == stats->last_sample){
+        if(stats->repeat_count < UINT16_MAX){
+            stats->repeat_count++;
+        }
+    }else{
+        stats->last_sample = sample;
+        stats->repeat_count = 1;
+    }
+}
+
+uint8_t sensor_stats_add_burst(struct sensor_stats_struct *stats, const int *burst, int count)
+{
+    uint8_t faults = 0;
+    int at_rail = 0;
+    float sorted[count];
+
+    for(int i = 0; i < count; i++)
+    {
+        sensor_stats_add(stats, burst[i]);
+        if(burst[i] <= 0 || burst[i] >= SENSOR_ADC_MAX){
+            at_rail++;
+        }
+        sorted[i] = burst[i];
+    }
+
+    if(stats->repeat_count >= SENSOR_STUCK_SAMPLES){
+        faults |= SENSOR_FAULT_STUCK;
+    }
+    if(2 * at_rail >= count){
+        faults |= SENSOR_FAULT_RAIL;
+    }
+
+    // Spread without the single highest and lowest sample, so one spike is not "noise"
+    if(count >= 4){
+        sort_floats(sorted, count);
+        if(sorted[count - 2] - sorted[1] > SENSOR_NOISE_RANGE_LIMIT){
+            faults |= SENSOR_FAULT_NOISY;
+        }
+    }
+
+    return faults;
+}
+
+float sensor_stats_variance(const struct sensor_stats_struct *stats)
+{
+    return stats->count > 1 ? stats->m2 / (stats->count - 1) : 0;
+}
+
+float sensor_stats_median(const struct sensor_stats_struct *stats)
+{
+    return p2_quantile_value(&stats->median);
+}
+
+float sensor_stats_mad(const struct sensor_stats_struct *stats)
+{
+    return p2_quantile_value(&stats->abs_deviation);
+}
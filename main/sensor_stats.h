@@ -0,0 +1,60 @@
+/* Plant Thing streaming sensor statistics
+
+   Constant memory statistics over the raw ADC samples of one channel:
+   mean and variance (Welford), min/max, median (P-square estimator) and a
+   median absolute deviation estimate, plus per-burst fault checks for
+   stuck, rail-saturated and noisy sensors.
+*/
+#pragma once
+
+#include <stdint.h>
+
+#define SENSOR_ADC_MAX 4095
+#define SENSOR_STUCK_SAMPLES 27          // Identical consecutive samples before a channel is "stuck" (3 polls)
+#define SENSOR_NOISE_RANGE_LIMIT 400     // Max burst spread (2nd lowest to 2nd highest) before a channel is "noisy"
+
+// Fault flags returned by sensor_stats_add_burst()
+#define SENSOR_FAULT_STUCK 0x01
+#define SENSOR_FAULT_RAIL  0x02
+#define SENSOR_FAULT_NOISY 0x04
+
+// P-square streaming quantile estimator (Jain & Chlamtac, 1985)
+struct p2_quantile_struct{
+    float p;
+    float q[5];     // Marker heights
+    float np[5];    // Desired marker positions
+    int n[5];       // Actual marker positions
+    uint32_t count;
+};
+
+struct sensor_stats_struct{
+    // Window statistics, cleared by sensor_stats_reset()
+    uint32_t count;
+    float mean;
+    float m2;
+    uint16_t min;
+    uint16_t max;
+    struct p2_quantile_struct median;
+    struct p2_quantile_struct abs_deviation;
+    // Fault tracking, kept across windows
+    uint16_t last_sample;
+    uint16_t repeat_count;
+};
+
+void p2_quantile_init(struct p2_quantile_struct *est, float p);
+void p2_quantile_add(struct p2_quantile_struct *est, float x);
+float p2_quantile_value(const struct p2_quantile_struct *est);
+
+void sensor_stats_init(struct sensor_stats_struct *stats);
+
+// Starts a new window, fault tracking is kept
+void sensor_stats_reset(struct sensor_stats_struct *stats);
+
+void sensor_stats_add(struct sensor_stats_struct *stats, uint16_t sample);
+
+// Adds a burst of samples and returns the SENSOR_FAULT_* flags for it
+uint8_t sensor_stats_add_burst(struct sensor_stats_struct *stats, const int *burst, int count);
+
+float sensor_stats_variance(const struct sensor_stats_struct *stats);
+float sensor_stats_median(const struct sensor_stats_struct *stats);
+float sensor_stats_mad(const struct sensor_stats_struct *stats);
@@ -0,0 +1,377 @@
+#!/usr/bin/env python3
+"""Load a broker with simulated Plant Thing devices.
+
+Usage:  tools/plant_loadgen.py <broker host> [--nodes N] [--duration S] [options]
+
+e.g.    tools/plant_loadgen.py localhost --nodes 2000 --plants 2 --interval 10 --ramp 20
+
+Each simulated device is one MQTT session on one asyncio event loop, behaving
+as the firmware does: client id plant_thing_<id> with a persistent session,
+a QoS 1 subscription to pt/<id>/cmd, a connect metric on pt/<id>/metrics, a
+QoS 1 boot metric, then retained QoS 1 telemetry per plant on pt/<id>/tele/<n>
+every --interval seconds (the worst case, a reading outside the deadband on
+every poll).  Payloads are the firmware's compact JSON.
+
+Each plant's moisture and state come from the state machine mirror of
+tools/plant_sweep.py on the CONFIG_PLANT_SYNTHETIC_SENSORS soil model, with the
+firmware's default watering config and learned dosing; the level is the
+model's.  --speed runs the pots faster than real time, so a short run sees
+them go through their watering cycles.
+
+A device whose session drops, or whose socket write fails, reconnects after
+esp-mqtt's 10 s reconnect timeout, keeping its persistent session.  --churn
+drops sessions on purpose, as devices losing WiFi or rebooting: each device
+closes its socket without a DISCONNECT at random, on average that many times
+an hour, and reconnects straight away.
+
+Every --report seconds, and at the end, prints:
+    msgs/s          publishes acknowledged (QoS 1) or written (QoS 0)
+    p50/p99/p999    publish to PUBACK latency, ms
+    inflight        QoS 1 publishes awaiting PUBACK, and the largest socket
+                    send backlog, which grows when the broker stops reading
+    dropped         telemetry not sent because the device's inflight window
+                    (--max-inflight) was full or its session was down, as the
+                    firmware skips publishes while disconnected
+    reconnects      sessions established after a device's first
+
+The MQTT 3.1.1 client is built in, so thousands of sessions need no more
+than the standard library; raise the open file limit (ulimit -n) to match
+--nodes.
+"""
+
+import argparse
+import asyncio
+import json
+import os
+import random
+import ssl
+import struct
+import sys
+import time
+
+import plant_sweep
+
+CONNECT, CONNACK, PUBLISH, PUBACK = 1, 2, 3, 4
+SUBSCRIBE, SUBACK, PINGREQ, PINGRESP, DISCONNECT = 8, 9, 12, 13, 14
+KEEPALIVE_S = 120           # esp-mqtt default
+RECONNECT_S = 10            # esp-mqtt default reconnect_timeout_ms
+SESSION_ERRORS = (OSError, ConnectionError, asyncio.IncompleteReadError, asyncio.TimeoutError)
+
+
+def encode_length(n):
+    out = bytearray()
+    while True:
+        byte = n & 0x7f
+        n >>= 7
+        out.append(byte | (0x80 if n else 0))
+        if not n:
+            return bytes(out)
+
+
+def encode_string(text):
+    data = text.encode()
+    return struct.pack('>H', len(data)) + data
+
+
+def packet(kind, flags, body):
+    return bytes([kind << 4 | flags]) + encode_length(len(body)) + body
+
+
+def device_id(index):
+    return '%012x' % (0x020000000000 + index)   # Locally administered MACs, as the firmware's 6 byte id
+
+
+def telemetry(rng, model, pot):
+    """pt/<id>/tele/<n> payload, as publishPlant builds it."""
+    return json.dumps({
+        'test': 100 * (pot.reading - model['dry']) / (model['wet'] - model['dry']),
+        'temperature': round(rng.uniform(18, 26), 1),
+        'humidity': round(rng.uniform(30, 60), 1),
+        'water_available': int(model['level']),
+        'state': pot.plant.state,
+        'moisture_faults': 0,
+        'level_faults': 0,
+        'sum_heap_free': rng.randint(150000, 170000),
+    }, separators=(',', ':')).encode()
+
+
+class Stats:
+    def __init__(self):
+        self.sent = 0
+        self.acked = 0
+        self.dropped = 0
+        self.latencies = []
+        self.connected = 0
+        self.connect_failures = 0
+        self.reconnects = 0
+        self.lost = 0           # Sessions that ended in an error or a broker disconnect
+        self.churned = 0
+        self.inflight = 0
+        self.max_backlog = 0
+
+    def take(self):
+        """Returns and resets the per-interval counters."""
+        taken = (self.acked, self.dropped, self.latencies, self.reconnects)
+        self.acked, self.dropped, self.latencies, self.reconnects = 0, 0, [], 0
+        return taken
+
+
+class Device:
+    def __init__(self, index, args, stats, model):
+        self.id = device_id(index)
+        self.args = args
+        self.stats = stats
+        self.model = model
+        self.rng = random.Random('%d:%d' % (args.seed, index))
+        counts = dict(model['defaults'])
+        for field in plant_sweep.RATIO_FIELDS:
+            counts[field] = plant_sweep.counts_from_ratio(model, counts[field])
+        self.pots = [plant_sweep.SimulatedPot(model, counts, pot, True)
+                     for pot in plant_sweep.make_pots('%d:%d' % (args.seed, index), args.plants)]
+        self.inflight = {}      # Packet id -> send time
+        self.next_packet_id = 1
+        self.writer = None
+        self.reading = None     # Packet reader task while a session is up
+        self.connack = None
+        self.connects = 0
+
+    def packet_id(self):
+        while self.next_packet_id in self.inflight:
+            self.next_packet_id = self.next_packet_id % 65535 + 1
+        packet_id = self.next_packet_id
+        self.next_packet_id = self.next_packet_id % 65535 + 1
+        return packet_id
+
+    def send(self, data):
+        self.writer.write(data)
+        backlog = self.writer.transport.get_write_buffer_size()
+        if backlog > self.stats.max_backlog:
+            self.stats.max_backlog = backlog
+
+    def publish(self, topic, payload, qos, retain=False):
+        body = encode_string(topic)
+        if qos:
+            if len(self.inflight) >= self.args.max_inflight:
+                self.stats.dropped += 1
+                return
+            packet_id = self.packet_id()
+            self.inflight[packet_id] = time.perf_counter()
+            self.stats.inflight += 1
+            body += struct.pack('>H', packet_id)
+        self.send(packet(PUBLISH, qos << 1 | retain, body + payload))
+        self.stats.sent += 1
+        if not qos:
+            self.stats.acked += 1
+
+    async def read_packets(self, reader):
+        """Handles the broker's packets until the connection ends."""
+        try:
+            while True:
+                header = await reader.readexactly(1)
+                length, shift = 0, 0
+                while True:
+                    byte = (await reader.readexactly(1))[0]
+                    length |= (byte & 0x7f) << shift
+                    shift += 7
+                    if not byte & 0x80:
+                        break
+                body = await reader.readexactly(length)
+                kind = header[0] >> 4
+                if kind == CONNACK:
+                    if not self.connack.done():
+                        self.connack.set_result(body)
+                elif kind == PUBACK:
+                    sent = self.inflight.pop(struct.unpack('>H', body[:2])[0], None)
+                    if sent is not None:
+                        self.stats.inflight -= 1
+                        self.stats.acked += 1
+                        self.stats.latencies.append(time.perf_counter() - sent)
+                elif kind == PUBLISH:
+                    qos = header[0] >> 1 & 3
+                    if qos:
+                        topic_len = struct.unpack('>H', body[:2])[0]
+                        self.send(packet(PUBACK, 0, body[2 + topic_len:4 + topic_len]))
+        except SESSION_ERRORS:
+            pass
+
+    async def connect(self):
+        args = self.args
+        context = ssl.create_default_context() if args.tls else None
+        reader, self.writer = await asyncio.open_connection(args.host, args.port, ssl=context)
+        self.connack = asyncio.get_running_loop().create_future()
+        self.reading = asyncio.ensure_future(self.read_packets(reader))
+
+        flags = 0   # Persistent session, as disable_clean_session
+        payload = encode_string('plant_thing_' + self.id)
+        if args.username:
+            flags |= 0x80
+            payload += encode_string(args.username)
+            if args.password:
+                flags |= 0x40
+                payload += encode_string(args.password)
+        start = time.perf_counter()
+        self.send(packet(CONNECT, 0, encode_string('MQTT') + bytes([4, flags]) + struct.pack('>H', KEEPALIVE_S) + payload))
+        connack = await asyncio.wait_for(self.connack, 30)
+        if connack[1] != 0:
+            raise ConnectionError('CONNACK return code %d' % connack[1])
+        session_present = bool(connack[0] & 1)
+        self.connects += 1
+
+        if not session_present:
+            self.send(packet(SUBSCRIBE, 2, struct.pack('>H', self.packet_id()) + encode_string('pt/%s/cmd' % self.id) + b'\x01'))
+        self.publish('pt/%s/metrics' % self.id, json.dumps({
+            'type': 'connect', 'connect_ms': int((time.perf_counter() - start) * 1000), 'connects': self.connects,
+            'session_present': session_present, 'tls': args.tls}, separators=(',', ':')).encode(), 0)
+
+    def close(self, clean):
+        """Ends the session, with a DISCONNECT if clean.  Publishes awaiting a PUBACK are given up."""
+        if self.reading is None:
+            return
+        if clean and not self.reading.done():
+            self.send(packet(DISCONNECT, 0, b''))
+        self.reading.cancel()
+        self.writer.close()
+        self.reading = self.writer = None
+        self.stats.inflight -= len(self.inflight)
+        self.inflight.clear()
+
+    async def run(self, start_delay, stop_at):
+        await asyncio.sleep(start_delay)
+        args = self.args
+        start = time.monotonic()
+        reconnect_at = start
+        churn_at = None
+        first = True
+        next_ping = 0
+
+        while time.monotonic() < stop_at:
+            now = time.monotonic()
+            if self.reading is not None and (self.reading.done() or (churn_at is not None and now >= churn_at)):
+                if self.reading.done():
+                    self.stats.lost += 1
+                    reconnect_at = now + RECONNECT_S
+                else:
+                    self.stats.churned += 1
+                    reconnect_at = now
+                self.close(False)
+                self.stats.connected -= 1
+            if self.reading is None and now >= reconnect_at:
+                try:
+                    await self.connect()
+                except SESSION_ERRORS:
+                    self.stats.connect_failures += 1
+                    self.close(False)
+                    reconnect_at = time.monotonic() + RECONNECT_S
+                else:
+                    self.stats.connected += 1
+                    if self.connects > 1:
+                        self.stats.reconnects += 1
+                    if args.churn:
+                        churn_at = time.monotonic() + self.rng.expovariate(args.churn / 3600.0)
+                    next_ping = time.monotonic() + KEEPALIVE_S / 2
+
+            # The pots keep watering whether or not the session is up
+            sim_t = (time.monotonic() - start) * args.speed
+            for pot in self.pots:
+                pot.run(sim_t)
+            if self.reading is None:
+                self.stats.dropped += args.plants   # The device skips its publishes while disconnected
+            else:
+                try:
+                    for plant, pot in enumerate(self.pots):
+                        self.publish('pt/%s/tele/%d' % (self.id, plant), telemetry(self.rng, self.model, pot), 1, True)
+                    if first:
+                        self.publish('pt/%s/metrics' % self.id, b'{"type":"boot","version":"loadgen"}', 1)
+                        first = False
+                    if time.monotonic() > next_ping:
+                        self.send(packet(PINGREQ, 0, b''))
+                        next_ping = time.monotonic() + KEEPALIVE_S / 2
+                    await self.writer.drain()
+                except SESSION_ERRORS:
+                    # Seen as a lost session on the next pass, once the reader has stopped
+                    self.reading.cancel()
+            await asyncio.sleep(args.interval * self.rng.uniform(0.9, 1.1))
+
+        if self.reading is not None:
+            self.stats.connected -= 1
+            try:
+                self.close(True)
+            except SESSION_ERRORS:
+                pass
+
+
+def percentile(sorted_values, q):
+    if not sorted_values:
+        return float('nan')
+    return sorted_values[min(len(sorted_values) - 1, int(q * len(sorted_values)))] * 1000
+
+
+def summary(acked, dropped, latencies, reconnects, seconds, stats):
+    latencies.sort()
+    return ('%8.1f msgs/s  p50 %7.2f  p99 %7.2f  p999 %7.2f ms  inflight %5d  backlog %7d B  dropped %6d  '
+            'connected %6d  reconnects %5d' %
+            (acked / seconds if seconds else 0, percentile(latencies, 0.5), percentile(latencies, 0.99),
+             percentile(latencies, 0.999), stats.inflight, stats.max_backlog, dropped, stats.connected, reconnects))
+
+
+async def main_async(args):
+    stats = Stats()
+    start = time.monotonic()
+    stop_at = start + args.ramp + args.duration
+    model = plant_sweep.load_model(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+    devices = [Device(i, args, stats, model) for i in range(args.nodes)]
+    tasks = [asyncio.ensure_future(d.run(args.ramp * i / args.nodes, stop_at)) for i, d in enumerate(devices)]
+
+    total_acked, total_dropped, all_latencies, total_reconnects = 0, 0, [], 0
+    last = start
+    while not all(t.done() for t in tasks):
+        await asyncio.sleep(args.report)
+        now = time.monotonic()
+        acked, dropped, latencies, reconnects = stats.take()
+        total_acked += acked
+        total_dropped += dropped
+        all_latencies += latencies
+        total_reconnects += reconnects
+        print('%6.0f s %s' % (now - start, summary(acked, dropped, latencies, reconnects, now - last, stats)), flush=True)
+        stats.max_backlog = 0
+        last = now
+
+    acked, dropped, latencies, reconnects = stats.take()
+    total_acked += acked
+    total_dropped += dropped
+    all_latencies += latencies
+    total_reconnects += reconnects
+    print('total    %s' % summary(total_acked, total_dropped, all_latencies, total_reconnects, time.monotonic() - start, stats))
+    print('%d publishes sent, %d connect failures, %d sessions lost, %d churned' %
+          (stats.sent, stats.connect_failures, stats.lost, stats.churned))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('host')
+    parser.add_argument('--port', type=int, default=None, help='default 1883, or 8883 with --tls')
+    parser.add_argument('--tls', action='store_true')
+    parser.add_argument('--username')
+    parser.add_argument('--password')
+    parser.add_argument('--nodes', type=int, default=1000)
+    parser.add_argument('--plants', type=int, default=1, help='plants per device (default 1)')
+    parser.add_argument('--interval', type=float, default=10, help='seconds between telemetry publishes (default 10)')
+    parser.add_argument('--ramp', type=float, default=10, help='seconds over which devices connect (default 10)')
+    parser.add_argument('--duration', type=float, default=60, help='seconds to run after the ramp (default 60)')
+    parser.add_argument('--churn', type=float, default=0, help='session drops per device per hour (default 0)')
+    parser.add_argument('--speed', type=float, default=1, help='simulated seconds per second for the pots (default 1)')
+    parser.add_argument('--max-inflight', type=int, default=16, help='QoS 1 publishes a device may have unacknowledged')
+    parser.add_argument('--report', type=float, default=5, help='seconds between reports (default 5)')
+    parser.add_argument('--seed', type=int, default=1)
+    args = parser.parse_args()
+    if args.port is None:
+        args.port = 8883 if args.tls else 1883
+
+    try:
+        asyncio.run(main_async(args))
+    except KeyboardInterrupt:
+        sys.exit(1)
+
+
+if __name__ == '__main__':
+    main()
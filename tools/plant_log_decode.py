@@ -0,0 +1,73 @@
+#!/usr/bin/env python3
+"""Expand deferred plant log records ("@PL" lines) back into text.
+
+Usage:  idf.py monitor | tools/plant_log_decode.py [main/plant_log_formats.h]
+
+The format table is read from plant_log_formats.h, the same file the firmware
+builds its ids from, so the decoder always matches the source tree.  Lines that
+are not "@PL" records are passed through unchanged.
+"""
+
+import os
+import re
+import struct
+import sys
+
+FORMAT_ENTRY = re.compile(r'^\s*PLOG_FMT\(\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)', re.MULTILINE)
+CONVERSION = re.compile(r'%[-+ #0]*\d*(?:\.\d+)?([diuxXfeEgG%])')
+
+
+def load_formats(path):
+    with open(path) as f:
+        text = f.read()
+    return [bytes(fmt, 'utf-8').decode('unicode_escape') for _, fmt in FORMAT_ENTRY.findall(text)]
+
+
+def convert_args(fmt, words):
+    args = []
+    for conversion in CONVERSION.finditer(fmt):
+        kind = conversion.group(1)
+        if kind == '%':
+            continue
+        word = words[len(args)] if len(args) < len(words) else 0
+        if kind in 'di':
+            args.append(struct.unpack('<i', struct.pack('<I', word))[0])
+        elif kind in 'uxX':
+            args.append(word)
+        else:
+            args.append(struct.unpack('<f', struct.pack('<I', word))[0])
+    return tuple(args)
+
+
+def decode_line(line, formats):
+    fields = line.split()
+    if len(fields) >= 4 and fields[2] == 'dropped':
+        return 'W plant: core %s dropped %s log records' % (fields[1], fields[3])
+
+    core = fields[1]
+    timestamp = int(fields[2], 16)
+    fmt_id = int(fields[3], 16)
+    words = [int(w, 16) for w in fields[4:]]
+    if fmt_id >= len(formats):
+        return 'I (%d) plant: <unknown format %d> %s' % (timestamp, fmt_id, ' '.join(fields[4:]))
+    return 'I (%d) plant[%s]: %s' % (timestamp, core, formats[fmt_id] % convert_args(formats[fmt_id], words))
+
+
+def main():
+    default_table = os.path.join(os.path.dirname(__file__), '..', 'main', 'plant_log_formats.h')
+    formats = load_formats(sys.argv[1] if len(sys.argv) > 1 else default_table)
+
+    for line in sys.stdin:
+        stripped = line.strip()
+        if stripped.startswith('@PL '):
+            try:
+                print(decode_line(stripped, formats))
+            except (ValueError, IndexError):
+                sys.stdout.write(line)
+        else:
+            sys.stdout.write(line)
+        sys.stdout.flush()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,191 @@
+#!/usr/bin/env python3
+"""Make, apply and serve Plant Thing delta OTA patches (main/ota_delta.h).
+
+Usage:  tools/plant_ota_delta.py diff old.bin new.bin patch.bin
+        tools/plant_ota_delta.py apply old.bin patch.bin out.bin
+        tools/plant_ota_delta.py serve patch.bin <broker host> <device id>
+
+diff reports the patch ratio and the new image's SHA-256, which the start
+command carries so the device can check its result before booting it.
+apply streams the patch through the same state machine as the firmware, in
+small chunks against a file standing in for the inactive partition, and
+reports throughput.  serve answers the device's chunk requests on
+pt/<id>/ota/req (needs paho-mqtt); start the update with
+    mosquitto_pub -t pt/<id>/cmd -m '{"ota":{"size":<patch size>,"sha256":"<new image sha256>"}}'
+"""
+
+import hashlib
+import json
+import struct
+import sys
+import time
+import zlib
+
+MAGIC = 0x31445450  # "PTD1"
+HEADER = struct.Struct('<5I')
+OP_END, OP_COPY, OP_INSERT = 0, 1, 2
+BLOCK = 32      # Match granularity
+STRIDE = 4      # Old image positions indexed
+MIN_COPY = 12   # Shorter matches cost more than inserting the bytes
+SECTOR = 4096
+
+
+def diff(old, new):
+    index = {}
+    for i in range(0, len(old) - BLOCK + 1, STRIDE):
+        index.setdefault(old[i:i + BLOCK], i)
+
+    ops = []
+    literal = bytearray()
+    last_copy_end = None
+    pos = 0
+
+    def flush_literal():
+        if literal:
+            ops.append(struct.pack('<BI', OP_INSERT, len(literal)) + bytes(literal))
+            literal.clear()
+
+    while pos < len(new):
+        start = None
+        # Code that moved keeps its layout, so try continuing the previous copy first
+        if last_copy_end is not None and old[last_copy_end:last_copy_end + MIN_COPY] == new[pos:pos + MIN_COPY]:
+            start = last_copy_end
+        else:
+            start = index.get(new[pos:pos + BLOCK])
+        if start is None:
+            literal.append(new[pos])
+            pos += 1
+            last_copy_end = None if last_copy_end is None else last_copy_end + 1
+            continue
+        length = 0
+        while pos + length < len(new) and start + length < len(old) and old[start + length] == new[pos + length]:
+            length += 1
+        flush_literal()
+        ops.append(struct.pack('<BII', OP_COPY, start, length))
+        pos += length
+        last_copy_end = start + length
+
+    flush_literal()
+    ops.append(bytes([OP_END]))
+    header = HEADER.pack(MAGIC, len(old), zlib.crc32(old), len(new), zlib.crc32(new))
+    return header + b''.join(ops)
+
+
+class Applier:
+    """Byte-at-a-time parser mirroring ota_delta_feed, writing sector by sector."""
+
+    def __init__(self, old, out):
+        self.old, self.out = old, out
+        self.buf = bytearray()
+        self.header = None
+        self.written = 0
+        self.done = False
+
+    def feed(self, chunk):
+        self.buf += chunk
+        while not self.done:
+            if self.header is None:
+                if len(self.buf) < HEADER.size:
+                    return
+                self.header = HEADER.unpack_from(self.buf)
+                del self.buf[:HEADER.size]
+                magic, old_size, old_crc, _, _ = self.header
+                if magic != MAGIC:
+                    raise ValueError('bad magic')
+                if old_size != len(self.old) or old_crc != zlib.crc32(self.old):
+                    raise ValueError('patch is for a different old image')
+                continue
+            if not self.buf:
+                return
+            op = self.buf[0]
+            if op == OP_END:
+                del self.buf[:1]
+                self.done = True
+            elif op == OP_COPY:
+                if len(self.buf) < 9:
+                    return
+                start, length = struct.unpack_from('<II', self.buf, 1)
+                del self.buf[:9]
+                self.write(self.old[start:start + length])
+            elif op == OP_INSERT:
+                if len(self.buf) < 5:
+                    return
+                length, = struct.unpack_from('<I', self.buf, 1)
+                if len(self.buf) < 5 + length:
+                    return
+                self.write(self.buf[5:5 + length])
+                del self.buf[:5 + length]
+            else:
+                raise ValueError('bad op %d' % op)
+
+    def write(self, data):
+        pos = 0
+        while pos < len(data):
+            n = min(len(data) - pos, SECTOR - self.written % SECTOR)
+            self.out.seek(self.written)
+            self.out.write(data[pos:pos + n])
+            self.written += n
+            pos += n
+
+
+def cmd_diff(old_path, new_path, patch_path):
+    old = open(old_path, 'rb').read()
+    new = open(new_path, 'rb').read()
+    started = time.monotonic()
+    patch = diff(old, new)
+    open(patch_path, 'wb').write(patch)
+    print('%s: %d bytes for a %d byte image, ratio %.3f (%.1fs)'
+          % (patch_path, len(patch), len(new), len(patch) / max(len(new), 1), time.monotonic() - started))
+    print('start with {"ota":{"size":%d,"sha256":"%s"}}' % (len(patch), hashlib.sha256(new).hexdigest()))
+
+
+def cmd_apply(old_path, patch_path, out_path, chunk=512):
+    old = open(old_path, 'rb').read()
+    patch = open(patch_path, 'rb').read()
+    started = time.monotonic()
+    with open(out_path, 'w+b') as out:
+        applier = Applier(old, out)
+        for i in range(0, len(patch), chunk):
+            applier.feed(patch[i:i + chunk])
+        out.seek(0)
+        result = out.read()
+    elapsed = time.monotonic() - started
+    _, _, _, new_size, new_crc = applier.header
+    if not applier.done or len(result) != new_size or zlib.crc32(result) != new_crc:
+        sys.exit('%s: output does not match the new image' % out_path)
+    print('%s: %d bytes from a %d byte patch, %.1f kB/s'
+          % (out_path, len(result), len(patch), len(result) / 1024 / max(elapsed, 1e-6)))
+
+
+def cmd_serve(patch_path, host, device_id):
+    import paho.mqtt.client as mqtt
+
+    patch = open(patch_path, 'rb').read()
+    prefix = 'pt/%s/ota/' % device_id
+
+    def on_connect(client, userdata, flags, rc):
+        client.subscribe(prefix + 'req', qos=1)
+        print('serving %d bytes to %s' % (len(patch), device_id))
+
+    def on_message(client, userdata, msg):
+        req = json.loads(msg.payload)
+        offset, length = req['offset'], req['len']
+        client.publish(prefix + 'data', struct.pack('<I', offset) + patch[offset:offset + length], qos=1)
+        print('%d/%d' % (min(offset + length, len(patch)), len(patch)), end='\r')
+
+    client = mqtt.Client()
+    client.on_connect = on_connect
+    client.on_message = on_message
+    client.connect(host)
+    client.loop_forever()
+
+
+def main():
+    commands = {'diff': cmd_diff, 'apply': cmd_apply, 'serve': cmd_serve}
+    if len(sys.argv) != 5 or sys.argv[1] not in commands:
+        sys.exit(__doc__)
+    commands[sys.argv[1]](*sys.argv[2:])
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,408 @@
+#!/usr/bin/env python3
+"""Sweep plant watering configs over simulated soil and report the Pareto front.
+
+Usage:  tools/plant_sweep.py [--<config field> start:stop[:step] ...] [options]
+
+e.g.    tools/plant_sweep.py --low_moisture .70:.85:.05 --high_moisture .90:.96:.02 \\
+            --pump_on_period_s 1:4 --pump_off_period_s 30:90:30 --days 14
+
+Every plant_watering_config_struct field takes a value or an inclusive range;
+moisture fields are ratios, as in the config command, periods are seconds.
+Fields not given keep the firmware defaults.  Each config in the grid is run
+against the same --scenarios simulated pots, which differ in drying rate, pump
+response and start moisture, and is scored on the mean per pot of:
+    water_ml    pumped water
+    out_h       hours the true moisture spent outside --band
+    pulses      pump cycles
+    mah         sensor polls, state change publishes, the pump and its safety
+                level reads
+Configs no other config beats on all four are printed.
+
+The simulation runs the firmware's state machine and scheduler deadlines
+against the synthetic soil model of CONFIG_PLANT_SYNTHETIC_SENSORS, with a
+diurnal drying cycle and sensor noise added.  Model constants and defaults
+are read from the source tree (main/app_main.c, main/plant_synthetic.h,
+main/plant_dosing.h, main/plant_energy.h, main/Kconfig.projbuild), so the
+sweep tracks the firmware.
+
+Runs are spread over --workers processes (default: all cores) which each
+take the next config as they finish one, so slow configs don't hold up a
+core.  Every pot's randomness comes from --seed and the pot's index only,
+so results don't depend on the worker count or scheduling.
+"""
+
+import argparse
+import itertools
+import json
+import math
+import multiprocessing
+import os
+import random
+import re
+import sys
+import time
+
+CONFIG_FIELDS = ['low_moisture', 'watered_moisture', 'high_moisture', 'polling_period_s',
+                 'pump_on_period_s', 'pump_off_period_s', 'wet_hold_period_s', 'dry_hold_period_s']
+RATIO_FIELDS = CONFIG_FIELDS[:3]
+OBJECTIVES = ['water_ml', 'out_h', 'pulses', 'mah']
+
+DRYING, PUMP_DELAY, PUMP_ON, WET_HOLD, DRY_HOLD = range(5)
+DEADLINE_EPSILON_S = 1e-6   # The firmware fires transitions once a period is exceeded
+DIURNAL_SWING = 0.5         # Drying rate varies +-50% over the day
+SENSOR_NOISE = 5.0          # Counts, standard deviation of a burst median
+DAY_S = 86400.0
+MA_MS_PER_MAH = 3600000.0
+
+DEFINE = re.compile(r'^\s*#define\s+(\w+)\s+\(?([-\d.]+)(?:f|ull)?\)?', re.MULTILINE)
+KCONFIG_DEFAULT = re.compile(r'config\s+(\w+)\s*\n(?:\s+(?!config)[^\n]*\n)*?\s+default\s+(\S+)')
+CONFIG_DEFAULT = re.compile(r'\.(\w+)\s*=\s*(?:MOISTURE_SENSOR_VALUE_FROM_RATIO\()?([\d.*]+)')
+
+
+def read(root, name):
+    with open(os.path.join(root, 'main', name)) as f:
+        return f.read()
+
+
+def load_model(root):
+    app = read(root, 'app_main.c')
+    sources = app + read(root, 'plant_synthetic.h') + read(root, 'plant_dosing.h')
+    defines = {name: float(value) for name, value in DEFINE.findall(sources)}
+    kconfig = {name: float(value) for name, value in KCONFIG_DEFAULT.findall(read(root, 'Kconfig.projbuild'))
+               if re.match(r'^[\d.]+$', value)}
+    costs = re.search(r'PLANT_ENERGY_COSTS_MA_MS\s*\{(.*?)\}', read(root, 'plant_energy.h'), re.DOTALL).group(1)
+    costs = [float(c) for c in re.findall(r'([\d.]+)f', costs)]
+
+    block = app[app.index('.config = {'):]
+    block = block[:block.index('}')]
+    defaults = {}
+    for name, value in CONFIG_DEFAULT.findall(block):
+        defaults[name] = float(eval(value)) if name in RATIO_FIELDS else int(eval(value))
+
+    return {
+        'dry': defines['MOISTURE_SENSOR_DRY'],
+        'wet': defines['MOISTURE_SENSOR_WET'],
+        'dry_rate': defines['PLANT_SYNTHETIC_DRY_COUNTS_PER_S'],
+        'pump_rate': defines['PLANT_SYNTHETIC_PUMP_COUNTS_PER_S'],
+        'soak_time_s': defines['PLANT_SYNTHETIC_SOAK_TIME_S'],
+        'level': defines['PLANT_SYNTHETIC_LEVEL'],
+        'state_change_s': defines['PLANT_SCHEDULER_MIN_SLEEP_US'] / 1e6,
+        'dose_aim': defines['PLANT_DOSING_AIM'],
+        'dose_learn_rate': defines['PLANT_DOSING_LEARN_RATE'],
+        'dose_min_gain': defines['PLANT_DOSING_MIN_GAIN'],
+        'dose_max_gain': defines['PLANT_DOSING_MAX_GAIN'],
+        'dose_min_measure_s': defines['PLANT_DOSING_MIN_MEASURE_S'],
+        'dose_max_pulse_s': kconfig['PLANT_DOSING_MAX_PULSE_S'],
+        'pump_ma': kconfig['PLANT_PUMP_CURRENT_MA'],
+        'pump_ml_per_min': kconfig['PLANT_PUMP_FLOW_ML_PER_MIN'],
+        'adc_burst_ma_ms': costs[0],
+        'publish_ma_ms': costs[2],
+        'safety_read_ma_ms': costs[6],
+        'safety_period_s': defines['PUMP_SAFETY_SAMPLE_PERIOD_US'] / 1e6,
+        'defaults': defaults,
+    }
+
+
+def counts_from_ratio(model, ratio):
+    return ratio * (model['wet'] - model['dry']) + model['dry']
+
+
+def time_outside(a, b, limit, below, dt):
+    """Time spent beyond limit by a reading moving linearly from a to b over dt."""
+    if below:
+        a, b, limit = -a, -b, -limit
+    if a <= limit and b <= limit:
+        return 0.0
+    if a > limit and b > limit:
+        return dt
+    return dt * (max(a, b) - limit) / abs(b - a)
+
+
+class PlantMirror:
+    """One plant's handleStateMachine and plantNextDeadline, with learned dosing as startDose and
+    measureDose.  config holds the watering config in sensor counts and seconds."""
+
+    def __init__(self, model, config, learned, state=DRYING, t=0.0):
+        self.model = model
+        self.config = config
+        self.learned = learned
+        self.state, self.entry = state, t
+        self.pulse_s = config['pump_on_period_s']
+        self.gain, self.cycles = 0.0, 0
+        self.dose_pending, self.dose_start_moisture, self.dose_start_pump_s = False, 0.0, 0.0
+        self.pump_total_s = 0.0
+        self.pulses = self.changes = 0
+
+    def pump_s(self, t):
+        """Pump run time up to t."""
+        return self.pump_total_s + (t - self.entry if self.state == PUMP_ON else 0.0)
+
+    def change(self, t, new_state):
+        if self.state == PUMP_ON:
+            self.pump_total_s += t - self.entry
+        self.state, self.entry = new_state, t
+        self.changes += 1
+
+    def measure_dose(self, t, reading):
+        model = self.model
+        if not self.dose_pending:
+            return
+        self.dose_pending = False
+        pumped_s = self.pump_total_s - self.dose_start_pump_s
+        if t - self.entry < self.config['pump_off_period_s'] or pumped_s < model['dose_min_measure_s']:
+            return
+        measured = (reading - self.dose_start_moisture) / pumped_s
+        if model['dose_min_gain'] <= measured <= model['dose_max_gain']:
+            self.gain = measured if self.cycles == 0 else self.gain + model['dose_learn_rate'] * (measured - self.gain)
+            self.cycles += 1
+
+    def start_dose(self, reading):
+        model, config = self.model, self.config
+        pump_on_s, high = config['pump_on_period_s'], config['high_moisture']
+        self.pulse_s = pump_on_s
+        if self.learned and self.cycles and reading < high:
+            max_s = max(model['dose_max_pulse_s'], pump_on_s)
+            self.pulse_s = min(max(model['dose_aim'] * (high - reading) / self.gain, pump_on_s), max_s)
+        self.dose_pending, self.dose_start_moisture, self.dose_start_pump_s = True, reading, self.pump_total_s
+        self.pulses += 1
+
+    def step(self, t, reading):
+        """One scheduler pass at t with the latest poll's moisture reading.  Returns True on a state change."""
+        config = self.config
+        state, elapsed = self.state, t - self.entry
+        if state == DRYING:
+            if reading < config['low_moisture']:
+                self.change(t, DRY_HOLD)
+        elif state == DRY_HOLD:
+            if reading > config['low_moisture']:
+                self.change(t, DRYING)
+            elif elapsed > config['dry_hold_period_s']:
+                self.change(t, PUMP_DELAY)
+        elif state == PUMP_DELAY:
+            if reading >= config['high_moisture']:
+                self.measure_dose(t, reading)
+                self.change(t, WET_HOLD)
+            elif elapsed > config['pump_off_period_s']:
+                self.measure_dose(t, reading)
+                self.start_dose(reading)
+                self.change(t, PUMP_ON)
+        elif state == PUMP_ON:
+            if elapsed > self.pulse_s:
+                self.change(t, PUMP_DELAY)
+        elif state == WET_HOLD:
+            if reading <= config['watered_moisture']:
+                self.change(t, PUMP_DELAY)
+            elif elapsed > config['wet_hold_period_s']:
+                self.change(t, DRYING)
+        return self.state != state
+
+    def state_deadline(self):
+        """Time at which the current state's period is exceeded, None if it has none."""
+        config = self.config
+        period = {DRY_HOLD: config['dry_hold_period_s'], PUMP_DELAY: config['pump_off_period_s'],
+                  PUMP_ON: self.pulse_s, WET_HOLD: config['wet_hold_period_s']}.get(self.state)
+        return None if period is None else self.entry + period + DEADLINE_EPSILON_S
+
+
+class SimulatedPot:
+    """One plant's state machine on the synthetic soil, mirroring runPlantScheduler and
+    stepSyntheticSensors, with a diurnal drying cycle and sensor noise added.  counts is the
+    watering config in sensor counts; with band (counts low, high) set, out_s sums the time the
+    true moisture spent outside it."""
+
+    def __init__(self, model, counts, pot, learned, band=None):
+        self.model = model
+        self.plant = PlantMirror(model, counts, learned)
+        self.rng = random.Random(pot['seed'])
+        self.dry_rate = model['dry_rate'] * pot['dry_scale']
+        self.pump_rate = model['pump_rate'] * pot['pump_scale']
+        self.band = band
+        self.t = 0.0
+        self.moisture = counts_from_ratio(model, pot['start'])
+        self.soak = 0.0
+        self.last_poll, self.reading = -math.inf, 0.0
+        self.out_s = 0.0
+        self.polls = 0
+
+    def run(self, end):
+        """Runs the scheduler passes up to end."""
+        model, plant = self.model, self.plant
+        polling_s = plant.config['polling_period_s']
+        soak_time_s = model['soak_time_s']
+        dry, wet = model['dry'], model['wet']
+        t, moisture, soak = self.t, self.moisture, self.soak
+
+        while t < end:
+            if t - self.last_poll > polling_s:
+                self.reading = min(max(int(moisture + self.rng.gauss(0.0, SENSOR_NOISE)), dry), wet)
+                self.last_poll = t
+                self.polls += 1
+
+            # Next wake, as plantNextDeadline
+            if plant.step(t, self.reading):
+                wake = t + model['state_change_s']
+            else:
+                wake = self.last_poll + polling_s + DEADLINE_EPSILON_S
+                deadline = plant.state_deadline()
+                if deadline is not None:
+                    wake = min(wake, deadline)
+            wake = min(wake, end)
+            dt = wake - t
+
+            # Soil up to the wake, as plant_synthetic_step
+            if plant.state == PUMP_ON:
+                soak += dt * self.pump_rate
+            absorbed = soak * (1.0 - math.exp(-dt / soak_time_s))
+            soak -= absorbed
+            rate = self.dry_rate * (1.0 + DIURNAL_SWING * math.sin(2.0 * math.pi * (t + dt / 2) / DAY_S))
+            moved = min(max(moisture + absorbed - dt * rate, dry), wet)
+            if self.band:
+                self.out_s += (time_outside(moisture, moved, self.band[0], True, dt) +
+                               time_outside(moisture, moved, self.band[1], False, dt))
+            moisture = moved
+            t = wake
+
+        self.t, self.moisture, self.soak = t, moisture, soak
+
+
+def simulate(model, config, pot, days, band, learned):
+    """Runs one config on one pot and scores it."""
+    counts = dict(config)
+    for field in RATIO_FIELDS:
+        counts[field] = counts_from_ratio(model, config[field])
+    end = days * DAY_S
+    sim = SimulatedPot(model, counts, pot, learned, [counts_from_ratio(model, r) for r in band])
+    sim.run(end)
+
+    plant = sim.plant
+    pump_s = plant.pump_s(end)
+    return {
+        'water_ml': model['pump_ml_per_min'] * pump_s / 60.0,
+        'out_h': sim.out_s / 3600.0,
+        'pulses': plant.pulses,
+        'mah': (sim.polls * model['adc_burst_ma_ms'] + plant.changes * model['publish_ma_ms']
+                + pump_s / model['safety_period_s'] * model['safety_read_ma_ms']) / MA_MS_PER_MAH
+               + model['pump_ma'] * pump_s / 3600.0,
+    }
+
+
+def make_pots(seed, count):
+    pots = []
+    for i in range(count):
+        rng = random.Random('%s:pot:%d' % (seed, i))
+        pots.append({
+            'seed': '%s:noise:%d' % (seed, i),
+            'dry_scale': math.exp(rng.uniform(math.log(0.5), math.log(2.0))),
+            'pump_scale': rng.uniform(0.5, 1.5),
+            'start': rng.uniform(0.80, 0.95),
+        })
+    return pots
+
+
+def parse_range(text, is_ratio):
+    parts = text.split(':')
+    kind = float if is_ratio else int
+    if len(parts) == 1:
+        return [kind(parts[0])]
+    start, stop = kind(parts[0]), kind(parts[1])
+    step = kind(parts[2]) if len(parts) > 2 else (0.01 if is_ratio else 1)
+    if step <= 0 or stop < start:
+        raise argparse.ArgumentTypeError('bad range %s' % text)
+    count = int(round((stop - start) / step)) + 1
+    return [round(start + i * step, 6) if is_ratio else start + i * step for i in range(count)]
+
+
+def pareto_front(results):
+    """Indices of results no other result is at least as good as on every objective and better on one."""
+    order = sorted(range(len(results)), key=lambda i: [results[i][o] for o in OBJECTIVES])
+    front = []
+    for i in order:
+        scores = [results[i][o] for o in OBJECTIVES]
+        if not any(all(results[j][o] <= s for o, s in zip(OBJECTIVES, scores)) for j in front):
+            front.append(i)
+    return front
+
+
+# Worker state, set once per process rather than sent with every config
+_job = None
+
+
+def init_worker(job):
+    global _job
+    _job = job
+
+
+def run_config(item):
+    index, config = item
+    totals = dict.fromkeys(OBJECTIVES, 0.0)
+    for pot in _job['pots']:
+        scores = simulate(_job['model'], config, pot, _job['days'], _job['band'], _job['learned'])
+        for o in OBJECTIVES:
+            totals[o] += scores[o]
+    return index, {o: totals[o] / len(_job['pots']) for o in OBJECTIVES}
+
+
+def main():
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    model = load_model(root)
+
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    for field in CONFIG_FIELDS:
+        parser.add_argument('--' + field, metavar='RANGE', type=lambda t, r=field in RATIO_FIELDS: parse_range(t, r),
+                            default=[model['defaults'][field]])
+    parser.add_argument('--days', type=float, default=7, help='simulated days per run (default 7)')
+    parser.add_argument('--scenarios', type=int, default=8, help='simulated pots per config (default 8)')
+    parser.add_argument('--band', type=lambda t: [float(v) for v in t.split(':')], default=[0.75, 0.95],
+                        help='healthy moisture ratios low:high (default .75:.95)')
+    parser.add_argument('--learned', action='store_true', help='size pulses as CONFIG_PLANT_LEARNED_DOSING')
+    parser.add_argument('--limit', type=int, default=0, help='run a seeded random sample of at most this many configs')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--workers', type=int, default=os.cpu_count())
+    parser.add_argument('--json', action='store_true', help='print the front as JSON')
+    args = parser.parse_args()
+
+    # The configs the firmware's config command accepts
+    configs = [dict(zip(CONFIG_FIELDS, values)) for values in itertools.product(*(getattr(args, f) for f in CONFIG_FIELDS))]
+    configs = [c for c in configs if c['low_moisture'] < c['watered_moisture'] <= c['high_moisture']]
+    if args.limit and len(configs) > args.limit:
+        configs = random.Random('%d:limit' % args.seed).sample(configs, args.limit)
+    if not configs:
+        sys.exit('No valid configs in the ranges (need low_moisture < watered_moisture <= high_moisture)')
+
+    job = {'model': model, 'pots': make_pots(args.seed, args.scenarios), 'days': args.days,
+           'band': args.band, 'learned': args.learned}
+    results = [None] * len(configs)
+    start = time.time()
+    if args.workers > 1:
+        with multiprocessing.Pool(args.workers, init_worker, (job,)) as pool:
+            for index, scores in pool.imap_unordered(run_config, enumerate(configs), chunksize=1):
+                results[index] = scores
+    else:
+        init_worker(job)
+        for item in enumerate(configs):
+            index, scores = run_config(item)
+            results[index] = scores
+    elapsed = time.time() - start
+
+    front = sorted(pareto_front(results), key=lambda i: [results[i][o] for o in OBJECTIVES])
+    if args.json:
+        json.dump([dict(configs[i], **results[i]) for i in front], sys.stdout, indent=1)
+        print()
+        return
+
+    runs = len(configs) * args.scenarios
+    print('%d configs x %d pots x %g days, %d workers: %.1f s, %.1f runs/s' %
+          (len(configs), args.scenarios, args.days, args.workers, elapsed, runs / elapsed if elapsed else 0))
+    print('%d Pareto-optimal configs (per pot means):' % len(front))
+    print('%6s %7s %6s %5s %5s %5s %7s %6s | %9s %7s %7s %7s' %
+          ('low', 'watered', 'high', 'poll', 'on', 'off', 'wet', 'dry', 'water_ml', 'out_h', 'pulses', 'mah'))
+    for i in front:
+        c, r = configs[i], results[i]
+        print('%6.2f %7.2f %6.2f %5d %5d %5d %7d %6d | %9.1f %7.2f %7.1f %7.2f' %
+              (c['low_moisture'], c['watered_moisture'], c['high_moisture'], c['polling_period_s'],
+               c['pump_on_period_s'], c['pump_off_period_s'], c['wet_hold_period_s'], c['dry_hold_period_s'],
+               r['water_ml'], r['out_h'], r['pulses'], r['mah']))
+
+
+if __name__ == '__main__':
+    main()
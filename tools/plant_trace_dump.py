@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+"""Print plant sensor traces (main/plant_trace.h records) as CSV, or replay them.
+
+Usage:  mosquitto_sub -t 'pt/+/trace' -N > trace.bin
+        tools/plant_trace_dump.py trace.bin > trace.csv
+        tools/plant_trace_dump.py replay [--learned] trace.bin [golden.txt]
+
+One row per poll: time, plant, state, watering config, the median of each raw
+ADC burst (as the firmware computes it), DHT values, the learned dosing gain
+and pulse, and the raw bursts.
+
+replay runs the trace through main/host_test/plant_replay, which feeds each
+poll's moisture median to the firmware's own state machine (main/plant_state.c),
+along with the time-driven transitions between polls, and prints one line per
+transition.  It exits with status 1 if the state the device recorded at a
+poll differs from the replay's, or if the transitions differ from
+golden.txt, so a trace captured from a known-good build becomes a regression
+check for the state machine:
+    tools/plant_trace_dump.py replay trace.bin > golden.txt
+    tools/plant_trace_dump.py replay trace.bin golden.txt
+Until the replay has seen a plant change state on a reading, it takes the
+plant's state from the trace without checking it, since the time the plant
+entered that state is unknown.  The harness is built with make on first use
+and replays a simulated 90 day, two plant trace (a million polls) in about
+0.35 s.
+
+The replay doses with the gain the device had learned at the last poll, and
+with --learned sizes pulses from it as a CONFIG_PLANT_LEARNED_DOSING build
+does, up to the Kconfig default CONFIG_PLANT_DOSING_MAX_PULSE_S.  A pulse
+the replay started that the device sized differently is a divergence;
+either way the device's pulse is used from the next poll on.
+"""
+
+import difflib
+import os
+import statistics
+import struct
+import subprocess
+import sys
+
+import plant_sweep
+
+MAGIC = 0x5054
+VERSION = 2
+SAMPLES = 9
+RECORD = struct.Struct('<HBBQ8H%dH%dHffBfIB' % (SAMPLES, SAMPLES))
+CONFIG_FIELDS = plant_sweep.CONFIG_FIELDS
+STATES = ['DRYING', 'PUMP_DELAY', 'PUMP_ON', 'WET_HOLD', 'DRY_HOLD', 'ALARM']
+
+
+def records(data):
+    offset = 0
+    while offset + RECORD.size <= len(data):
+        fields = RECORD.unpack_from(data, offset)
+        if fields[0] != MAGIC or fields[1] != VERSION:
+            offset += 1  # Resync, e.g. after a newline added by the subscriber
+            continue
+        offset += RECORD.size
+        _, _, plant, time_us = fields[:4]
+        temperature, humidity, dht_ok, gain, dose_pulse_ms, state = fields[12 + 2 * SAMPLES:]
+        yield {
+            'plant': plant,
+            'time_s': time_us / 1e6,
+            'config': dict(zip(CONFIG_FIELDS, fields[4:12])),
+            'moisture_samples': fields[12:12 + SAMPLES],
+            'level_samples': fields[12 + SAMPLES:12 + 2 * SAMPLES],
+            'temperature': temperature,
+            'humidity': humidity,
+            'dht_ok': dht_ok,
+            'gain': gain,
+            'dose_pulse_s': dose_pulse_ms / 1000.0,
+            'state': state,
+        }
+
+
+def state_name(state):
+    return STATES[state] if state < len(STATES) else str(state)
+
+
+def dump(data):
+    print(','.join(['time_s', 'plant', 'state'] + CONFIG_FIELDS +
+                   ['moisture', 'level', 'temperature', 'humidity', 'dht_ok', 'gain', 'dose_pulse_s',
+                    'moisture_samples', 'level_samples']))
+    for record in records(data):
+        row = ['%.3f' % record['time_s'], str(record['plant']), state_name(record['state'])]
+        row += [str(record['config'][f]) for f in CONFIG_FIELDS]
+        row += [str(statistics.median(record['moisture_samples'])), str(statistics.median(record['level_samples'])),
+                '%.1f' % record['temperature'], '%.1f' % record['humidity'], str(record['dht_ok']),
+                '%.2f' % record['gain'], '%.3f' % record['dose_pulse_s'],
+                ' '.join(map(str, record['moisture_samples'])), ' '.join(map(str, record['level_samples']))]
+        print(','.join(row))
+
+
+def replay(path, golden_path, learned):
+    root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    host_test = os.path.join(root, 'main', 'host_test')
+    subprocess.run(['make', '-s', '-C', host_test, 'build/plant_replay'], check=True)
+    command = [os.path.join(host_test, 'build', 'plant_replay')]
+    if learned:
+        command += ['-l', str(plant_sweep.load_model(root)['dose_max_pulse_s'])]
+    result = subprocess.run(command + [path], stdout=subprocess.PIPE, universal_newlines=True)
+    if result.returncode not in (0, 1):
+        return result.returncode
+    lines = result.stdout.splitlines()
+    for line in lines:
+        print(line)
+
+    failed = result.returncode != 0
+    if golden_path:
+        with open(golden_path) as f:
+            golden = f.read().splitlines()
+        diff = list(difflib.unified_diff(golden, lines, golden_path, 'replay', lineterm=''))
+        if diff:
+            print('\n'.join(diff), file=sys.stderr)
+            failed = True
+    return 1 if failed else 0
+
+
+def main():
+    args = sys.argv[1:]
+    if args and args[0] == 'replay':
+        learned = '--learned' in args
+        args = [a for a in args[1:] if a != '--learned']
+        if len(args) not in (1, 2):
+            sys.exit(__doc__)
+        sys.exit(replay(args[0], args[1] if len(args) > 1 else None, learned))
+
+    with open(args[0], 'rb') if args else sys.stdin.buffer as f:
+        dump(f.read())
+
+
+if __name__ == '__main__':
+    main()